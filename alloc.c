@@ -21,9 +21,28 @@ along with 12to11.  If not, see <https://www.gnu.org/licenses/>.  */
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stddef.h>
 
 #include "compositor.h"
 
+/* Number of objects allocated at once when a slab runs out of free
+   objects.  */
+#define SlabChunkObjects 32
+
+/* Alignment of each object in a slab.  */
+#define SlabAlignment (sizeof (max_align_t))
+
+typedef struct _SlabFreeObject SlabFreeObject;
+
+struct _SlabFreeObject
+{
+  /* The next free object.  */
+  SlabFreeObject *next;
+};
+
+/* List of all slabs that have been used, for printing statistics.  */
+static XLSlab *all_slabs;
+
 void *
 XLMalloc (size_t size)
 {
@@ -106,3 +125,127 @@ XLRealloc (void *ptr, size_t size)
 
   return ptr;
 }
+
+static void
+PrintSlabStatistics (void)
+{
+  XLSlab *slab;
+
+  fprintf (stderr, "Slab allocation statistics:\n");
+
+  for (slab = all_slabs; slab; slab = slab->next)
+    fprintf (stderr, "  %s: %lu allocations served by %lu calls to"
+	     " malloc, %lu objects in use out of %lu\n", slab->name,
+	     slab->n_allocations, slab->n_chunks, slab->n_used,
+	     slab->n_chunks * SlabChunkObjects);
+}
+
+static void
+RegisterSlab (XLSlab *slab)
+{
+  static Bool print_statistics_registered;
+
+  slab->next = all_slabs;
+  all_slabs = slab;
+  slab->registered = True;
+
+  if (!print_statistics_registered
+      && getenv ("DEBUG_SLAB_STATISTICS"))
+    {
+      /* Print statistics once the protocol translator exits.  */
+      atexit (PrintSlabStatistics);
+      print_statistics_registered = True;
+    }
+}
+
+static Bool
+GrowSlab (XLSlab *slab, Bool safe)
+{
+  size_t size;
+  char *chunk;
+  int i;
+  SlabFreeObject *object;
+
+  /* Round the object size up to the alignment of any object.  */
+  size = ((slab->size + SlabAlignment - 1)
+	  / SlabAlignment * SlabAlignment);
+
+  if (safe)
+    chunk = XLSafeMalloc (size * SlabChunkObjects);
+  else
+    chunk = XLMalloc (size * SlabChunkObjects);
+
+  if (!chunk)
+    return False;
+
+  /* Chain each object in the chunk onto the free list.  Chunks are
+     never returned to malloc, as objects in slabs are expected to be
+     allocated again soon.  */
+
+  for (i = SlabChunkObjects - 1; i >= 0; --i)
+    {
+      object = (SlabFreeObject *) (chunk + size * i);
+      object->next = slab->free_list;
+      slab->free_list = object;
+    }
+
+  slab->n_chunks++;
+  return True;
+}
+
+static void *
+SlabAllocate (XLSlab *slab, Bool safe)
+{
+  SlabFreeObject *object;
+
+  if (!slab->registered)
+    RegisterSlab (slab);
+
+  if (!slab->free_list && !GrowSlab (slab, safe))
+    return NULL;
+
+  object = slab->free_list;
+  slab->free_list = object->next;
+  slab->n_allocations++;
+  slab->n_used++;
+
+  return object;
+}
+
+void *
+XLSlabAlloc (XLSlab *slab)
+{
+  return SlabAllocate (slab, False);
+}
+
+void *
+XLSafeSlabAlloc (XLSlab *slab)
+{
+  return SlabAllocate (slab, True);
+}
+
+void *
+XLSlabCalloc (XLSlab *slab)
+{
+  void *ptr;
+
+  ptr = SlabAllocate (slab, False);
+  memset (ptr, 0, slab->size);
+
+  return ptr;
+}
+
+void
+XLSlabFree (XLSlab *slab, void *ptr)
+{
+  SlabFreeObject *object;
+
+  if (!ptr)
+    return;
+
+  /* Put the object back on the free list of the slab.  */
+  object = ptr;
+  object->next = slab->free_list;
+  slab->free_list = object;
+  slab->n_used--;
+}
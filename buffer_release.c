@@ -42,6 +42,10 @@ struct _ReleaseLaterRecord
   ReleaseLaterRecord *next, *last;
 };
 
+/* Slab from which release records are allocated.  */
+static XLSlab release_later_record_slab
+  = XLSlabInitializer (ReleaseLaterRecord);
+
 struct _BufferReleaseHelper
 {
   /* Queue of buffers pending release.  */
@@ -91,7 +95,7 @@ FreeBufferReleaseHelper (BufferReleaseHelper *helper)
       XLReleaseBuffer (last->buffer);
 
       /* Before freeing the record itself.  */
-      XLFree (last);
+      XLSlabFree (&release_later_record_slab, last);
     }
 
   /* Free the helper.  */
@@ -113,7 +117,7 @@ BufferIdleCallback (RenderBuffer buffer, void *data)
   /* Unlink and free the record.  */
   record->next->last = record->last;
   record->last->next = record->next;
-  XLFree (record);
+  XLSlabFree (&release_later_record_slab, record);
 
   /* If there are no more records in the helper, run its
      all-released-callback.  */
@@ -130,7 +134,7 @@ ReleaseBufferWithHelper (BufferReleaseHelper *helper, ExtBuffer *buffer,
 
   render_buffer = XLRenderBufferFromBuffer (buffer);
 
-  record = XLCalloc (1, sizeof *record);
+  record = XLSlabCalloc (&release_later_record_slab);
   record->next = helper->records.next;
   record->last = &helper->records;
   helper->records.next->last = record;
@@ -244,6 +244,11 @@ struct _SharedMemoryAttributes
 
   /* Size of the pool.  */
   size_t pool_size;
+
+  /* Pointer to data the renderer associates with the pool, which is
+     NULL until the renderer sets it.  It is released with
+     free_shm_pool_data once the pool is destroyed or resized.  */
+  void **renderer_data;
 };
 
 struct _DmaBufAttributes
@@ -386,6 +391,17 @@ struct _RenderFuncs
   void (*composite) (RenderBuffer, RenderTarget, Operation, int, int,
 		     int, int, int, int, DrawParams *);
 
+  /* Composite each rectangle in a region from the given buffer onto
+     the given target, in as few drawing requests as possible.  The
+     arguments are: buffer, target, operation, region, source_x,
+     source_y, x, y, params.  Each box in region, translated by
+     source_x and source_y, is a rectangle in the buffer, which is
+     drawn at the same box translated by x and y.  May be NULL, in
+     which case composite is called for each box.  */
+  void (*composite_region) (RenderBuffer, RenderTarget, Operation,
+			    pixman_region32_t *, int, int, int, int,
+			    DrawParams *);
+
   /* Finish rendering, and swap changes in given damage to display.
      May be NULL.  If a callback is passed and a non-NULL key is
      returned, then the rendering will not actually have finished
@@ -449,6 +465,11 @@ struct _RenderFuncs
   /* Cancel the given presentation callback.  */
   void (*cancel_presentation_callback) (PresentCompletionKey);
 
+  /* Send any requests that were deferred until the end of this
+     iteration of the event loop, before the connection to the X
+     server is flushed.  May be NULL.  */
+  void (*flush) (void);
+
   /* Some flags.  NeverAges means targets always preserve contents
      that were previously drawn.  */
   int flags;
@@ -508,6 +529,11 @@ struct _BufferFuncs
   /* Free a buffer created from shared memory.  */
   void (*free_shm_buffer) (RenderBuffer);
 
+  /* Free data stored in the renderer_data field of a shared memory
+     pool.  May be NULL if the renderer never stores anything
+     there.  */
+  void (*free_shm_pool_data) (void *);
+
   /* Free a dma-buf buffer.  */
   void (*free_dmabuf_buffer) (RenderBuffer);
 
@@ -527,6 +553,11 @@ struct _BufferFuncs
      by being copied to an offscreen buffer.  */
   Bool (*can_release_now) (RenderBuffer);
 
+  /* Return whether or not buffers created from dma-bufs of the given
+     DRM format refer to the dma-buf contents directly, instead of a
+     copy of them.  May be NULL if that is true of every format.  */
+  Bool (*is_dmabuf_format_direct) (uint32_t);
+
   /* Run a callback once the buffer contents become idle on the given
      target.  NULL if flags contains ImmediateRelease.  The callback
      is also run when the buffer is destroyed, but not when the target
@@ -561,6 +592,7 @@ extern int renderer_flags;
 
 extern void RegisterStaticRenderer (const char *, RenderFuncs *,
 				    BufferFuncs *);
+extern Visual *PickTrueColorVisual (int *);
 extern void InitRenderers (void);
 
 extern RenderTarget RenderTargetFromWindow (Window, unsigned long);
@@ -578,6 +610,9 @@ extern void RenderFillBoxesWithTransparency (RenderTarget, pixman_box32_t *,
 extern void RenderClearRectangle (RenderTarget, int, int, int, int);
 extern void RenderComposite (RenderBuffer, RenderTarget, Operation, int,
 			     int, int, int, int, int, DrawParams *);
+extern void RenderCompositeRegion (RenderBuffer, RenderTarget, Operation,
+				   pixman_region32_t *, int, int, int, int,
+				   DrawParams *);
 extern RenderCompletionKey RenderFinishRender (RenderTarget,
 					       pixman_region32_t *,
 					       RenderCompletionFunc,
@@ -595,6 +630,7 @@ extern PresentCompletionKey RenderPresentToWindow (RenderTarget, RenderBuffer,
 extern RenderCompletionKey RenderNotifyMsc (RenderTarget, RenderCompletionFunc,
 					    void *);
 extern void RenderCancelPresentationCallback (PresentCompletionKey);
+extern void RenderFlush (void);
 
 extern DrmFormat *RenderGetDrmFormats (int *);
 extern dev_t *RenderGetRenderDevices (int *);
@@ -608,11 +644,13 @@ extern Bool RenderValidateShmParams (uint32_t, uint32_t, uint32_t, int32_t,
 extern RenderBuffer RenderBufferFromSinglePixel (uint32_t, uint32_t, uint32_t,
 						 uint32_t, Bool *);
 extern void RenderFreeShmBuffer (RenderBuffer);
+extern void RenderFreeShmPoolData (void *);
 extern void RenderFreeDmabufBuffer (RenderBuffer);
 extern void RenderFreeSinglePixelBuffer (RenderBuffer);
 extern void RenderUpdateBufferForDamage (RenderBuffer, pixman_region32_t *,
 					 DrawParams *);
 extern Bool RenderCanReleaseNow (RenderBuffer);
+extern Bool RenderIsDmabufFormatDirect (uint32_t);
 extern IdleCallbackKey RenderAddIdleCallback (RenderBuffer, RenderTarget,
 					      BufferIdleFunc, void *);
 extern void RenderCancelIdleCallback (IdleCallbackKey);
@@ -634,12 +672,48 @@ extern void XLRemoveReadFd (ReadFd *);
 
 /* Defined in alloc.c.  */
 
+typedef struct _XLSlab XLSlab;
+
+/* Pool of fixed-size objects of a single type, with its own list of
+   free objects.  Define one statically with XLSlabInitializer.  */
+
+struct _XLSlab
+{
+  /* The name of the type of objects in this slab.  */
+  const char *name;
+
+  /* The size of each object.  */
+  size_t size;
+
+  /* List of free objects.  */
+  void *free_list;
+
+  /* The next slab in the list of all slabs.  */
+  XLSlab *next;
+
+  /* Whether or not this slab is on that list.  */
+  Bool registered;
+
+  /* Number of allocations made from this slab, number of objects
+     currently in use, and number of chunks obtained from malloc.  */
+  unsigned long n_allocations, n_used, n_chunks;
+};
+
+#define XLSlabInitializer(type)					\
+  { #type, (sizeof (type) > sizeof (void *)			\
+	    ? sizeof (type) : sizeof (void *)),			\
+    NULL, NULL, False, 0, 0, 0 }
+
 extern void *XLMalloc (size_t);
 extern void *XLRealloc (void *, size_t);
 extern void *XLSafeMalloc (size_t);
 extern void *XLCalloc (size_t, size_t);
 extern char *XLStrdup (const char *);
 extern void XLFree (void *);
+extern void *XLSlabAlloc (XLSlab *);
+extern void *XLSafeSlabAlloc (XLSlab *);
+extern void *XLSlabCalloc (XLSlab *);
+extern void XLSlabFree (XLSlab *, void *);
 
 /* Defined in fns.c.  */
 
@@ -675,29 +749,31 @@ extern XIDList *XIDListPrepend (XIDList *, XID);
 
 struct _XLAssoc
 {
-  /* Next object in this bucket.  */
-  XLAssoc *next;
-
-  /* Last object in this bucket.  */
-  XLAssoc *prev;
-
-  /* XID of the object.  */
+  /* XID of the object, or None if this slot is empty.  */
   XID x_id;
 
   /* Untyped data.  */
   void *data;
 };
 
-/* Map between XID and untyped data.  Implemented the same way as the
-   old XAssocTable.  */
+/* Map between XID and untyped data.  Implemented as an open
+   addressing hash table that grows as entries are added.  */
 
 struct _XLAssocTable
 {
-  /* Pointer to first pucket in bucket array.  */
-  XLAssoc *buckets;
+  /* Array of slots.  */
+  XLAssoc *slots;
+
+  /* Number of slots, always a power of two, and number of slots in
+     use.  */
+  int size, count;
 
-  /* Table size (number of buckets).  */
-  int size;
+  /* Shift applied to the hash to obtain a slot index.  */
+  int shift;
+
+  /* Data associated with None, if any.  */
+  void *none_data;
+  Bool have_none;
 };
 
 extern XLAssocTable *XLCreateAssocTable (int);
@@ -1790,6 +1866,33 @@ extern Bool HandleErrorForPictureRenderer (XErrorEvent *);
 extern Bool HandleOneXEventForPictureRenderer (XEvent *);
 extern void InitPictureRenderer (void);
 
+/* Defined in pixman_renderer.c.  */
+
+extern void InitPixmanRenderer (void);
+
+/* Defined in pixel_conversion.c.  */
+
+typedef struct _ConversionSource ConversionSource;
+
+struct _ConversionSource
+{
+  /* The start of each plane of the buffer.  */
+  const unsigned char *planes[3];
+
+  /* The stride of each plane.  */
+  size_t strides[3];
+};
+
+extern Bool GetConversionFormatInfo (uint32_t, int *, int *, Bool *);
+extern uint32_t GetConversionFormat (int);
+extern void GetConversionPlaneSize (uint32_t, int, int, int, size_t *,
+				    int *);
+extern Bool GetShmConversionLayout (uint32_t, int32_t, int, size_t[3],
+				    size_t[3], size_t *);
+extern void ConvertPixels (uint32_t, ConversionSource *, int, int,
+			   void *, size_t, int, int);
+extern const char *GetConversionKernelName (void);
+
 #ifdef HaveEglSupport
 
 /* Defined in egl.c.  */
@@ -1823,6 +1926,7 @@ extern void ApplyInverseTransform (int, int, Matrix *,
 				   BufferTransform);
 extern void TransformBox (pixman_box32_t *, BufferTransform, int, int);
 extern BufferTransform InvertTransform (BufferTransform);
+extern void ReverseTransformToBox (DrawParams *, pixman_box32_t *);
 
 /* Defined in wp_viewporter.c.  */
 
@@ -19,6 +19,9 @@ along with 12to11.  If not, see <https://www.gnu.org/licenses/>.  */
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/vfs.h>
+
+#include <linux/magic.h>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -40,13 +43,64 @@ typedef struct _BufferParams BufferParams;
 typedef struct _Buffer Buffer;
 typedef struct _TemporarySetEntry TemporarySetEntry;
 typedef struct _FormatModifierPair FormatModifierPair;
+typedef struct _ImportKey ImportKey;
+typedef struct _CachedImport CachedImport;
 
 enum
   {
     IsUsed	   = 1,
     IsCallbackData = (1 << 2),
+    IsCacheable    = (1 << 3),
   };
 
+/* How long an import that is no longer used by any buffer is kept
+   around, in case the client creates a buffer for the same dmabuf
+   again.  */
+#define ImportIdleTime	MakeTimespec (1, 0)
+
+/* The maximum number of such imports.  */
+#define MaxIdleImports	16
+
+struct _ImportKey
+{
+  /* The identity of the dmabuf backing each plane.  */
+  dev_t devices[4];
+  ino_t inodes[4];
+
+  /* The offset and stride of each plane.  */
+  unsigned int offsets[4], strides[4];
+
+  /* The modifier.  */
+  uint64_t modifier;
+
+  /* The DRM format.  */
+  uint32_t format;
+
+  /* The number of planes, dimensions and flags of the buffer.  */
+  int n_planes, width, height, flags;
+};
+
+struct _CachedImport
+{
+  /* The next and last imports in the cache.  */
+  CachedImport *next, *last;
+
+  /* What was imported.  */
+  ImportKey key;
+
+  /* The RenderBuffer the import created.  */
+  RenderBuffer render_buffer;
+
+  /* The number of buffers using this import.  */
+  int refcount;
+
+  /* Whether or not the import is in the cache at all.  */
+  Bool cached;
+
+  /* When the refcount last dropped to 0.  */
+  struct timespec idle_since;
+};
+
 struct _TemporarySetEntry
 {
   /* These fields mean the same as they do in the args to
@@ -62,6 +116,10 @@ struct _BufferParams
   /* Entries for each plane.  DRI3 only supports up to 4 planes.  */
   TemporarySetEntry entries[4];
 
+  /* The key under which the import will be cached, if IsCacheable is
+     set.  */
+  ImportKey key;
+
   /* The struct wl_resource associated with this object.  */
   struct wl_resource *resource;
 
@@ -80,6 +138,10 @@ struct _Buffer
   /* The RenderBuffer associated with this buffer.  */
   RenderBuffer render_buffer;
 
+  /* The import providing that RenderBuffer, or NULL if this is a
+     fallback buffer.  */
+  CachedImport *import;
+
   /* The wl_resource corresponding to this buffer.  */
   struct wl_resource *resource;
 
@@ -123,6 +185,15 @@ static DrmFormat *supported_formats;
 /* Number of formats.  */
 static int n_drm_formats;
 
+/* List of cached imports, most recently used first.  */
+static CachedImport imports;
+
+/* The number of imports in that list that are not used.  */
+static int n_idle_imports;
+
+/* Timer that evicts imports that have not been used for a while.  */
+static Timer *eviction_timer;
+
 
 
 static void
@@ -264,6 +335,190 @@ Add (struct wl_client *client, struct wl_resource *resource, int32_t fd,
   params->entries[plane_idx].modifier_lo = modifier_lo;
 }
 
+static Bool
+MakeImportKey (DmaBufAttributes *attributes, ImportKey *key)
+{
+  struct stat statb;
+  struct statfs statfsb;
+  int i;
+
+  /* Fill KEY with the identity of the dmabuf described by ATTRIBUTES.
+     Return whether or not that identity is reliable.  Only dmabufs
+     on the dmabuf pseudo file system have an inode of their own; on
+     older kernels they all share one anonymous inode.  The render
+     buffer of an import holds a reference to the dmabuf, so its inode
+     cannot be reused while the import is cached.
+
+     Imports whose renderer copies the contents of the dma-buf are not
+     cached either, since the copy would be out of date once the
+     import is reused.  */
+
+  if (!RenderIsDmabufFormatDirect (attributes->drm_format))
+    return False;
+
+  memset (key, 0, sizeof *key);
+
+  for (i = 0; i < attributes->n_planes; ++i)
+    {
+      if (fstatfs (attributes->fds[i], &statfsb)
+	  || statfsb.f_type != DMA_BUF_MAGIC
+	  || fstat (attributes->fds[i], &statb))
+	return False;
+
+      key->devices[i] = statb.st_dev;
+      key->inodes[i] = statb.st_ino;
+      key->offsets[i] = attributes->offsets[i];
+      key->strides[i] = attributes->strides[i];
+    }
+
+  key->modifier = attributes->modifier;
+  key->format = attributes->drm_format;
+  key->n_planes = attributes->n_planes;
+  key->width = attributes->width;
+  key->height = attributes->height;
+  key->flags = attributes->flags;
+
+  return True;
+}
+
+static void
+UnlinkImport (CachedImport *import)
+{
+  import->last->next = import->next;
+  import->next->last = import->last;
+}
+
+static void
+LinkImport (CachedImport *import)
+{
+  import->next = imports.next;
+  import->last = &imports;
+  imports.next->last = import;
+  imports.next = import;
+}
+
+static void
+FreeImport (CachedImport *import)
+{
+  if (import->cached)
+    UnlinkImport (import);
+
+  RenderFreeDmabufBuffer (import->render_buffer);
+  XLFree (import);
+}
+
+static CachedImport *
+FindImport (ImportKey *key)
+{
+  CachedImport *import;
+
+  for (import = imports.next; import != &imports;
+       import = import->next)
+    {
+      if (!memcmp (&import->key, key, sizeof *key))
+	{
+	  if (!import->refcount)
+	    n_idle_imports--;
+
+	  /* Move the import to the start of the list.  */
+	  UnlinkImport (import);
+	  LinkImport (import);
+
+	  return import;
+	}
+    }
+
+  return NULL;
+}
+
+static CachedImport *
+AddImport (RenderBuffer render_buffer, ImportKey *key)
+{
+  CachedImport *import;
+
+  /* Make an import for RENDER_BUFFER, and cache it under KEY if it is
+     not NULL.  The caller must reference it.  */
+
+  import = XLCalloc (1, sizeof *import);
+  import->render_buffer = render_buffer;
+
+  if (key)
+    {
+      /* Copy the padding too, since keys are compared with
+	 memcmp.  */
+      memcpy (&import->key, key, sizeof *key);
+      import->cached = True;
+      LinkImport (import);
+    }
+
+  return import;
+}
+
+static void
+EvictImports (Timer *timer, void *data, struct timespec time)
+{
+  CachedImport *import, *last;
+
+  /* Free every import that has not been used for ImportIdleTime.  */
+
+  import = imports.next;
+
+  while (import != &imports)
+    {
+      last = import;
+      import = import->next;
+
+      if (!last->refcount
+	  && TimespecCmp (TimespecSub (time, last->idle_since),
+			  ImportIdleTime) >= 0)
+	{
+	  FreeImport (last);
+	  n_idle_imports--;
+	}
+    }
+
+  if (!n_idle_imports)
+    {
+      RemoveTimer (eviction_timer);
+      eviction_timer = NULL;
+    }
+}
+
+static void
+ReleaseImport (CachedImport *import)
+{
+  CachedImport *oldest;
+
+  if (--import->refcount)
+    return;
+
+  if (!import->cached)
+    {
+      /* The import cannot be reused.  */
+      FreeImport (import);
+      return;
+    }
+
+  /* Keep the import around for a while, in case the client creates a
+     buffer for the same dmabuf again.  */
+  import->idle_since = CurrentTimespec ();
+  n_idle_imports++;
+
+  if (n_idle_imports > MaxIdleImports)
+    {
+      /* Evict the least recently used idle import.  */
+      for (oldest = imports.last; oldest->refcount;
+	   oldest = oldest->last)
+	/* Skip imports that are in use.  */;
+
+      FreeImport (oldest);
+      n_idle_imports--;
+    }
+
+  if (!eviction_timer)
+    eviction_timer = AddTimer (EvictImports, NULL, ImportIdleTime);
+}
+
 static void
 DestroyBacking (Buffer *buffer)
 {
@@ -271,8 +526,9 @@ DestroyBacking (Buffer *buffer)
     return;
 
   if (!buffer->is_fallback)
-    /* Free the renderer-specific dmabuf buffer.  */
-    RenderFreeDmabufBuffer (buffer->render_buffer);
+    /* Release the import of the dmabuf, which frees the
+       renderer-specific dmabuf buffer once it is no longer used.  */
+    ReleaseImport (buffer->import);
   else
     /* This is actually a fallback single-pixel buffer.  Destroy it
        instead.  */
@@ -357,7 +613,7 @@ GetBufferFunc (ExtBuffer *buffer)
 }
 
 static Buffer *
-CreateBufferFor (BufferParams *params, RenderBuffer render_buffer,
+CreateBufferFor (BufferParams *params, CachedImport *import,
 		 uint32_t id)
 {
   Buffer *buffer;
@@ -366,9 +622,12 @@ CreateBufferFor (BufferParams *params, RenderBuffer render_buffer,
   buffer = XLSafeMalloc (sizeof *buffer);
   client = wl_resource_get_client (params->resource);
 
+  /* Reference the import.  */
+  import->refcount++;
+
   if (!buffer)
     {
-      RenderFreeDmabufBuffer (render_buffer);
+      ReleaseImport (import);
       zwp_linux_buffer_params_v1_send_failed (params->resource);
 
       return NULL;
@@ -380,14 +639,15 @@ CreateBufferFor (BufferParams *params, RenderBuffer render_buffer,
 
   if (!buffer->resource)
     {
-      RenderFreeDmabufBuffer (render_buffer);
+      ReleaseImport (import);
       XLFree (buffer);
       zwp_linux_buffer_params_v1_send_failed (params->resource);
 
       return NULL;
     }
 
-  buffer->render_buffer = render_buffer;
+  buffer->render_buffer = import->render_buffer;
+  buffer->import = import;
   buffer->width = params->width;
   buffer->height = params->height;
 
@@ -460,8 +720,12 @@ CreateSucceeded (RenderBuffer render_buffer, void *data)
   /* Mark the params object as no longer being callback data.  */
   params->flags &= ~IsCallbackData;
 
-  /* Create the buffer.  */
-  buffer = CreateBufferFor (params, render_buffer, 0);
+  /* Create the buffer, caching the import if possible.  */
+  buffer = CreateBufferFor (params,
+			    AddImport (render_buffer,
+				       (params->flags & IsCacheable
+					? &params->key : NULL)),
+			    0);
 
   /* If buffer is NULL, then the failure message will already have
      been sent.  */
@@ -499,6 +763,8 @@ Create (struct wl_client *client, struct wl_resource *resource, int32_t width,
   int num_buffers, i;
   uint32_t mod_high, mod_low;
   uint32_t all_flags;
+  CachedImport *import;
+  Buffer *buffer;
 
   params = wl_resource_get_user_data (resource);
 
@@ -619,6 +885,29 @@ Create (struct wl_client *client, struct wl_resource *resource, int32_t width,
   params->width = width;
   params->height = height;
 
+  /* If this dmabuf was imported before, reuse that import instead of
+     importing it again.  */
+  if (MakeImportKey (&attributes, &params->key))
+    {
+      import = FindImport (&params->key);
+
+      if (import)
+	{
+	  /* The renderer will not close the fds, so do that here.  */
+	  CloseFdsEarly (params);
+	  buffer = CreateBufferFor (params, import, 0);
+
+	  if (buffer)
+	    zwp_linux_buffer_params_v1_send_created (resource,
+						     buffer->resource);
+
+	  return;
+	}
+
+      /* Otherwise, cache the import once it completes.  */
+      params->flags |= IsCacheable;
+    }
+
   /* Mark params as callback and post asynchronous creation.  This is
      so that the parameters will not be destroyed until one of the
      callback functions are called.  */
@@ -707,6 +996,8 @@ CreateImmed (struct wl_client *client, struct wl_resource *resource, uint32_t id
   uint32_t mod_high, mod_low;
   uint32_t all_flags;
   RenderBuffer buffer;
+  CachedImport *import;
+  Bool cacheable;
 
   params = wl_resource_get_user_data (resource);
 
@@ -830,6 +1121,20 @@ CreateImmed (struct wl_client *client, struct wl_resource *resource, uint32_t id
   params->width = width;
   params->height = height;
 
+  /* If this dmabuf was imported before, reuse that import instead of
+     importing it again.  */
+  cacheable = MakeImportKey (&attributes, &params->key);
+  import = cacheable ? FindImport (&params->key) : NULL;
+
+  if (import)
+    {
+      /* The renderer will not close the fds, so do that here.  */
+      CloseFdsEarly (params);
+      CreateBufferFor (params, import, id);
+
+      return;
+    }
+
   /* Now, try to create the buffer.  Send failed should it actually
      fail.  */
   error = False;
@@ -843,8 +1148,11 @@ CreateImmed (struct wl_client *client, struct wl_resource *resource, uint32_t id
     }
   else
     /* Otherwise, buffer creation was successful.  Create the buffer
-       for the id.  */
-    CreateBufferFor (params, buffer, id);
+       for the id, caching the import if possible.  */
+    CreateBufferFor (params, AddImport (buffer, (cacheable
+						 ? &params->key
+						 : NULL)),
+		     id);
 
   return;
 
@@ -1139,6 +1447,10 @@ XLInitDmabuf (void)
 {
   ssize_t size;
 
+  /* Initialize the import cache.  */
+  imports.next = &imports;
+  imports.last = &imports;
+
   /* First, initialize supported formats.  */
   if (!ReadSupportedFormats ())
     return;
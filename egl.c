@@ -17,10 +17,13 @@ for more details.
 You should have received a copy of the GNU General Public License
 along with 12to11.  If not, see <https://www.gnu.org/licenses/>.  */
 
+#include <errno.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stddef.h>
+#include <unistd.h>
 
 #include <drm_fourcc.h>
 
@@ -207,6 +210,47 @@ struct _CompositeProgram
 
   /* The index of the source_pixel uniform.  */
   GLuint source_color;
+
+  /* The values last given to the source and invert_y uniforms, or -1
+     in last_invert_y if they have not been set yet.  */
+  Matrix last_matrix;
+  GLint last_invert_y;
+};
+
+/* A quad waiting to be drawn.  */
+typedef struct _EglQuad EglQuad;
+
+/* A run of quads drawn with the same state.  */
+typedef struct _EglBatch EglBatch;
+
+struct _EglQuad
+{
+  /* The position and texcoord of each of its six vertices.  */
+  GLfloat vertices[24];
+
+  /* The index of the next quad in the same batch, or -1.  */
+  int next;
+};
+
+struct _EglBatch
+{
+  /* The buffer being drawn.  */
+  EglBuffer *buffer;
+
+  /* The program used to draw it.  */
+  CompositeProgram *program;
+
+  /* The transformation matrix of the buffer.  */
+  Matrix matrix;
+
+  /* Whether or not blending is enabled.  */
+  Bool blend;
+
+  /* The first and last quads in this batch, and their number.  */
+  int first_quad, last_quad, n_quads;
+
+  /* The extents of the quads on the target.  */
+  pixman_box32_t extents;
 };
 
 /* This macro makes column major order easier to reason about for C
@@ -352,6 +396,10 @@ static PFNEGLGETSYNCATTRIBKHRPROC IGetSyncAttrib;
 static PFNEGLWAITSYNCKHRPROC IWaitSync;
 static PFNEGLDUPNATIVEFENCEFDANDROIDPROC IDupNativeFenceFD;
 static PFNEGLSWAPBUFFERSWITHDAMAGEEXTPROC ISwapBuffersWithDamage;
+static PFNGLMAPBUFFERRANGEEXTPROC IMapBufferRange;
+static PFNGLUNMAPBUFFEROESPROC IUnmapBuffer;
+static PFNGLGETPROGRAMBINARYOESPROC IGetProgramBinary;
+static PFNGLPROGRAMBINARYOESPROC IProgramBinary;
 
 /* The EGL display handle.  */
 static EGLDisplay egl_display;
@@ -410,6 +458,73 @@ static CompositeProgram single_pixel_buffer_program;
 /* Whether or not buffer age is supported.  */
 static Bool have_egl_ext_buffer_age;
 
+/* The directory holding cached program binaries, or NULL if program
+   binaries are not cached.  */
+static char *program_cache_directory;
+
+/* Hash of the strings identifying the GL driver.  */
+static uint64_t driver_hash;
+
+/* Header of each cached program binary.  */
+typedef struct _ProgramCacheHeader ProgramCacheHeader;
+
+struct _ProgramCacheHeader
+{
+  /* ProgramCacheMagic.  */
+  uint32_t magic;
+
+  /* The format of the binary.  */
+  uint32_t format;
+
+  /* The key of the binary, to detect collisions.  */
+  uint64_t key;
+
+  /* The length of the binary that follows.  */
+  uint32_t length;
+};
+
+#define ProgramCacheMagic	0x31317431
+#define MaxProgramBinarySize	(16 * 1024 * 1024)
+
+/* Pixel unpack buffer through which shared memory buffers are
+   uploaded, its size, and the offset of its first unused byte.  The
+   buffer is used as a ring: once it is full, its storage is orphaned
+   and uploading restarts at its beginning.  */
+static GLuint upload_buffer;
+static size_t upload_buffer_size, upload_buffer_offset;
+
+/* The initial size of that buffer.  */
+#define UploadBufferSize (4 * 1024 * 1024)
+
+/* Quads accumulated for the current target but not yet drawn, and
+   the batches they are sorted into.  */
+static EglQuad *quads;
+static int n_quads, quads_size;
+static EglBatch *batches;
+static int n_batches, batches_size;
+
+/* Scratch space holding the vertices of those quads in draw order,
+   and the array buffer they are uploaded to.  */
+static GLfloat *batch_vertices;
+static int batch_vertices_size;
+static GLuint batch_buffer;
+
+/* The number of batches searched for one with the same state as a
+   new quad.  */
+#define MaxBatchLookback 16
+
+/* The program in use, whether or not blending is enabled (or -1 if
+   unknown), and the textures bound to GL_TEXTURE_2D and
+   GL_TEXTURE_EXTERNAL_OES.  */
+static GLuint current_program;
+static int current_blend = -1;
+static GLuint bound_textures[2];
+
+/* Whether or not to print the number of quads and draw calls in each
+   frame, and those numbers for the frame being drawn.  */
+static Bool print_draw_calls;
+static unsigned long frame_quads, frame_draw_calls;
+
 /* EGL and GLES 2-based renderer.  */
 
 #define CheckExtension(name)				\
@@ -553,8 +668,47 @@ EglInitFuncs (void)
 static void
 EglInitGlFuncs (void)
 {
+  const char *version;
+
   LoadProcGl (EGLImageTargetTexture2D, "OES", "GL_OES_EGL_image");
 
+  /* Pixel unpack buffers are used to upload shared memory buffers if
+     they are supported, either by GLES 3.0 or by extensions.  */
+  version = (const char *) glGetString (GL_VERSION);
+
+  if (version && !strncmp (version, "OpenGL ES ", 10)
+      && atoi (version + 10) >= 3)
+    {
+      IMapBufferRange
+	= (void *) eglGetProcAddress ("glMapBufferRange");
+      IUnmapBuffer
+	= (void *) eglGetProcAddress ("glUnmapBuffer");
+    }
+  else if (HaveGlExtension ("GL_NV_pixel_buffer_object"))
+    {
+      LoadProcGl (MapBufferRange, "EXT", "GL_EXT_map_buffer_range");
+      LoadProcGl (UnmapBuffer, "OES", "GL_OES_mapbuffer");
+    }
+
+  if (!IMapBufferRange || !IUnmapBuffer)
+    IMapBufferRange = NULL, IUnmapBuffer = NULL;
+
+  /* Program binaries are used to cache linked programs, either from
+     GLES 3.0 or from GL_OES_get_program_binary.  */
+  if (version && !strncmp (version, "OpenGL ES ", 10)
+      && atoi (version + 10) >= 3)
+    {
+      IGetProgramBinary
+	= (void *) eglGetProcAddress ("glGetProgramBinary");
+      IProgramBinary
+	= (void *) eglGetProcAddress ("glProgramBinary");
+    }
+  else
+    {
+      LoadProcGl (GetProgramBinary, "OES", "GL_OES_get_program_binary");
+      LoadProcGl (ProgramBinary, "OES", "GL_OES_get_program_binary");
+    }
+
   /* We treat eglWaitSyncKHR specially, since it only works if the
      server client API also supports GL_OES_EGL_sync.  */
   if (!HaveGlExtension ("GL_OES_EGL_sync"))
@@ -865,32 +1019,320 @@ CheckProgramLink (GLuint program, const char *name)
   abort ();
 }
 
+/* Program binary cache.  Linked programs are saved under
+   program_cache_directory, keyed by a hash of the driver strings and
+   of the shader sources, and loaded instead of being compiled when
+   the compositor next starts.  */
+
+static uint64_t
+HashString (uint64_t hash, const char *string)
+{
+  /* FNV-1a.  The terminating NUL is also hashed, so that different
+     splits of the same characters hash differently.  */
+
+  do
+    {
+      hash ^= (unsigned char) *string;
+      hash *= UINT64_C (0x100000001b3);
+    }
+  while (*string++);
+
+  return hash;
+}
+
 static void
-EglCompileCompositeProgram (CompositeProgram *program,
-			    const char *fragment_shader)
+InitProgramCache (void)
 {
-  GLuint vertex, fragment;
+  const char *base, *home, *strings[4];
+  char *directory;
+  GLint n_formats;
+  int i;
 
-  /* There are different composite programs for different
-     kinds of textures, differing in their fragment shaders.  */
+  if (!IGetProgramBinary || !IProgramBinary)
+    return;
+
+  /* Some drivers export the extension without supporting any binary
+     formats.  */
+  n_formats = 0;
+  glGetIntegerv (GL_NUM_PROGRAM_BINARY_FORMATS_OES, &n_formats);
+
+  if (n_formats <= 0)
+    return;
+
+  base = getenv ("XDG_CACHE_HOME");
+
+  if (base && *base)
+    {
+      directory = XLMalloc (strlen (base) + sizeof "/12to11");
+      sprintf (directory, "%s/12to11", base);
+    }
+  else
+    {
+      home = getenv ("HOME");
+
+      if (!home || !*home)
+	return;
+
+      directory = XLMalloc (strlen (home) + sizeof "/.cache/12to11");
+      sprintf (directory, "%s/.cache", home);
+      mkdir (directory, 0700);
+      strcat (directory, "/12to11");
+    }
+
+  if (mkdir (directory, 0700) && errno != EEXIST)
+    {
+      XLFree (directory);
+      return;
+    }
+
+  program_cache_directory = directory;
+
+  /* Binaries are only valid for the driver that produced them.  */
+  strings[0] = (const char *) glGetString (GL_VENDOR);
+  strings[1] = (const char *) glGetString (GL_RENDERER);
+  strings[2] = (const char *) glGetString (GL_VERSION);
+  strings[3] = (const char *) glGetString (GL_SHADING_LANGUAGE_VERSION);
+  driver_hash = UINT64_C (0xcbf29ce484222325);
+
+  for (i = 0; i < ArrayElements (strings); ++i)
+    driver_hash = HashString (driver_hash, strings[i] ? strings[i] : "");
+}
+
+static char *
+ProgramCachePath (uint64_t key, const char *suffix)
+{
+  char *path;
+
+  path = XLMalloc (strlen (program_cache_directory)
+		   + strlen (suffix) + 18);
+  sprintf (path, "%s/%016" PRIx64 "%s", program_cache_directory,
+	   key, suffix);
+
+  return path;
+}
+
+static GLuint
+LoadCachedProgram (uint64_t key)
+{
+  ProgramCacheHeader header;
+  char *path;
+  FILE *file;
+  void *data;
+  GLuint program;
+  GLint success;
+
+  path = ProgramCachePath (key, "");
+  file = fopen (path, "rb");
+  XLFree (path);
+
+  if (!file)
+    return 0;
+
+  program = 0;
+  data = NULL;
+
+  if (fread (&header, sizeof header, 1, file) != 1
+      || header.magic != ProgramCacheMagic
+      || header.key != key
+      || !header.length
+      || header.length > MaxProgramBinarySize)
+    goto out;
+
+  data = XLMalloc (header.length);
+
+  if (fread (data, header.length, 1, file) != 1)
+    goto out;
+
+  program = glCreateProgram ();
+  IProgramBinary (program, header.format, data, header.length);
+
+  /* The driver rejects binaries it can no longer use, in which case
+     the program is compiled again and the cache entry replaced.  */
+  glGetProgramiv (program, GL_LINK_STATUS, &success);
+
+  if (!success)
+    {
+      glDeleteProgram (program);
+      program = 0;
+    }
+
+ out:
+  XLFree (data);
+  fclose (file);
+  return program;
+}
+
+static void
+StoreCachedProgram (GLuint program, uint64_t key)
+{
+  ProgramCacheHeader header;
+  char *path, *temp;
+  FILE *file;
+  void *data;
+  GLint length;
+  GLenum format;
+  Bool success;
+
+  length = 0;
+  glGetProgramiv (program, GL_PROGRAM_BINARY_LENGTH_OES, &length);
+
+  if (length <= 0 || length > MaxProgramBinarySize)
+    return;
+
+  data = XLMalloc (length);
+  IGetProgramBinary (program, length, &length, &format, data);
+
+  if (length <= 0)
+    {
+      XLFree (data);
+      return;
+    }
+
+  memset (&header, 0, sizeof header);
+  header.magic = ProgramCacheMagic;
+  header.format = format;
+  header.key = key;
+  header.length = length;
+
+  /* Write the binary to a temporary file first, so that other
+     compositors never read a partially written binary.  */
+  path = ProgramCachePath (key, "");
+  temp = XLMalloc (strlen (path) + 32);
+  sprintf (temp, "%s.%ld", path, (long) getpid ());
+  file = fopen (temp, "wb");
+
+  if (file)
+    {
+      success = (fwrite (&header, sizeof header, 1, file) == 1
+		 && fwrite (data, length, 1, file) == 1);
+
+      if (fclose (file) || !success || rename (temp, path))
+	unlink (temp);
+    }
+
+  XLFree (temp);
+  XLFree (path);
+  XLFree (data);
+}
+
+/* Return a linked program made of VERTEX_SOURCE and FRAGMENT_SOURCE,
+   loading it from the program binary cache if possible.  The names
+   are used to report errors.  */
+
+static GLuint
+EglLinkProgram (const char *vertex_source, const char *vertex_name,
+		const char *fragment_source, const char *fragment_name,
+		const char *name)
+{
+  GLuint vertex, fragment, program;
+  uint64_t key;
+
+  key = 0;
+
+  if (program_cache_directory)
+    {
+      key = HashString (HashString (driver_hash, vertex_source),
+			fragment_source);
+      program = LoadCachedProgram (key);
+
+      if (program)
+	return program;
+    }
 
   vertex = glCreateShader (GL_VERTEX_SHADER);
   fragment = glCreateShader (GL_FRAGMENT_SHADER);
 
-  glShaderSource (vertex, 1, &composite_rectangle_vertex_shader,
-		  NULL);
+  glShaderSource (vertex, 1, &vertex_source, NULL);
   glCompileShader (vertex);
-  CheckShaderCompilation (vertex, "compositor vertex shader");
+  CheckShaderCompilation (vertex, vertex_name);
 
-  glShaderSource (fragment, 1, &fragment_shader, NULL);
+  glShaderSource (fragment, 1, &fragment_source, NULL);
   glCompileShader (fragment);
-  CheckShaderCompilation (fragment, "compositor fragment shader");
+  CheckShaderCompilation (fragment, fragment_name);
+
+  program = glCreateProgram ();
+  glAttachShader (program, vertex);
+  glAttachShader (program, fragment);
+  glLinkProgram (program);
+  CheckProgramLink (program, name);
+
+  /* Now delete the shaders.  */
+  glDeleteShader (vertex);
+  glDeleteShader (fragment);
+
+  if (program_cache_directory)
+    StoreCachedProgram (program, key);
+
+  return program;
+}
+
+/* GL state tracking.  The renderer uses a single context, so state
+   set while drawing to one target persists on the others.  */
+
+static void
+UseProgram (GLuint program)
+{
+  if (current_program == program)
+    return;
+
+  glUseProgram (program);
+  current_program = program;
+}
+
+static void
+SetBlend (Bool blend)
+{
+  if (current_blend == blend)
+    return;
+
+  if (blend)
+    glEnable (GL_BLEND);
+  else
+    glDisable (GL_BLEND);
+
+  current_blend = blend;
+}
+
+static void
+BindTexture (GLenum target, GLuint texture)
+{
+  GLuint *bound;
+
+  bound = &bound_textures[target == GL_TEXTURE_EXTERNAL_OES];
+
+  if (*bound == texture)
+    return;
+
+  glBindTexture (target, texture);
+  *bound = texture;
+}
+
+static void
+DeleteTexture (GLuint texture)
+{
+  int i;
 
-  program->program = glCreateProgram ();
-  glAttachShader (program->program, vertex);
-  glAttachShader (program->program, fragment);
-  glLinkProgram (program->program);
-  CheckProgramLink (program->program, "compositor program");
+  glDeleteTextures (1, &texture);
+
+  /* Deleting a bound texture reverts the binding to 0.  */
+  for (i = 0; i < ArrayElements (bound_textures); ++i)
+    {
+      if (bound_textures[i] == texture)
+	bound_textures[i] = 0;
+    }
+}
+
+static void
+EglCompileCompositeProgram (CompositeProgram *program,
+			    const char *fragment_shader)
+{
+  /* There are different composite programs for different
+     kinds of textures, differing in their fragment shaders.  */
+
+  program->program
+    = EglLinkProgram (composite_rectangle_vertex_shader,
+		      "compositor vertex shader", fragment_shader,
+		      "compositor fragment shader", "compositor program");
 
   /* Obtain the indices of the texcoord and pos attributes.  */
   program->texcoord = glGetAttribLocation (program->program,
@@ -906,41 +1348,29 @@ EglCompileCompositeProgram (CompositeProgram *program,
   program->source_color = glGetUniformLocation (program->program,
 						"source_color");
 
-  /* Now delete the shaders.  */
-  glDeleteShader (vertex);
-  glDeleteShader (fragment);
+  /* Only texture unit 0 is used.  */
+  UseProgram (program->program);
+  glUniform1i (program->texture, 0);
+  program->last_invert_y = -1;
 }
 
 static void
 EglCompileShaders (void)
 {
-  GLuint vertex, fragment;
-
-  vertex = glCreateShader (GL_VERTEX_SHADER);
-  fragment = glCreateShader (GL_FRAGMENT_SHADER);
+  /* Find out where linked programs are cached.  */
+  InitProgramCache ();
 
-  glShaderSource (vertex, 1, &clear_rectangle_vertex_shader, NULL);
-  glCompileShader (vertex);
-  CheckShaderCompilation (vertex, "clear_rectangle_vertex_shader");
-
-  glShaderSource (fragment, 1, &clear_rectangle_fragment_shader, NULL);
-  glCompileShader (fragment);
-  CheckShaderCompilation (fragment, "clear_rectangle_fragment_shader");
-
-  clear_rect_program = glCreateProgram ();
-  glAttachShader (clear_rect_program, vertex);
-  glAttachShader (clear_rect_program, fragment);
-  glLinkProgram (clear_rect_program);
-  CheckProgramLink (clear_rect_program, "clear_rect_program");
+  clear_rect_program
+    = EglLinkProgram (clear_rectangle_vertex_shader,
+		      "clear_rectangle_vertex_shader",
+		      clear_rectangle_fragment_shader,
+		      "clear_rectangle_fragment_shader",
+		      "clear_rect_program");
 
   /* Obtain the location of an attribute.  */
   clear_rect_program_pos_attrib
     = glGetAttribLocation (clear_rect_program, "pos");
 
-  /* Now delete the shaders.  */
-  glDeleteShader (vertex);
-  glDeleteShader (fragment);
-
   /* Compile some other programs used for compositing textures.  */
   EglCompileCompositeProgram (&argb_program,
 			      composite_rectangle_fragment_shader_rgba);
@@ -950,10 +1380,14 @@ EglCompileShaders (void)
 			      composite_rectangle_fragment_shader_external);
   EglCompileCompositeProgram (&single_pixel_buffer_program,
 			      composite_rectangle_fragment_shader_single_pixel);
+
+  /* Create the buffer batched quads are uploaded to.  */
+  glGenBuffers (1, &batch_buffer);
 }
 
-/* Forward declaration.  */
+/* Forward declarations.  */
 static void AddRenderFlag (int);
+static void FlushBatches (void);
 
 static Bool
 EglInitDisplay (void)
@@ -1046,6 +1480,9 @@ EglInitDisplay (void)
   /* Now, try to compile the shaders.  */
   EglCompileShaders ();
 
+  if (getenv ("DEBUG_EGL_DRAW_CALLS"))
+    print_draw_calls = True;
+
   return True;
 }
 
@@ -1171,6 +1608,10 @@ DestroyRenderTarget (RenderTarget target)
 
   egl_target = target.pointer;
 
+  /* Draw any quads queued for the target before it goes away.  */
+  if (egl_target == current_target)
+    FlushBatches ();
+
   /* Destroy the EGL surface.  */
   eglDestroySurface (egl_display, egl_target->surface);
 
@@ -1199,6 +1640,9 @@ MakeRenderTargetCurrent (RenderTarget target)
 
   egl_target = target.pointer;
 
+  /* Draw the quads queued for the previous target.  */
+  FlushBatches ();
+
   /* Otherwise, make it current for the context.  */
   if (!eglMakeCurrent (egl_display, egl_target->surface,
 		       egl_target->surface, egl_context))
@@ -1224,6 +1668,9 @@ StartRender (RenderTarget target)
 
   egl_target = target.pointer;
 
+  /* Quads already queued were computed for the old viewport.  */
+  FlushBatches ();
+
   /* Set the viewport.  */
   glViewport (0, 0, egl_target->width,
 	      egl_target->height);
@@ -1243,8 +1690,11 @@ FillBoxesWithTransparency (RenderTarget target, pixman_box32_t *boxes,
 
   egl_target = target.pointer;
 
-  glDisable (GL_BLEND);
-  glUseProgram (clear_rect_program);
+  /* Draw queued quads first, as the boxes may overlap them.  */
+  FlushBatches ();
+
+  SetBlend (False);
+  UseProgram (clear_rect_program);
 
   /* Allocate enough to hold each triangle.  */
   verts = alloca (sizeof *verts * nboxes * 8);
@@ -1398,130 +1848,364 @@ ComputeTransformMatrix (EglBuffer *buffer, DrawParams *params)
 
 static void EnsureTexture (EglBuffer *);
 
+/* Write the two triangles making up a WIDTH by HEIGHT rectangle at X,
+   Y on EGL_TARGET, sampled from SRC_X, SRC_Y in EGL_BUFFER, to
+   VERTICES, which must have space for 24 floats.  Each vertex is
+   written as its position followed by its texcoord.  */
+
 static void
-Composite (RenderBuffer buffer, RenderTarget target,
-	   Operation op, int src_x, int src_y, int x, int y,
-	   int width, int height, DrawParams *params)
+WriteCompositeQuad (EglTarget *egl_target, EglBuffer *egl_buffer,
+		    GLfloat *vertices, int src_x, int src_y, int x,
+		    int y, int width, int height)
 {
-  GLfloat verts[8], texcoord[8];
-  GLfloat x1, x2, y1, y2;
-  EglTarget *egl_target;
-  EglBuffer *egl_buffer;
-  CompositeProgram *program;
-  GLenum tex_target;
+  GLfloat x1, x2, y1, y2, s1, s2, t1, t2;
 
-  egl_target = target.pointer;
-  egl_buffer = buffer.pointer;
+  /* dest rectangle on target.  */
+  x1 = -1.0f + (GLfloat) x / egl_target->width * 2;
+  x2 = -1.0f + (GLfloat) (x + width) / egl_target->width * 2;
+  y1 = -1.0f + ((GLfloat) (egl_target->height - y)
+		/ egl_target->height * 2);
+  y2 = -1.0f + ((GLfloat) (egl_target->height - y - height)
+		/ egl_target->height * 2);
 
-  if (egl_buffer->u.type != SinglePixelBuffer)
-    {
-      /* If no texture was generated, upload the buffer contents
-	 now.  */
-      if (!(egl_buffer->flags & IsTextureGenerated))
-	EnsureTexture (egl_buffer);
+  /* source rectangle on buffer.  */
+  s1 = (GLfloat) src_x / egl_buffer->width;
+  s2 = (GLfloat) (src_x + width) / egl_buffer->width;
+  t1 = (GLfloat) src_y / egl_buffer->height;
+  t2 = (GLfloat) (src_y + height) / egl_buffer->height;
+
+  /* Bottom left, top left, bottom right.  */
+  vertices[0] = x1, vertices[1] = y2;
+  vertices[2] = s1, vertices[3] = t2;
+  vertices[4] = x1, vertices[5] = y1;
+  vertices[6] = s1, vertices[7] = t1;
+  vertices[8] = x2, vertices[9] = y2;
+  vertices[10] = s2, vertices[11] = t2;
+
+  /* Top left, bottom right, top right.  */
+  vertices[12] = x1, vertices[13] = y1;
+  vertices[14] = s1, vertices[15] = t1;
+  vertices[16] = x2, vertices[17] = y2;
+  vertices[18] = s2, vertices[19] = t2;
+  vertices[20] = x2, vertices[21] = y1;
+  vertices[22] = s2, vertices[23] = t1;
+}
+
+/* Fill in the state used to draw EGL_BUFFER with OP and PARAMS in
+   KEY.  */
 
-      /* Get the texturing target.  */
-      tex_target = GetTextureTarget (egl_buffer);
-    }
-  else
-    /* This value is not actually used.  */
-    tex_target = 0;
+static void
+PrepareBatch (EglBuffer *egl_buffer, Operation op, DrawParams *params,
+	      EglBatch *key)
+{
+  key->buffer = egl_buffer;
 
   /* Find the program to use for compositing.  */
-  program = FindProgram (egl_buffer);
+  key->program = FindProgram (egl_buffer);
 
   /* Compute the transformation matrix to use to draw the given
      buffer.  */
   ComputeTransformMatrix (egl_buffer, params);
+  memcpy (key->matrix, egl_buffer->matrix, sizeof key->matrix);
 
-  /* dest rectangle on target.  */
-  x1 = x;
-  y1 = y;
-  x2 = x + width;
-  y2 = y + height;
+  /* Disable blending based on whether or not an alpha channel is
+     present.  */
+  key->blend = (op == OperationOver
+		&& egl_buffer->flags & HasAlpha);
+}
 
-  /* Bottom left.  */
-  verts[0] = -1.0f + x1 / egl_target->width * 2;
-  verts[1] = -1.0f + (egl_target->height - y2) / egl_target->height * 2;
+static Bool
+SameBatchState (EglBatch *batch, EglBatch *key)
+{
+  return (batch->buffer == key->buffer
+	  && batch->program == key->program
+	  && batch->blend == key->blend
+	  && !memcmp (batch->matrix, key->matrix,
+		      sizeof batch->matrix));
+}
 
-  /* Top left.  */
-  verts[2] = -1.0f + x1 / egl_target->width * 2;
-  verts[3] = -1.0f + (egl_target->height - y1) / egl_target->height * 2;
+static Bool
+BoxesIntersect (pixman_box32_t *a, pixman_box32_t *b)
+{
+  return (a->x1 < b->x2 && b->x1 < a->x2
+	  && a->y1 < b->y2 && b->y1 < a->y2);
+}
 
-  /* Bottom right.  */
-  verts[4] = -1.0f + x2 / egl_target->width * 2;
-  verts[5] = -1.0f + (egl_target->height - y2) / egl_target->height * 2;
+/* Queue a quad drawn with the state in KEY, as described in
+   WriteCompositeQuad.  The quad is added to the most recent batch
+   with the same state, unless it overlaps a batch queued after that
+   one, since quads must still be drawn in the order they were
+   queued wherever they overlap.  */
 
-  /* Top right.  */
-  verts[6] = -1.0f + x2 / egl_target->width * 2;
-  verts[7] = -1.0f + (egl_target->height - y1) / egl_target->height * 2;
+static void
+QueueCompositeQuad (EglTarget *egl_target, EglBatch *key, int src_x,
+		    int src_y, int x, int y, int width, int height)
+{
+  pixman_box32_t box;
+  EglBatch *batch;
+  int i, limit;
 
-  /* source rectangle on buffer.  */
-  x1 = src_x;
-  y1 = src_y;
-  x2 = src_x + width;
-  y2 = src_y + height;
-
-  texcoord[0] = x1 / egl_buffer->width;
-  texcoord[1] = y2 / egl_buffer->height;
-  texcoord[2] = x1 / egl_buffer->width;
-  texcoord[3] = y1 / egl_buffer->height;
-  texcoord[4] = x2 / egl_buffer->width;
-  texcoord[5] = y2 / egl_buffer->height;
-  texcoord[6] = x2 / egl_buffer->width;
-  texcoord[7] = y1 / egl_buffer->height;
+  box.x1 = x;
+  box.y1 = y;
+  box.x2 = x + width;
+  box.y2 = y + height;
+  batch = NULL;
 
-  /* Disable blending based on whether or not an alpha channel is
-     present.  */
-  if (op == OperationOver
-      && egl_buffer->flags & HasAlpha)
-    glEnable (GL_BLEND);
+  limit = MAX (0, n_batches - MaxBatchLookback);
+
+  for (i = n_batches - 1; i >= limit; --i)
+    {
+      if (SameBatchState (&batches[i], key))
+	{
+	  batch = &batches[i];
+	  break;
+	}
+
+      if (BoxesIntersect (&batches[i].extents, &box))
+	break;
+    }
+
+  if (!batch)
+    {
+      /* Start a new batch.  */
+      if (n_batches == batches_size)
+	{
+	  batches_size = MAX (16, batches_size * 2);
+	  batches = XLRealloc (batches, sizeof *batches * batches_size);
+	}
+
+      batch = &batches[n_batches++];
+      *batch = *key;
+      batch->first_quad = -1;
+      batch->n_quads = 0;
+      batch->extents = box;
+    }
   else
-    glDisable (GL_BLEND);
+    {
+      batch->extents.x1 = MIN (batch->extents.x1, box.x1);
+      batch->extents.y1 = MIN (batch->extents.y1, box.y1);
+      batch->extents.x2 = MAX (batch->extents.x2, box.x2);
+      batch->extents.y2 = MAX (batch->extents.y2, box.y2);
+    }
 
-  /* Single pixel buffers have no textures.  */
-  if (egl_buffer->u.type != SinglePixelBuffer)
-    {
-      glActiveTexture (GL_TEXTURE0);
-      glBindTexture (tex_target, egl_buffer->texture);
-      glTexParameteri (tex_target, GL_TEXTURE_MIN_FILTER,
-		       GL_NEAREST);
-      glTexParameteri (tex_target, GL_TEXTURE_MAG_FILTER,
-		       GL_NEAREST);
+  if (n_quads == quads_size)
+    {
+      quads_size = MAX (64, quads_size * 2);
+      quads = XLRealloc (quads, sizeof *quads * quads_size);
     }
 
-  glUseProgram (program->program);
+  WriteCompositeQuad (egl_target, key->buffer,
+		      quads[n_quads].vertices, src_x, src_y,
+		      x, y, width, height);
+  quads[n_quads].next = -1;
+
+  /* Link the quad onto the end of the batch.  */
+  if (batch->first_quad == -1)
+    batch->first_quad = n_quads;
+  else
+    quads[batch->last_quad].next = n_quads;
+
+  batch->last_quad = n_quads++;
+  batch->n_quads++;
+}
+
+static void
+SetBatchUniforms (EglBatch *batch)
+{
+  CompositeProgram *program;
+  GLint invert_y;
+
+  program = batch->program;
 
   /* Single pixel buffers have no textures.  */
-  if (egl_buffer->u.type != SinglePixelBuffer)
-    glUniform1i (program->texture, 0);
+  if (batch->buffer->u.type != SinglePixelBuffer)
+    BindTexture (GetTextureTarget (batch->buffer),
+		 batch->buffer->texture);
   else
     /* Attach the source color.  */
     glUniform4f (program->source_color,
-		 egl_buffer->u.single_pixel.r,
-		 egl_buffer->u.single_pixel.g,
-		 egl_buffer->u.single_pixel.b,
-		 egl_buffer->u.single_pixel.a);
+		 batch->buffer->u.single_pixel.r,
+		 batch->buffer->u.single_pixel.g,
+		 batch->buffer->u.single_pixel.b,
+		 batch->buffer->u.single_pixel.a);
+
+  invert_y = (batch->buffer->flags & InvertY) != 0;
+
+  /* Uniforms keep their values in each program, so only send those
+     that changed.  */
+  if (program->last_invert_y == -1
+      || memcmp (program->last_matrix, batch->matrix,
+		 sizeof batch->matrix))
+    {
+      glUniformMatrix3fv (program->source, 1, GL_FALSE,
+			  batch->matrix);
+      memcpy (program->last_matrix, batch->matrix,
+	      sizeof batch->matrix);
+    }
 
-  glUniformMatrix3fv (program->source, 1, GL_FALSE,
-		      egl_buffer->matrix);
-  glUniform1i (program->invert_y, egl_buffer->flags & InvertY);
-  glVertexAttribPointer (program->position, 2, GL_FLOAT,
-			 GL_FALSE, 0, verts);
-  glVertexAttribPointer (program->texcoord, 2, GL_FLOAT,
-			 GL_FALSE, 0, texcoord);
+  if (program->last_invert_y != invert_y)
+    {
+      glUniform1i (program->invert_y, invert_y);
+      program->last_invert_y = invert_y;
+    }
+}
 
-  glEnableVertexAttribArray (program->position);
-  glEnableVertexAttribArray (program->texcoord);
+/* Draw every queued quad to the current target, with one draw call
+   for each batch.  */
 
-  glDrawArrays (GL_TRIANGLE_STRIP, 0, 4);
+static void
+FlushBatches (void)
+{
+  CompositeProgram *program;
+  EglBatch *batch;
+  GLfloat *vertices;
+  int i, quad, first;
+
+  if (!n_batches)
+    return;
+
+  /* Copy the vertices of each batch's quads next to each other, in
+     the order the batches are drawn.  */
+  if (batch_vertices_size < n_quads * 24)
+    {
+      batch_vertices_size = quads_size * 24;
+      batch_vertices = XLRealloc (batch_vertices,
+				  (sizeof *batch_vertices
+				   * batch_vertices_size));
+    }
+
+  vertices = batch_vertices;
+
+  for (i = 0; i < n_batches; ++i)
+    {
+      for (quad = batches[i].first_quad; quad != -1;
+	   quad = quads[quad].next)
+	{
+	  memcpy (vertices, quads[quad].vertices,
+		  sizeof quads[quad].vertices);
+	  vertices += 24;
+	}
+    }
+
+  /* Upload all of them at once.  */
+  glBindBuffer (GL_ARRAY_BUFFER, batch_buffer);
+  glBufferData (GL_ARRAY_BUFFER, sizeof *batch_vertices * n_quads * 24,
+		batch_vertices, GL_STREAM_DRAW);
+
+  program = NULL;
+  first = 0;
+
+  for (i = 0; i < n_batches; ++i)
+    {
+      batch = &batches[i];
+
+      if (batch->program != program)
+	{
+	  if (program)
+	    {
+	      glDisableVertexAttribArray (program->position);
+	      glDisableVertexAttribArray (program->texcoord);
+	    }
+
+	  program = batch->program;
+	  UseProgram (program->program);
+
+	  glVertexAttribPointer (program->position, 2, GL_FLOAT,
+				 GL_FALSE, sizeof (GLfloat) * 4,
+				 (void *) 0);
+	  glVertexAttribPointer (program->texcoord, 2, GL_FLOAT,
+				 GL_FALSE, sizeof (GLfloat) * 4,
+				 (void *) (sizeof (GLfloat) * 2));
+	  glEnableVertexAttribArray (program->position);
+	  glEnableVertexAttribArray (program->texcoord);
+	}
+
+      SetBlend (batch->blend);
+      SetBatchUniforms (batch);
+
+      glDrawArrays (GL_TRIANGLES, first, batch->n_quads * 6);
+      first += batch->n_quads * 6;
+    }
 
   glDisableVertexAttribArray (program->position);
   glDisableVertexAttribArray (program->texcoord);
 
-  /* Single pixel buffers have no textures.  */
-  if (egl_buffer->u.type != SinglePixelBuffer)
-    glBindTexture (tex_target, 0);
+  /* FillBoxesWithTransparency uses client side vertex arrays.  */
+  glBindBuffer (GL_ARRAY_BUFFER, 0);
+
+  frame_quads += n_quads;
+  frame_draw_calls += n_batches;
+  n_quads = 0;
+  n_batches = 0;
+}
+
+/* Draw the queued quads if any of them are drawn from BUFFER.  */
+
+static void
+FlushBatchesFor (EglBuffer *buffer)
+{
+  int i;
+
+  for (i = 0; i < n_batches; ++i)
+    {
+      if (batches[i].buffer == buffer)
+	{
+	  FlushBatches ();
+	  return;
+	}
+    }
+}
+
+static void
+Composite (RenderBuffer buffer, RenderTarget target,
+	   Operation op, int src_x, int src_y, int x, int y,
+	   int width, int height, DrawParams *params)
+{
+  EglBuffer *egl_buffer;
+  EglBatch key;
+
+  egl_buffer = buffer.pointer;
+
+  /* If no texture was generated, upload the buffer contents now.  */
+  if (egl_buffer->u.type != SinglePixelBuffer
+      && !(egl_buffer->flags & IsTextureGenerated))
+    EnsureTexture (egl_buffer);
+
+  PrepareBatch (egl_buffer, op, params, &key);
+  QueueCompositeQuad (target.pointer, &key, src_x, src_y,
+		      x, y, width, height);
+}
+
+static void
+CompositeRegion (RenderBuffer buffer, RenderTarget target,
+		 Operation op, pixman_region32_t *region, int src_x,
+		 int src_y, int x, int y, DrawParams *params)
+{
+  EglBuffer *egl_buffer;
+  pixman_box32_t *boxes;
+  int nboxes, i;
+  EglBatch key;
+
+  egl_buffer = buffer.pointer;
+  boxes = pixman_region32_rectangles (region, &nboxes);
+
+  if (!nboxes)
+    return;
+
+  /* If no texture was generated, upload the buffer contents now.  */
+  if (egl_buffer->u.type != SinglePixelBuffer
+      && !(egl_buffer->flags & IsTextureGenerated))
+    EnsureTexture (egl_buffer);
+
+  PrepareBatch (egl_buffer, op, params, &key);
+
+  /* The boxes of a region never overlap, so they all end up in the
+     same batch.  */
+  for (i = 0; i < nboxes; ++i)
+    QueueCompositeQuad (target.pointer, &key, boxes[i].x1 + src_x,
+			boxes[i].y1 + src_y, boxes[i].x1 + x,
+			boxes[i].y1 + y, boxes[i].x2 - boxes[i].x1,
+			boxes[i].y2 - boxes[i].y1);
 }
 
 static RenderCompletionKey
@@ -1535,6 +2219,16 @@ FinishRender (RenderTarget target, pixman_region32_t *damage,
 
   egl_target = target.pointer;
 
+  /* Draw everything queued for this frame.  */
+  FlushBatches ();
+
+  if (print_draw_calls)
+    fprintf (stderr, "egl: drew %lu quads with %lu draw calls\n",
+	     frame_quads, frame_draw_calls);
+
+  frame_quads = 0;
+  frame_draw_calls = 0;
+
   if (egl_target->flags & IsPixmap)
     glFinish ();
   else if (!ISwapBuffersWithDamage || !damage)
@@ -1698,6 +2392,7 @@ static RenderFuncs egl_render_funcs =
     .fill_boxes_with_transparency = FillBoxesWithTransparency,
     .clear_rectangle = ClearRectangle,
     .composite = Composite,
+    .composite_region = CompositeRegion,
     .finish_render = FinishRender,
     .target_age = TargetAge,
     .import_fd_fence = ImportFdFence,
@@ -2008,9 +2703,12 @@ FreeShmBuffer (RenderBuffer buffer)
 
   egl_buffer = buffer.pointer;
 
+  /* Draw any quads that sample from the buffer.  */
+  FlushBatchesFor (egl_buffer);
+
   /* If a texture is attached, delete it.  */
   if (egl_buffer->flags & IsTextureGenerated)
-    glDeleteTextures (1, &egl_buffer->texture);
+    DeleteTexture (egl_buffer->texture);
 
   XLFree (buffer.pointer);
 }
@@ -2022,9 +2720,12 @@ FreeDmabufBuffer (RenderBuffer buffer)
 
   egl_buffer = buffer.pointer;
 
+  /* Draw any quads that sample from the buffer.  */
+  FlushBatchesFor (egl_buffer);
+
   /* If a texture is attached, delete it.  */
   if (egl_buffer->flags & IsTextureGenerated)
-    glDeleteTextures (1, &egl_buffer->texture);
+    DeleteTexture (egl_buffer->texture);
 
   /* Free the EGL image.  */
   IDestroyImage (egl_display, egl_buffer->u.dmabuf.image);
@@ -2042,6 +2743,9 @@ FreeSinglePixelBuffer (RenderBuffer buffer)
   /* Make sure a texture was not created.  */
   XLAssert (egl_buffer->texture == EGL_NO_TEXTURE);
 
+  /* Draw any quads filled with the buffer's color.  */
+  FlushBatchesFor (egl_buffer);
+
   /* Free the wrapper struct.  */
   XLFree (buffer.pointer);
 }
@@ -2279,22 +2983,155 @@ GetShmParams (EglBuffer *buffer, void **data_ptr, size_t *expected_size)
   *expected_size = (size_t) buffer->u.shm.stride * buffer->height;
 }
 
+static void *
+MapUploadBuffer (size_t size, size_t *offset)
+{
+  /* Return a pointer to SIZE bytes of the pixel unpack buffer, which
+     is bound, and the offset of those bytes in *OFFSET.  Return NULL
+     if the buffer could not be mapped.  */
+
+  if (!upload_buffer)
+    glGenBuffers (1, &upload_buffer);
+
+  glBindBuffer (GL_PIXEL_UNPACK_BUFFER_NV, upload_buffer);
+
+  if (size > upload_buffer_size
+      || upload_buffer_offset + size > upload_buffer_size)
+    {
+      /* Grow the buffer if SIZE does not fit.  */
+      if (!upload_buffer_size)
+	upload_buffer_size = UploadBufferSize;
+
+      while (upload_buffer_size < size)
+	upload_buffer_size *= 2;
+
+      /* Orphan the storage of the buffer, so the driver allocates new
+	 storage instead of waiting for pending uploads to finish.  */
+      glBufferData (GL_PIXEL_UNPACK_BUFFER_NV, upload_buffer_size,
+		    NULL, GL_STREAM_DRAW);
+      upload_buffer_offset = 0;
+    }
+
+  *offset = upload_buffer_offset;
+
+  /* Keep each upload aligned to 16 bytes.  */
+  upload_buffer_offset = (upload_buffer_offset + size + 15) & ~15;
+
+  /* Nothing else uses this part of the buffer, so there is no need to
+     synchronize.  */
+  return IMapBufferRange (GL_PIXEL_UNPACK_BUFFER_NV, *offset, size,
+			  (GL_MAP_WRITE_BIT_EXT
+			   | GL_MAP_INVALIDATE_RANGE_BIT_EXT
+			   | GL_MAP_UNSYNCHRONIZED_BIT_EXT));
+}
+
+static Bool
+StreamShmBuffer (EglBuffer *buffer, GLenum target, pixman_box32_t *boxes,
+		 int nboxes, Bool full)
+{
+  size_t size, offset, row, bytes_per_pixel, expected_size;
+  char *data, *dest;
+  int i, y;
+  GLenum internal_format;
+
+  /* Upload each box in BOXES from BUFFER to its texture, which is
+     bound to TARGET, by copying them into the pixel unpack buffer.
+     The driver then copies the pixel unpack buffer to the texture
+     asynchronously.  If FULL, BOXES must be a single box covering the
+     entire buffer, and the texture is respecified.  Return whether or
+     not the upload succeeded.  */
+
+  if (!IMapBufferRange)
+    return False;
+
+  bytes_per_pixel = buffer->u.shm.format->bpp / 8;
+  size = 0;
+
+  for (i = 0; i < nboxes; ++i)
+    size += ((size_t) (boxes[i].x2 - boxes[i].x1)
+	     * (boxes[i].y2 - boxes[i].y1) * bytes_per_pixel);
+
+  dest = MapUploadBuffer (size, &offset);
+
+  if (!dest)
+    {
+      glBindBuffer (GL_PIXEL_UNPACK_BUFFER_NV, 0);
+      return False;
+    }
+
+  /* Copy the rows of each box into the buffer.  This is the only
+     time the contents of the shared memory buffer are read.  */
+  GetShmParams (buffer, (void **) &data, &expected_size);
+
+  for (i = 0; i < nboxes; ++i)
+    {
+      row = (boxes[i].x2 - boxes[i].x1) * bytes_per_pixel;
+
+      for (y = boxes[i].y1; y < boxes[i].y2; ++y)
+	{
+	  memcpy (dest, (data + (size_t) y * buffer->u.shm.stride
+			 + boxes[i].x1 * bytes_per_pixel), row);
+	  dest += row;
+	}
+    }
+
+  IUnmapBuffer (GL_PIXEL_UNPACK_BUFFER_NV);
+
+  /* Rows in the unpack buffer are tightly packed.  */
+  glPixelStorei (GL_UNPACK_ALIGNMENT, 1);
+
+  internal_format = (buffer->u.shm.format->gl_internalformat
+		     ? buffer->u.shm.format->gl_internalformat
+		     : buffer->u.shm.format->gl_format);
+
+  for (i = 0; i < nboxes; ++i)
+    {
+      if (full)
+	glTexImage2D (target, 0, internal_format, buffer->width,
+		      buffer->height, 0, buffer->u.shm.format->gl_format,
+		      buffer->u.shm.format->gl_type,
+		      (void *) (uintptr_t) offset);
+      else
+	glTexSubImage2D (target, 0, boxes[i].x1, boxes[i].y1,
+			 boxes[i].x2 - boxes[i].x1,
+			 boxes[i].y2 - boxes[i].y1,
+			 buffer->u.shm.format->gl_format,
+			 buffer->u.shm.format->gl_type,
+			 (void *) (uintptr_t) offset);
+
+      offset += ((size_t) (boxes[i].x2 - boxes[i].x1)
+		 * (boxes[i].y2 - boxes[i].y1) * bytes_per_pixel);
+    }
+
+  glPixelStorei (GL_UNPACK_ALIGNMENT, 4);
+  glBindBuffer (GL_PIXEL_UNPACK_BUFFER_NV, 0);
+  return True;
+}
+
 static void
 UpdateTexture (EglBuffer *buffer)
 {
+  pixman_box32_t box;
   GLenum target;
   void *data_ptr;
   size_t expected_data_size;
 
+  /* Queued quads must sample the old contents of the texture.  */
+  FlushBatchesFor (buffer);
+
   /* Get the appropriate target for the texture.  */
   target = GetTextureTarget (buffer);
 
   /* Bind the target to the texture.  */
-  glBindTexture (target, buffer->texture);
+  BindTexture (target, buffer->texture);
 
-  /* Set the wrapping mode to CLAMP_TO_EDGE.  */
+  /* Set the wrapping mode to CLAMP_TO_EDGE, and the filters to
+     GL_NEAREST.  These are kept by the texture, so they need not be
+     set each time it is drawn.  */
   glTexParameteri (target, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
   glTexParameteri (target, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexParameteri (target, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri (target, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 
   switch (buffer->u.type)
     {
@@ -2304,6 +3141,19 @@ UpdateTexture (EglBuffer *buffer)
       break;
 
     case ShmBuffer:
+      /* Try to upload the buffer through the pixel unpack buffer
+	 first.  */
+      box.x1 = 0;
+      box.y1 = 0;
+      box.x2 = buffer->width;
+      box.y2 = buffer->height;
+
+      if (StreamShmBuffer (buffer, target, &box, 1, True))
+	{
+	  buffer->flags |= CanRelease;
+	  break;
+	}
+
       /* This is much more complicated... First, set the row length to
 	 the stride.  */
       glPixelStorei (GL_UNPACK_ROW_LENGTH_EXT,
@@ -2333,50 +3183,53 @@ UpdateTexture (EglBuffer *buffer)
     default:
       break;
     }
-
-  /* Bind the target to nothing.  */
-  glBindTexture (target, 0);
 }
 
-static void
-ReverseTransformToBox (DrawParams *params, pixman_box32_t *box)
+static int
+MakeUploadBands (EglBuffer *buffer, pixman_region32_t *damage,
+		 DrawParams *params, pixman_box32_t *bands)
 {
-  double x_factor, y_factor;
+  pixman_region32_t region;
+  pixman_box32_t *boxes;
+  int nboxes, i, nbands;
 
-  if (!params)
-    return;
+  /* Place the boxes in DAMAGE, transformed into buffer coordinates,
+     into BANDS, which must be large enough to hold all of them, and
+     return the number of bands.  Each band spans every box of the
+     damage that shares the same rows, so that it can be uploaded
+     with a single call.  */
 
-  /* Apply the inverse of PARAMS to BOX, for use in damage
-     tracking.  */
+  boxes = pixman_region32_rectangles (damage, &nboxes);
 
-  if (params->flags & ScaleSet)
+  for (i = 0; i < nboxes; ++i)
     {
-      box->x1 = floor (box->x1 / params->scale);
-      box->y1 = floor (box->y1 / params->scale);
-      box->x2 = ceil (box->x2 / params->scale);
-      box->y2 = ceil (box->y2 / params->scale);
-    }
+      /* Get a copy of the box.  */
+      bands[i] = boxes[i];
 
-  if (params->flags & OffsetSet)
-    {
-      /* Since the offset can be a fractional value, also try to
-	 include as much as possible in the box.  */
-      box->x1 = floor (box->x1 + params->off_x);
-      box->y1 = floor (box->y1 + params->off_y);
-      box->x2 = ceil (box->x2 + params->off_x);
-      box->y2 = ceil (box->y2 + params->off_y);
+      /* Transform the box according to any transforms.  */
+      ReverseTransformToBox (params, &bands[i]);
     }
 
-  if (params->flags & StretchSet)
-    {
-      x_factor = params->crop_width / params->stretch_width;
-      y_factor = params->crop_height / params->stretch_height;
+  /* Clip the boxes to the buffer, and sort them into bands.  */
+  pixman_region32_init_rects (&region, bands, nboxes);
+  pixman_region32_intersect_rect (&region, &region, 0, 0,
+				  buffer->width, buffer->height);
+  boxes = pixman_region32_rectangles (&region, &nboxes);
+  nbands = 0;
 
-      box->x1 = floor (box->x1 * x_factor);
-      box->y1 = floor (box->y1 * y_factor);
-      box->x2 = ceil (box->x2 * x_factor);
-      box->y2 = ceil (box->y2 * y_factor);
+  for (i = 0; i < nboxes; ++i)
+    {
+      if (nbands && bands[nbands - 1].y1 == boxes[i].y1
+	  && bands[nbands - 1].y2 == boxes[i].y2)
+	/* This box is part of the last band.  */
+	bands[nbands - 1].x2 = MAX (bands[nbands - 1].x2,
+				    boxes[i].x2);
+      else
+	bands[nbands++] = boxes[i];
     }
+
+  pixman_region32_fini (&region);
+  return nbands;
 }
 
 static void
@@ -2384,50 +3237,50 @@ UpdateShmBufferIncrementally (EglBuffer *buffer, pixman_region32_t *damage,
 			      DrawParams *params)
 {
   GLenum target;
-  pixman_box32_t *boxes, box;
-  int nboxes, i, width, height;
+  pixman_box32_t *bands, box;
+  int nbands, i, width, height;
   void *data_ptr;
   size_t expected_data_size;
 
-  /* Obtain the rectangles that are part of the damage.  */
-  boxes = pixman_region32_rectangles (damage, &nboxes);
+  /* Obtain the bands of the damage in buffer coordinates.  */
+  bands = alloca (sizeof *bands
+		  * MAX (1, pixman_region32_n_rects (damage)));
+  nbands = MakeUploadBands (buffer, damage, params, bands);
 
-  if (!nboxes)
-    return;
+  if (!nbands)
+    {
+      /* The damage lies outside the buffer, so nothing has to be
+	 copied.  */
+      buffer->flags |= CanRelease;
+      return;
+    }
 
-  /* Compute the expected data size and data pointer of the buffer.
-     This is only valid until the next time ResizePool is called.  */
-  GetShmParams (buffer, &data_ptr, &expected_data_size);
+  /* Queued quads must sample the old contents of the texture.  */
+  FlushBatchesFor (buffer);
 
   /* Get the texturing target.  */
   target = GetTextureTarget (buffer);
 
   /* Bind the target to the texture.  */
-  glBindTexture (target, buffer->texture);
+  BindTexture (target, buffer->texture);
+
+  /* Try to upload the bands through the pixel unpack buffer.  */
+  if (StreamShmBuffer (buffer, target, bands, nbands, False))
+    goto done;
+
+  /* Compute the expected data size and data pointer of the buffer.
+     This is only valid until the next time ResizePool is called.  */
+  GetShmParams (buffer, &data_ptr, &expected_data_size);
 
   /* And copy from the shm data to the texture according to
      the damage.  */
-  for (i = 0; i < nboxes; ++i)
+  for (i = 0; i < nbands; ++i)
     {
-      /* Get a copy of the box.  */
-      box = boxes[i];
-
-      /* Transform the box according to any transforms.  */
-      ReverseTransformToBox (params, &box);
-
-      /* Clip the box X and Y to 0, 0.  */
-      box.x1 = MIN (box.y1, 0);
-      box.y1 = MIN (box.y1, 0);
-
-      /* These computations are correct, since box->x2/box->y2 are
-	 actually 1 pixel outside the last pixel in the box.  */
-      width = MIN (box.x2, buffer->width) - box.x1;
-      height = MIN (box.y2, buffer->height) - box.y1;
-
-      if (width <= 0 || height <= 0)
-	/* The box is effectively empty because it straddles one of
-	   the corners of the buffer, or is outside of the buffer.  */
-	continue;
+      /* Get a copy of the band, which is already clipped to the
+	 buffer.  */
+      box = bands[i];
+      width = box.x2 - box.x1;
+      height = box.y2 - box.y1;
 
       /* First, set the length of a single row.  */
       glPixelStorei (GL_UNPACK_ROW_LENGTH_EXT,
@@ -2450,9 +3303,7 @@ UpdateShmBufferIncrementally (EglBuffer *buffer, pixman_region32_t *damage,
   glPixelStorei (GL_UNPACK_SKIP_PIXELS_EXT, 0);
   glPixelStorei (GL_UNPACK_SKIP_ROWS_EXT, 0);
 
-  /* Unbind from the texturing target.  */
-  glBindTexture (target, 0);
-
+ done:
   /* The buffer's been copied to the texture.  It can now be
      released.  */
   buffer->flags |= CanRelease;
@@ -20,6 +20,7 @@ along with 12to11.  If not, see <https://www.gnu.org/licenses/>.  */
 #include <sys/fcntl.h>
 
 #include <stdio.h>
+#include <string.h>
 
 #include "compositor.h"
 
@@ -39,10 +40,32 @@ struct _Fence
   /* The number of references to this fence.  Incremented by
      FenceRetain, decremented by FenceRelease.  */
   int refcount;
+
+  /* Whether or not the fence was given to the X server since it was
+     last reset, which means it might still be triggered.  */
+  Bool pending;
 };
 
-Fence *
-GetFence (void)
+/* Fences that are not in use and have been reset, so they can be
+   handed out again by GetFence without allocating a new fence.  */
+static Fence **free_fences;
+
+/* The number of fences in that array, and the number of fences it
+   can hold.  */
+static int n_free_fences, free_fences_size;
+
+/* The smallest number of free fences since the last time the free
+   fences were trimmed.  */
+static int min_free_fences;
+
+/* Timer used to free fences that have not been used for a while.  */
+static Timer *trim_timer;
+
+/* How often free fences are trimmed.  */
+#define FenceTrimInterval	MakeTimespec (5, 0)
+
+static Fence *
+AllocateFence (void)
 {
   Fence *fence;
   int fd;
@@ -79,6 +102,67 @@ GetFence (void)
   xcb_dri3_fence_from_fd (compositor.conn, drawable,
 			  fence->fence_id, 0, fd);
 
+  return fence;
+}
+
+static void
+DestroyFence (Fence *fence)
+{
+  /* Unmap the fence.  */
+  xshmfence_unmap_shm (fence->fence);
+
+  /* Destroy the fence.  */
+  XSyncDestroyFence (compositor.display, fence->fence_id);
+
+  /* Free the fence.  */
+  XLFree (fence);
+}
+
+static void
+TrimFreeFences (Timer *timer, void *data, struct timespec time)
+{
+  /* Free each fence that stayed unused since the last time this
+     timer fired.  The most recently released fences are at the end
+     of the array and are kept.  */
+
+  while (min_free_fences)
+    {
+      DestroyFence (free_fences[0]);
+      memmove (free_fences, free_fences + 1,
+	       sizeof *free_fences * --n_free_fences);
+      min_free_fences--;
+    }
+
+  min_free_fences = n_free_fences;
+
+  if (!n_free_fences)
+    {
+      /* Nothing is left to trim.  */
+      RemoveTimer (trim_timer);
+      trim_timer = NULL;
+
+      XLFree (free_fences);
+      free_fences = NULL;
+      free_fences_size = 0;
+    }
+}
+
+Fence *
+GetFence (void)
+{
+  Fence *fence;
+
+  if (n_free_fences)
+    {
+      /* Reuse the most recently released fence.  */
+      fence = free_fences[--n_free_fences];
+
+      if (n_free_fences < min_free_fences)
+	min_free_fences = n_free_fences;
+    }
+  else
+    fence = AllocateFence ();
+
   /* Retain the fence.  */
   FenceRetain (fence);
 
@@ -94,6 +178,7 @@ FenceAwait (Fence *fence)
 
   /* Reset the fence.  */
   xshmfence_reset (fence->fence);
+  fence->pending = False;
 }
 
 void
@@ -102,14 +187,38 @@ FenceRelease (Fence *fence)
   if (--fence->refcount)
     return;
 
-  /* Unmap the fence.  */
-  xshmfence_unmap_shm (fence->fence);
+  if (fence->pending)
+    {
+      if (!xshmfence_query (fence->fence))
+	{
+	  /* The X server might still trigger this fence, so it
+	     cannot be reused.  */
+	  DestroyFence (fence);
+	  return;
+	}
+
+      /* The fence has been triggered; reset it.  */
+      xshmfence_reset (fence->fence);
+      fence->pending = False;
+    }
 
-  /* Destroy the fence.  */
-  XSyncDestroyFence (compositor.display, fence->fence_id);
+  /* Put the fence on the list of free fences.  */
+  if (n_free_fences == free_fences_size)
+    {
+      free_fences_size = MAX (8, free_fences_size * 2);
+      free_fences = XLRealloc (free_fences,
+			       sizeof *free_fences * free_fences_size);
+    }
 
-  /* Free the fence.  */
-  XLFree (fence);
+  free_fences[n_free_fences++] = fence;
+
+  if (!trim_timer)
+    {
+      /* Start trimming free fences.  */
+      min_free_fences = n_free_fences;
+      trim_timer = AddTimer (TrimFreeFences, NULL,
+			     FenceTrimInterval);
+    }
 }
 
 void
@@ -121,5 +230,8 @@ FenceRetain (Fence *fence)
 XSyncFence
 FenceToXFence (Fence *fence)
 {
+  /* The X server may trigger the fence once it is given this
+     ID.  */
+  fence->pending = True;
   return fence->fence_id;
 }
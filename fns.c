@@ -57,6 +57,9 @@ struct _Busfault
   int height;
 };
 
+/* Slab from which list elements are allocated.  */
+static XLSlab list_slab = XLSlabInitializer (XLList);
+
 /* Events that are being selected for on the root window.  */
 static RootWindowSelection root_window_events;
 
@@ -80,7 +83,7 @@ XLListFree (XLList *list, void (*item_func) (void *))
 
       if (item_func)
 	item_func (last->data);
-      XLFree (last);
+      XLSlabFree (&list_slab, last);
     }
 }
 
@@ -98,7 +101,7 @@ XLListRemove (XLList *list, void *data)
       if (tem->data == data)
 	{
 	  *last = tem->next;
-	  XLFree (tem);
+	  XLSlabFree (&list_slab, tem);
 	}
       else
 	last = &tem->next;
@@ -112,7 +115,7 @@ XLListPrepend (XLList *list, void *data)
 {
   XLList *tem;
 
-  tem = XLMalloc (sizeof *tem);
+  tem = XLSlabAlloc (&list_slab);
   tem->data = data;
   tem->next = list;
 
@@ -176,116 +179,145 @@ XIDListPrepend (XIDList *list, XID resource)
 }
 
 
-/* Hash tables between XIDs and arbitrary data.  */
+/* Hash tables between XIDs and arbitrary data.  The tables use open
+   addressing with linear probing, and are grown once they become
+   three quarters full.  A slot whose XID is None is empty, so None
+   itself is kept outside the slot array.  */
+
+static unsigned int
+HashXID (XLAssocTable *table, XID x_id)
+{
+  /* Fibonacci hashing.  XIDs allocated to a single client differ only
+     in their low bits, which this spreads across the whole table.  */
+  return ((uint32_t) x_id * 2654435769u) >> table->shift;
+}
+
+static void
+AllocateAssocSlots (XLAssocTable *table, int size)
+{
+  int shift;
+
+  /* SIZE must be a power of two.  */
+  XLAssert (!(size & (size - 1)));
+
+  for (shift = 32; (1 << (32 - shift)) < size; --shift)
+    ;
+
+  table->slots = XLCalloc (size, sizeof *table->slots);
+  table->size = size;
+  table->shift = shift;
+}
 
 XLAssocTable *
 XLCreateAssocTable (int size)
 {
   XLAssocTable *table;
-  XLAssoc *buckets;
+  int n_slots;
 
-  table = XLMalloc (sizeof *table);
-  buckets = XLCalloc (size, sizeof *buckets);
+  table = XLCalloc (1, sizeof *table);
 
-  table->buckets = buckets;
-  table->size = size;
+  /* Round SIZE up to a power of two.  */
+  n_slots = 8;
 
-  while (--size >= 0)
-    {
-      /* Initialize each bucket with the sentinel node. */
-      buckets->prev = buckets;
-      buckets->next = buckets;
-      buckets++;
-    }
+  while (n_slots < size)
+    n_slots <<= 1;
 
+  AllocateAssocSlots (table, n_slots);
   return table;
 }
 
 static void
-Insque (XLAssoc *velem, XLAssoc *vprev)
+GrowAssocTable (XLAssocTable *table)
 {
-  XLAssoc *elem, *prev, *next;
+  XLAssoc *old_slots;
+  int old_size, i;
+  unsigned int mask, hash;
 
-  elem = velem;
-  prev = vprev;
-  next = prev->next;
+  old_slots = table->slots;
+  old_size = table->size;
 
-  prev->next = elem;
-  if (next)
-    next->prev = elem;
-  elem->next = next;
-  elem->prev = prev;
-}
+  AllocateAssocSlots (table, old_size * 2);
+  mask = table->size - 1;
 
-static void
-Remque (XLAssoc *velem)
-{
-  XLAssoc *elem, *prev, *next;
+  /* Reinsert each entry into the new slot array.  */
+
+  for (i = 0; i < old_size; ++i)
+    {
+      if (old_slots[i].x_id == None)
+	continue;
+
+      hash = HashXID (table, old_slots[i].x_id);
 
-  elem = velem;
-  next = elem->next;
-  prev = elem->prev;
+      while (table->slots[hash].x_id != None)
+	hash = (hash + 1) & mask;
 
-  if (next)
-    next->prev = prev;
+      table->slots[hash] = old_slots[i];
+    }
 
-  if (prev)
-    prev->next = next;
+  XLFree (old_slots);
 }
 
 void
 XLMakeAssoc (XLAssocTable *table, XID x_id, void *data)
 {
-  int hash;
-  XLAssoc *bucket, *entry, *new_entry;
-
-  hash = x_id % table->size;
-  bucket = &table->buckets[hash];
-  entry = bucket->next;
+  unsigned int hash, mask;
 
-  if (entry != bucket)
+  if (x_id == None)
     {
-      /* Bucket isn't empty, start searching.  */
+      table->none_data = data;
+      table->have_none = True;
+      return;
+    }
 
-      for (; entry != bucket; entry = entry->next)
-	{
-	  if (entry->x_id == x_id)
-	    {
-	      entry->data = data;
-	      return;
-	    }
+  mask = table->size - 1;
+  hash = HashXID (table, x_id);
 
-	  if (entry->x_id > x_id)
-	    break;
+  for (; table->slots[hash].x_id != None; hash = (hash + 1) & mask)
+    {
+      if (table->slots[hash].x_id == x_id)
+	{
+	  /* Replace the existing association.  */
+	  table->slots[hash].data = data;
+	  return;
 	}
     }
 
-  /* Insert new_entry immediately before entry.  */
+  if ((table->count + 1) * 4 > table->size * 3)
+    {
+      /* The table would become too full; grow it and find the new
+	 empty slot.  */
+      GrowAssocTable (table);
+
+      mask = table->size - 1;
+      hash = HashXID (table, x_id);
 
-  new_entry = XLMalloc (sizeof *new_entry);
-  new_entry->x_id = x_id;
-  new_entry->data = data;
+      while (table->slots[hash].x_id != None)
+	hash = (hash + 1) & mask;
+    }
 
-  Insque (new_entry, entry->prev);
+  table->slots[hash].x_id = x_id;
+  table->slots[hash].data = data;
+  table->count++;
 }
 
 void *
 XLLookUpAssoc (XLAssocTable *table, XID x_id)
 {
-  int hash;
-  XLAssoc *bucket, *entry;
+  unsigned int hash, mask;
 
-  hash = x_id % table->size;
-  bucket = &table->buckets[hash];
-  entry = bucket->next;
+  if (x_id == None)
+    return table->have_none ? table->none_data : NULL;
 
-  for (; entry != bucket; entry = entry->next)
-    {
-      if (entry->x_id == x_id)
-	return entry->data;
+  mask = table->size - 1;
+  hash = HashXID (table, x_id);
 
-      if (entry->x_id > x_id)
-	return NULL;
+  /* The table is never full, so this always reaches an empty
+     slot.  */
+
+  for (; table->slots[hash].x_id != None; hash = (hash + 1) & mask)
+    {
+      if (table->slots[hash].x_id == x_id)
+	return table->slots[hash].data;
     }
 
   return NULL;
@@ -294,46 +326,61 @@ XLLookUpAssoc (XLAssocTable *table, XID x_id)
 void
 XLDeleteAssoc (XLAssocTable *table, XID x_id)
 {
-  int hash;
-  XLAssoc *bucket, *entry;
+  unsigned int hash, mask, next, home;
 
-  hash = x_id % table->size;
-  bucket = &table->buckets[hash];
-  entry = bucket->next;
-
-  for (; entry != bucket; entry = entry->next)
+  if (x_id == None)
     {
-      if (entry->x_id == x_id)
-	{
-	  Remque (entry);
-	  XLFree (entry);
-	  return;
-	}
+      table->none_data = NULL;
+      table->have_none = False;
+      return;
+    }
 
-      if (entry->x_id > x_id)
+  mask = table->size - 1;
+  hash = HashXID (table, x_id);
+
+  while (table->slots[hash].x_id != x_id)
+    {
+      if (table->slots[hash].x_id == None)
+	/* X_ID is not present.  */
 	return;
+
+      hash = (hash + 1) & mask;
     }
-}
 
-void
-XLDestroyAssocTable (XLAssocTable *table)
-{
-  int i;
-  XLAssoc *bucket, *entry, *entry_next;
+  /* Instead of leaving a tombstone, move back each following entry
+     in the same cluster whose home slot does not lie cyclically
+     within (hash, next], so that lookups never have to probe past
+     deleted entries.  */
+
+  next = hash;
 
-  for (i = 0; i < table->size; i++)
+  while (True)
     {
-      bucket = &table->buckets[i];
+      next = (next + 1) & mask;
 
-      for (entry = bucket->next; entry != bucket;
-	   entry = entry_next)
-	{
-	  entry_next = entry->next;
-	  XLFree (entry);
-	}
+      if (table->slots[next].x_id == None)
+	break;
+
+      home = HashXID (table, table->slots[next].x_id);
+
+      if (hash <= next
+	  ? (hash < home && home <= next)
+	  : (hash < home || home <= next))
+	continue;
+
+      table->slots[hash] = table->slots[next];
+      hash = next;
     }
 
-  XLFree (table->buckets);
+  table->slots[hash].x_id = None;
+  table->slots[hash].data = NULL;
+  table->count--;
+}
+
+void
+XLDestroyAssocTable (XLAssocTable *table)
+{
+  XLFree (table->slots);
   XLFree (table);
 }
 
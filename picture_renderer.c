@@ -18,11 +18,17 @@ You should have received a copy of the GNU General Public License
 along with 12to11.  If not, see <https://www.gnu.org/licenses/>.  */
 
 #include <alloca.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <unistd.h>
 
 #include <sys/fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include <linux/dma-buf.h>
 #include <drm_fourcc.h>
 
 #include "compositor.h"
@@ -36,6 +42,7 @@ along with 12to11.  If not, see <https://www.gnu.org/licenses/>.  */
 #include <X11/extensions/Xpresent.h>
 #include <X11/extensions/Xfixes.h>
 #include <X11/extensions/shape.h>
+#include <X11/extensions/XShm.h>
 
 typedef struct _DrmFormatInfo DrmFormatInfo;
 typedef struct _DmaBufRecord DmaBufRecord;
@@ -44,8 +51,10 @@ typedef struct _DrmModifierName DrmModifierName;
 typedef struct _BackBuffer BackBuffer;
 
 typedef struct _PictureBuffer PictureBuffer;
+typedef struct _DerivedPicture DerivedPicture;
 typedef struct _PictureTarget PictureTarget;
 typedef struct _PresentRecord PresentRecord;
+typedef struct _ShmSegment ShmSegment;
 
 typedef struct _BufferActivityRecord BufferActivityRecord;
 typedef struct _IdleCallback IdleCallback;
@@ -82,7 +91,7 @@ struct _PresentRecord
 };
 
 /* Structure describing buffer activity.  It is linked onto 3 (!!!)
-   lists.  */
+   lists, and a hash table.  */
 
 struct _BufferActivityRecord
 {
@@ -100,6 +109,10 @@ struct _BufferActivityRecord
 
   /* The backlinks to the three lists.  */
   BufferActivityRecord *buffer_last, *target_last, *global_last;
+
+  /* The next record in the same bucket of the activity hash
+     table.  */
+  BufferActivityRecord *hash_next;
 };
 
 struct _IdleCallback
@@ -122,12 +135,38 @@ struct _IdleCallback
   BufferIdleFunc function;
 };
 
+struct _ShmSegment
+{
+  /* The MIT-SHM segment attached for a shared memory pool.  Every
+     buffer created from the pool is a pixmap created from this
+     segment.  */
+  xcb_shm_seg_t seg;
+};
+
 enum
   {
-    CanPresent = 1,
-    IsOpaque   = (1 << 1),
+    CanPresent        = 1,
+    IsOpaque          = (1 << 1),
+    NeedsConversion   = (1 << 2),
+    ContentsConverted = (1 << 3),
+    CanRelease        = (1 << 4),
+    CopyContents      = (1 << 5),
+    PendingIdle       = (1 << 6),
   };
 
+/* The maximum number of transformed pictures kept for each
+   buffer.  */
+#define MaxDerivedPictures 4
+
+struct _DerivedPicture
+{
+  /* The picture.  */
+  Picture picture;
+
+  /* The draw params whose transform is set on the picture.  */
+  DrawParams params;
+};
+
 struct _PictureBuffer
 {
   /* The XID of the picture.  */
@@ -145,8 +184,16 @@ struct _PictureBuffer
   /* The width and height of the buffer.  */
   short width, height;
 
-  /* The last draw params associated with the picture.  */
-  DrawParams params;
+  /* The picture format of the picture.  */
+  XRenderPictFormat *format;
+
+  /* Pictures of the same pixmap with a transform applied, most
+     recently used first.  picture itself always has the identity
+     transform.  */
+  DerivedPicture derived[MaxDerivedPictures];
+
+  /* The number of those pictures.  */
+  int n_derived;
 
   /* List of release records.  */
   PresentRecord pending;
@@ -156,12 +203,35 @@ struct _PictureBuffer
 
   /* Ongoing buffer activity.  */
   BufferActivityRecord activity;
+
+  /* If the buffer is in a format the X server cannot use, the format
+     of its contents, which are converted into the pixmap upon
+     damage.  */
+  uint32_t conversion_format;
+
+  /* If it is also a shared memory buffer, the pool data, offset and
+     stride of those contents.  */
+  void **shm_data;
+  int32_t shm_offset, shm_stride;
+
+  /* Otherwise, the planes of the mapped dmabuf...  */
+  ConversionSource dmabuf_source;
+
+  /* ...and the mappings and file descriptors backing them.  */
+  void *dmabuf_maps[3];
+  size_t dmabuf_map_sizes[3];
+  int dmabuf_fds[3], n_dmabuf_planes;
+
+  /* The next buffer in the list of buffers whose idle callbacks are
+     run upon the next flush.  */
+  PictureBuffer *idle_next;
 };
 
 enum
   {
     JustPresented  = 1,
     NoPresentation = 2,
+    Resizing       = 4,
   };
 
 /* Structure describing presentation callback.  The callback is run
@@ -202,6 +272,14 @@ struct _BackBuffer
 
   /* The age of this back buffer.  0 means it is fresh.  */
   unsigned int age;
+
+  /* The width and height of the pixmap, which can be larger than the
+     target while it is being resized.  */
+  int width, height;
+
+  /* Whether or not this buffer has been in the back buffer pool since
+     the last time the pool was trimmed.  */
+  Bool stale;
 };
 
 enum
@@ -218,6 +296,34 @@ enum
 #define SetBufferBusy(buffer)	((buffer)->picture |= BufferBusy)
 #define ClearBufferBusy(buffer)	((buffer)->picture &= ~BufferBusy)
 
+/* Whether or not using the buffer means waiting for an idle
+   notification that has not yet arrived.  */
+#define IsBufferStalled(buffer)					\
+  (((buffer)->picture & BufferSync) && !((buffer)->pixmap & BufferSync))
+
+/* The maximum number of back buffers that can be attached to a
+   target.  */
+#define MaxBackBuffers 4
+
+/* The number of times a target must wait for a back buffer to be
+   released before another back buffer is added in automatic mode.  */
+#define StallsBeforeGrowth 3
+
+/* While a target is being resized, the size of its back buffers is
+   rounded up to a multiple of this, so that they can be reused across
+   several steps of the resize.  */
+#define BackBufferGranularity 64
+
+/* The size of a target must stay the same for this long before the
+   resize is considered finished and back buffers of the exact size
+   are created again.  */
+#define ResizeSettleTime	MakeTimespec (0, 500000000)
+
+/* The maximum number of back buffers kept for reuse, and how often
+   back buffers that were not reused are freed.  */
+#define MaxPooledBackBuffers	8
+#define BackBufferPoolInterval	MakeTimespec (2, 0)
+
 struct _PictureTarget
 {
   /* The next frame number.  */
@@ -232,8 +338,8 @@ struct _PictureTarget
   /* The GC used to swap back buffers  */
   GC gc;
 
-  /* Two back buffers.  */
-  BackBuffer *back_buffers[2];
+  /* Up to MaxBackBuffers back buffers.  */
+  BackBuffer *back_buffers[MaxBackBuffers];
 
   /* Structure used to allocate the amount of pixmap allocated on
      behalf of a client.  */
@@ -254,6 +360,14 @@ struct _PictureTarget
   /* The index of the current back buffer.  */
   int current_back_buffer;
 
+  /* The number of back buffers that may be used, and the number of
+     times a back buffer had to be waited for since the last time that
+     number changed.  */
+  int n_back_buffers, stalls;
+
+  /* The last time the size of this target changed.  */
+  struct timespec resize_time;
+
   /* List of release records.  */
   PresentRecord pending;
 
@@ -318,6 +432,10 @@ struct _DmaBufRecord
   /* The next and last pending buffers in this list.  */
   DmaBufRecord *next, *last;
 
+  /* The id of the round trip event after which the buffer is known to
+     have been created.  */
+  uint64_t id;
+
   /* The depth of the pixmap.  */
   int depth;
 
@@ -346,6 +464,55 @@ static ShmFormat default_formats[] =
     { WL_SHM_FORMAT_XRGB8888 },
   };
 
+/* Whether or not the contents of shm buffers in the formats above
+   are copied into a pixmap owned by the compositor, instead of being
+   used directly.  */
+static Bool copy_shm_buffers;
+
+/* List of all supported shm formats, which are the formats above and
+   those converted to them by pixel_conversion.c.  */
+static ShmFormat *shm_formats;
+
+/* Number of formats in that list.  */
+static int num_shm_formats;
+
+/* The byte order of converted pixels, which are stored as 32 bit
+   words on this machine.  */
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define HostByteOrder MSBFirst
+#else
+#define HostByteOrder LSBFirst
+#endif
+
+/* The maximum number of rectangles of damage to convert separately.
+   Past this, the extents of the damage are converted instead.  */
+#define MaxConversionBoxes 16
+
+/* Whether or not the X server supports the MIT-SHM extension.  If
+   it does not, which is usually the case with remote displays, every
+   shm buffer is copied, and uploaded with XPutImage.  */
+static Bool have_mit_shm;
+
+/* Buffer through which converted buffer contents are uploaded.  With
+   MIT-SHM, it is a shared memory segment described by
+   conversion_shminfo.  */
+static char *conversion_data;
+static XShmSegmentInfo conversion_shminfo;
+
+/* Size of that buffer.  */
+static size_t conversion_size;
+
+/* Serial of the last request that read from that segment.  */
+static unsigned long conversion_last_put;
+
+/* GCs used to upload converted contents to pixmaps of depth 24 and
+   32.  */
+static GC conversion_gcs[2];
+
+/* List of buffers whose contents were copied, and which have idle
+   callbacks that should be run upon the next flush.  */
+static PictureBuffer *idle_buffers;
+
 /* List of all supported DRM formats.  */
 static DrmFormatInfo all_formats[] =
   {
@@ -414,6 +581,15 @@ static DrmFormatInfo all_formats[] =
     },
   };
 
+/* DRM formats whose buffers are mapped and converted by the CPU
+   instead of being imported through DRI3.  Only linear buffers can
+   be read that way.  */
+static uint32_t converted_drm_formats[] =
+  {
+    DRM_FORMAT_NV12,
+    DRM_FORMAT_YUV420,
+  };
+
 /* Array of all known DRM modifier names.  */
 static DrmModifierName known_modifiers[] =
   {
@@ -430,8 +606,29 @@ static int n_drm_formats;
 /* List of buffers that are still pending asynchronous creation.  */
 static DmaBufRecord pending_success;
 
-/* The id of the next round trip event.  */
-static uint64_t next_roundtrip_id;
+/* The id of the last round trip event sent to find out whether or
+   not buffers were created, and the id of the event that will be sent
+   at the end of this iteration of the event loop, or 0.  */
+static uint64_t last_dma_buf_id, pending_dma_buf_id;
+
+/* The id of the last buffer release message, and the id of the
+   message that will be sent at the end of this iteration of the event
+   loop, or 0.  */
+static uint64_t last_roundtrip_id, pending_roundtrip_id;
+
+/* Counters used to print statistics about buffer release messages if
+   DEBUG_ROUNDTRIP_STATISTICS is set.  */
+static struct
+{
+  /* The number of buffers used in each frame, summed.  */
+  unsigned long buffer_uses;
+
+  /* The number of frames in which buffers were used.  */
+  unsigned long frames;
+
+  /* The number of buffer release messages sent.  */
+  unsigned long messages;
+} roundtrip_statistics;
 
 /* A window used to receive round trip events.  */
 static Window round_trip_window;
@@ -451,9 +648,23 @@ static uint32_t present_serial;
 /* The major opcode of the presentation extension.  */
 static int present_opcode;
 
-/* Ongoing buffer activity.  */
+/* Ongoing buffer activity, in order of increasing roundtrip ID.  */
 static BufferActivityRecord all_activity;
 
+/* Hash table of ongoing buffer activity, keyed by buffer and target.
+   activity_buckets holds 1 << (64 - activity_hash_shift) buckets.  */
+static BufferActivityRecord **activity_buckets;
+static int activity_hash_shift;
+
+/* The number of records in that hash table.  */
+static int n_activity_records;
+
+/* Slabs from which activity and presentation records are
+   allocated.  */
+static XLSlab activity_record_slab
+  = XLSlabInitializer (BufferActivityRecord);
+static XLSlab present_record_slab = XLSlabInitializer (PresentRecord);
+
 /* List of all presentations that have not yet been completed.  */
 static PresentCompletionCallback all_completion_callbacks;
 
@@ -463,6 +674,24 @@ static dev_t *render_devices;
 /* The number of device nodes.  */
 static int num_render_devices;
 
+/* Clip rectangles used by CompositeRegion, and the number of
+   rectangles allocated.  */
+static XRectangle *clip_rectangles;
+static int clip_rectangles_size;
+
+/* The number of back buffers each target starts with, and whether or
+   not more are added up to MaxBackBuffers when presentation stalls.  */
+static int default_back_buffers;
+static Bool auto_back_buffers;
+
+/* Back buffers that are no longer attached to any target, most
+   recently released last, and the number of such buffers.  */
+static BackBuffer *pooled_back_buffers[MaxPooledBackBuffers];
+static int n_pooled_back_buffers;
+
+/* Timer used to free pooled back buffers that are not reused.  */
+static Timer *back_buffer_pool_timer;
+
 /* XRender, DRI3 and XPresent-based renderer.  A RenderTarget is just
    a Picture.  Here is a rough explanation of how the buffer release
    machinery works.
@@ -509,11 +738,33 @@ static int num_render_devices;
 
 
 
+static void
+PrintRoundtripStatistics (void)
+{
+  fprintf (stderr, "Buffer activity statistics: %lu buffer uses in"
+	   " %lu frames tracked by %lu roundtrip messages\n",
+	   roundtrip_statistics.buffer_uses,
+	   roundtrip_statistics.frames, roundtrip_statistics.messages);
+}
+
 static uint64_t
+GetRoundtripId (void)
+{
+  /* Return the ID of the roundtrip message that will be sent at the
+     end of this iteration of the event loop, so that buffer activity
+     from every frame drawn until then can share one message.  */
+
+  if (!pending_roundtrip_id)
+    pending_roundtrip_id = ++last_roundtrip_id;
+
+  return pending_roundtrip_id;
+}
+
+static void
 SendRoundtripMessage (void)
 {
   XEvent event;
-  static uint64_t id;
+  uint64_t id;
 
   /* Send a message to the X server with a monotonically increasing
      counter.  This is necessary because the connection to the X
@@ -521,9 +772,16 @@ SendRoundtripMessage (void)
      tells us that the X server has finished processing all requests
      that access the buffer.  */
 
+  if (!pending_roundtrip_id)
+    /* No buffer activity is waiting for a message.  */
+    return;
+
+  id = pending_roundtrip_id;
+  pending_roundtrip_id = 0;
+  roundtrip_statistics.messages++;
+
   memset (&event, 0, sizeof event);
 
-  id += 1;
   event.xclient.type = ClientMessage;
   event.xclient.window = round_trip_window;
   event.xclient.message_type = _XL_BUFFER_RELEASE;
@@ -534,7 +792,52 @@ SendRoundtripMessage (void)
 
   XSendEvent (compositor.display, round_trip_window, False,
 	      NoEventMask, &event);
-  return id;
+}
+
+static BufferActivityRecord **
+ActivityBucket (PictureBuffer *buffer, PictureTarget *target)
+{
+  uint64_t key;
+
+  /* Combine both pointers and use Fibonacci hashing to find the
+     bucket.  */
+  key = (uintptr_t) buffer * 31 + (uintptr_t) target;
+  key *= UINT64_C (11400714819323198485);
+
+  return &activity_buckets[key >> activity_hash_shift];
+}
+
+static void
+GrowActivityBuckets (void)
+{
+  BufferActivityRecord **old_buckets, *record, *next, **bucket;
+  int old_size, i;
+
+  old_buckets = activity_buckets;
+  old_size = (old_buckets ? 1 << (64 - activity_hash_shift) : 0);
+
+  /* Start with 64 buckets, and double that number each time.  */
+  activity_hash_shift = (old_buckets ? activity_hash_shift - 1 : 58);
+  activity_buckets
+    = XLCalloc (1 << (64 - activity_hash_shift),
+		sizeof *activity_buckets);
+
+  /* Move every record into the new buckets.  */
+  for (i = 0; i < old_size; ++i)
+    {
+      record = old_buckets[i];
+
+      while (record)
+	{
+	  next = record->hash_next;
+	  bucket = ActivityBucket (record->buffer, record->target);
+	  record->hash_next = *bucket;
+	  *bucket = record;
+	  record = next;
+	}
+    }
+
+  XLFree (old_buckets);
 }
 
 /* Find an existing buffer activity record matching the given buffer
@@ -545,66 +848,97 @@ FindBufferActivityRecord (PictureBuffer *buffer, PictureTarget *target)
 {
   BufferActivityRecord *record;
 
-  /* Look through the global activity list for a record matching
-     the given values.  */
-  record = all_activity.global_next;
-  while (record != &all_activity)
+  if (!activity_buckets)
+    return NULL;
+
+  /* Look through the bucket for a record matching the given
+     values.  */
+  record = *ActivityBucket (buffer, target);
+
+  while (record)
     {
       if (record->buffer == buffer
 	  && record->target == target)
 	return record;
 
-      record = record->global_next;
+      record = record->hash_next;
     }
 
   return NULL;
 }
 
+static void
+AppendActivityRecord (BufferActivityRecord *record)
+{
+  /* Link the record onto the end of the global list, which keeps it
+     sorted by roundtrip ID, as IDs only increase.  */
+  record->global_next = &all_activity;
+  record->global_last = all_activity.global_last;
+  all_activity.global_last->global_next = record;
+  all_activity.global_last = record;
+}
+
 /* Record buffer activity involving the given buffer and target.  */
 
 static void
 RecordBufferActivity (PictureBuffer *buffer, PictureTarget *target,
 		      uint64_t roundtrip_id)
 {
-  BufferActivityRecord *record;
+  BufferActivityRecord *record, **bucket;
 
   /* Try to find an existing record.  */
   record = FindBufferActivityRecord (buffer, target);
 
   if (!record)
     {
-      record = XLMalloc (sizeof *record);
+      record = XLSlabAlloc (&activity_record_slab);
 
       /* Buffer activity is actually linked on 3 different lists:
 
-	 - a global list, which is used to actually look up buffer
-           activity in response to events.  A list is faster than a
-           hash table, as there is not much activity going on at any
-           given time.
+	 - a global list, sorted by roundtrip ID, which is used to
+           find completed buffer activity in response to events.
 
 	 - a buffer list, which is used to remove buffer activity on
            buffer destruction.
 
 	 - a target list, which is used to remove buffer activity on
-           target destruction.  */
+           target destruction.
+
+	 It is also placed in a hash table, which is used to find the
+	 existing record for a buffer and target.  */
       record->buffer_next = buffer->activity.buffer_next;
       record->buffer_last = &buffer->activity;
       record->target_next = target->activity.target_next;
       record->target_last = &target->activity;
-      record->global_next = all_activity.global_next;
-      record->global_last = &all_activity;
       buffer->activity.buffer_next->buffer_last = record;
       buffer->activity.buffer_next = record;
       target->activity.target_next->target_last = record;
       target->activity.target_next = record;
-      all_activity.global_next->global_last = record;
-      all_activity.global_next = record;
 
       /* Set the appropriate values.  */
       record->buffer = buffer;
       record->target = target;
+
+      /* Insert the record into the hash table, growing it once there
+	 are more records than buckets.  */
+      if (!activity_buckets
+	  || n_activity_records >= 1 << (64 - activity_hash_shift))
+	GrowActivityBuckets ();
+
+      bucket = ActivityBucket (buffer, target);
+      record->hash_next = *bucket;
+      *bucket = record;
+      n_activity_records++;
+    }
+  else
+    {
+      /* Move the record to the end of the global list, as it now
+	 has the newest roundtrip ID.  */
+      record->global_last->global_next = record->global_next;
+      record->global_next->global_last = record->global_last;
     }
 
+  AppendActivityRecord (record);
   record->id = roundtrip_id;
 }
 
@@ -674,6 +1008,17 @@ MaybeRunIdleCallbacks (PictureBuffer *buffer, PictureTarget *target)
 static void
 UnlinkActivityRecord (BufferActivityRecord *record)
 {
+  BufferActivityRecord **bucket;
+
+  /* Remove the record from its hash bucket.  */
+  bucket = ActivityBucket (record->buffer, record->target);
+
+  while (*bucket != record)
+    bucket = &(*bucket)->hash_next;
+
+  *bucket = record->hash_next;
+  n_activity_records--;
+
   record->buffer_last->buffer_next = record->buffer_next;
   record->buffer_next->buffer_last = record->buffer_last;
   record->target_last->target_next = record->target_next;
@@ -688,35 +1033,31 @@ UnlinkActivityRecord (BufferActivityRecord *record)
 static void
 HandleActivityEvent (uint64_t counter)
 {
-  BufferActivityRecord *record, *last;
+  BufferActivityRecord *record;
 
-  /* Look through the global activity list for a record matching
-     counter.  */
+  /* The global activity list is sorted by roundtrip ID, so the
+     records completed by this event are at its start.  */
   record = all_activity.global_next;
-  while (record != &all_activity)
+  while (record != &all_activity && record->id <= counter)
     {
-      last = record;
-      record = record->global_next;
+      /* Remove the record.  Then, run any callbacks pertaining to it.
+	 This code mandates that there only be a single activity
+	 record for each buffer-target combination on the global list
+	 at any given time.  */
+      UnlinkActivityRecord (record);
+      MaybeRunIdleCallbacks (record->buffer, record->target);
 
-      if (last->id == counter)
-	{
-	  /* Remove the record.  Then, run any callbacks pertaining to
-	     it.  This code mandates that there only be a single
-	     activity record for each buffer-target combination on the
-	     global list at any given time.  */
-	  UnlinkActivityRecord (last);
-	  MaybeRunIdleCallbacks (last->buffer, last->target);
-
-	  /* Free the record.  */
-	  XLFree (last);
-	}
+      /* Free the record.  */
+      XLSlabFree (&activity_record_slab, record);
+
+      record = all_activity.global_next;
     }
 }
 
 
 
 static void
-FreeBackBuffer (PictureTarget *target, BackBuffer *buffer)
+DestroyBackBuffer (BackBuffer *buffer)
 {
   XRenderFreePicture (compositor.display, (buffer->picture
 					   & ~BufferSync
@@ -724,7 +1065,84 @@ FreeBackBuffer (PictureTarget *target, BackBuffer *buffer)
   XFreePixmap (compositor.display, (buffer->pixmap
 				    & ~BufferSync));
   FenceRelease (buffer->idle_fence);
+  XLFree (buffer);
+}
+
+static void
+TrimBackBufferPool (Timer *timer, void *data, struct timespec time)
+{
+  int i, j;
+
+  /* Free each pooled back buffer that was not reused since the last
+     time this timer fired, and mark the rest as stale.  */
+
+  for (i = 0, j = 0; i < n_pooled_back_buffers; ++i)
+    {
+      if (pooled_back_buffers[i]->stale)
+	DestroyBackBuffer (pooled_back_buffers[i]);
+      else
+	{
+	  pooled_back_buffers[i]->stale = True;
+	  pooled_back_buffers[j++] = pooled_back_buffers[i];
+	}
+    }
+
+  n_pooled_back_buffers = j;
+
+  if (!n_pooled_back_buffers)
+    {
+      /* Nothing is left to trim.  */
+      RemoveTimer (back_buffer_pool_timer);
+      back_buffer_pool_timer = NULL;
+    }
+}
+
+static void
+PoolBackBuffer (BackBuffer *buffer)
+{
+  if (n_pooled_back_buffers == MaxPooledBackBuffers)
+    {
+      /* Free the least recently released buffer to make space.  */
+      DestroyBackBuffer (pooled_back_buffers[0]);
+      memmove (pooled_back_buffers, pooled_back_buffers + 1,
+	       sizeof *pooled_back_buffers * --n_pooled_back_buffers);
+    }
+
+  buffer->stale = False;
+  pooled_back_buffers[n_pooled_back_buffers++] = buffer;
+
+  if (!back_buffer_pool_timer)
+    back_buffer_pool_timer = AddTimer (TrimBackBufferPool, NULL,
+				       BackBufferPoolInterval);
+}
+
+static BackBuffer *
+TakePooledBackBuffer (int width, int height)
+{
+  BackBuffer *buffer;
+  int i;
+
+  /* Look for the most recently released buffer of the given size.  */
+
+  for (i = n_pooled_back_buffers - 1; i >= 0; --i)
+    {
+      buffer = pooled_back_buffers[i];
+
+      if (buffer->width == width && buffer->height == height)
+	{
+	  memmove (pooled_back_buffers + i, pooled_back_buffers + i + 1,
+		   sizeof *pooled_back_buffers
+		   * (--n_pooled_back_buffers - i));
+	  return buffer;
+	}
+    }
+
+  return NULL;
+}
 
+static void
+FreeBackBuffer (PictureTarget *target, BackBuffer *buffer)
+{
   /* Subtract the amount of pixels allocated from the target.  */
   if (target->client
       && IntSubtractWrapv (target->client->n_pixels,
@@ -733,7 +1151,15 @@ FreeBackBuffer (PictureTarget *target, BackBuffer *buffer)
     /* Handle overflow by just setting n_pixels to 0.  */
     target->client->n_pixels = 0;
 
-  XLFree (buffer);
+  if (IsBufferBusy (buffer))
+    /* The X server still uses the buffer, and its idle notification
+       can only be handled while it is attached to this target.  */
+    DestroyBackBuffer (buffer);
+  else
+    /* Otherwise, keep it around for another target or size.  If an
+       idle notification is still pending, the fence is waited for
+       once it is reused.  */
+    PoolBackBuffer (buffer);
 }
 
 static void
@@ -745,36 +1171,64 @@ FreeBackBuffers (PictureTarget *target)
     {
       if (target->back_buffers[i])
 	FreeBackBuffer (target, target->back_buffers[i]);
+
+      target->back_buffers[i] = NULL;
     }
 
   /* Also clear target->picture if it is a window target.  */
   if (target->window)
     target->picture = None;
 
-  target->back_buffers[0] = NULL;
-  target->back_buffers[1] = NULL;
   target->current_back_buffer = -1;
 }
 
+static int
+BackBufferSize (PictureTarget *target, int size)
+{
+  /* Return the size of a back buffer for a target of the given width
+     or height.  */
+
+  if (!(target->flags & Resizing))
+    return size;
+
+  return ((size + BackBufferGranularity - 1)
+	  & ~(BackBufferGranularity - 1));
+}
+
 static BackBuffer *
 CreateBackBuffer (PictureTarget *target)
 {
   BackBuffer *buffer;
   XRenderPictureAttributes attrs;
   Window root_window;
+  int width, height;
+
+  width = BackBufferSize (target, target->width);
+  height = BackBufferSize (target, target->height);
 
-  /* Create a single back buffer.  */
-  root_window = DefaultRootWindow (compositor.display);
-  buffer = XLMalloc (sizeof *buffer);
+  /* Try to reuse a back buffer of the same size.  */
+  buffer = TakePooledBackBuffer (width, height);
+
+  if (!buffer)
+    {
+      /* Create a single back buffer.  */
+      root_window = DefaultRootWindow (compositor.display);
+      buffer = XLMalloc (sizeof *buffer);
+
+      buffer->pixmap
+	= XCreatePixmap (compositor.display, root_window,
+			 width, height, compositor.n_planes);
+      buffer->picture
+	= XRenderCreatePicture (compositor.display, buffer->pixmap,
+				compositor.argb_format, 0, &attrs);
+      buffer->idle_fence = GetFence ();
+      buffer->present_serial = 0;
+      buffer->width = width;
+      buffer->height = height;
+    }
 
-  buffer->pixmap
-    = XCreatePixmap (compositor.display, root_window,
-		     target->width, target->height,
-		     compositor.n_planes);
-  buffer->picture
-    = XRenderCreatePicture (compositor.display, buffer->pixmap,
-			    compositor.argb_format, 0, &attrs);
-  buffer->idle_fence = GetFence ();
+  /* The buffer is fresh.  */
+  buffer->age = 0;
 
   /* The target is no longer freshly presented.  */
   target->flags &= ~JustPresented;
@@ -782,8 +1236,7 @@ CreateBackBuffer (PictureTarget *target)
   /* Calculate how many pixels would be allocated and add it to the
      target data.  */
 
-  if (IntMultiplyWrapv (target->width, target->height,
-			&buffer->n_pixels))
+  if (IntMultiplyWrapv (width, height, &buffer->n_pixels))
     buffer->n_pixels = UINT64_MAX;
 
   if (target->client
@@ -817,8 +1270,8 @@ SwapBackBuffers (PictureTarget *target, pixman_region32_t *damage)
 {
   XserverRegion region;
   XSyncFence fence;
-  BackBuffer *back_buffer;
-  int other;
+  BackBuffer *back_buffer, *other;
+  int i;
   PresentCompletionCallback *callback;
 
   /* Swap back buffers according to the damage in region using the
@@ -862,8 +1315,8 @@ SwapBackBuffers (PictureTarget *target, pixman_region32_t *damage)
 		    PresentOptionNone, target->next_msc,
 		    1, 0, NULL, 0);
 
-  /* Mark the back buffer as busy, and the other back buffer as having
-     been released.  */
+  /* Mark the back buffer as busy, and the previously presented back
+     buffer as having been released.  */
   SetBufferBusy (back_buffer);
   back_buffer->present_serial = present_serial;
 
@@ -871,18 +1324,27 @@ SwapBackBuffers (PictureTarget *target, pixman_region32_t *damage)
      the contents of the buffer 1 swap ago.  */
   back_buffer->age = 1;
 
-  /* Find the other back buffer and clear its busy flag if set.  */
-  other = (target->current_back_buffer ? 0 : 1);
+  /* Find the other back buffers and clear the busy flag of the one
+     that was presented last, as presenting this buffer releases
+     it.  */
 
-  if (target->back_buffers[other])
+  for (i = 0; i < ArrayElements (target->back_buffers); ++i)
     {
-      target->back_buffers[other]->picture |= BufferSync;
-      ClearBufferBusy (target->back_buffers[other]);
+      other = target->back_buffers[i];
+
+      if (!other || i == target->current_back_buffer)
+	continue;
+
+      if (IsBufferBusy (other))
+	{
+	  other->picture |= BufferSync;
+	  ClearBufferBusy (other);
+	}
 
       /* Age the other buffer as well, given that it is not currently
 	 garbaged.  */
-      if (target->back_buffers[other]->age)
-	target->back_buffers[other]->age++;
+      if (other->age)
+	other->age++;
     }
 
   if (region)
@@ -901,7 +1363,7 @@ static void
 SwapBackBuffersWithCopy (PictureTarget *target, pixman_region32_t *damage)
 {
   pixman_box32_t *boxes;
-  int nboxes, i, other;
+  int nboxes, i;
   BackBuffer *back_buffer;
 
   boxes = pixman_region32_rectangles (damage, &nboxes);
@@ -923,15 +1385,19 @@ SwapBackBuffersWithCopy (PictureTarget *target, pixman_region32_t *damage)
 	       boxes[i].y1 - boxes[i].y2,
 	       boxes[i].x1, boxes[i].y1);
 
-  /* Age and the other back buffer.  N.B. that presenting and then
+  /* Age and the other back buffers.  N.B. that presenting and then
      copying is not handled at all, so be sure to only call one or the
      other for any given target.  */
 
-  other = (target->current_back_buffer ? 0 : 1);
   back_buffer->age = 1;
 
-  if (target->back_buffers[other])
-    target->back_buffers[other]++;
+  for (i = 0; i < ArrayElements (target->back_buffers); ++i)
+    {
+      if (target->back_buffers[i]
+	  && i != target->current_back_buffer
+	  && target->back_buffers[i]->age)
+	target->back_buffers[i]->age++;
+    }
 }
 
 static void
@@ -954,53 +1420,108 @@ MaybeAwaitBuffer (BackBuffer *buffer)
   buffer->present_serial = 0;
 }
 
+static int
+PickBackBuffer (PictureTarget *target)
+{
+  int i, empty, stalled;
+  BackBuffer *buffer;
+
+  /* Return the index of the back buffer that will be used next, or
+     the index of an empty slot if a new back buffer will be created.
+     This must not change any state, as TargetAge relies on it
+     returning the same buffer EnsurePicture will later use.  */
+
+  empty = -1;
+  stalled = -1;
+
+  for (i = 0; i < target->n_back_buffers; ++i)
+    {
+      buffer = target->back_buffers[i];
+
+      if (!buffer)
+	{
+	  if (empty == -1)
+	    empty = i;
+
+	  continue;
+	}
+
+      if (IsBufferBusy (buffer))
+	continue;
+
+      if (!IsBufferStalled (buffer))
+	/* This buffer can be used immediately.  */
+	return i;
+
+      if (stalled == -1)
+	stalled = i;
+    }
+
+  if (empty != -1)
+    return empty;
+
+  /* Every back buffer is either busy or waiting for an idle
+     notification.  If the target has stalled too often, add another
+     back buffer instead of waiting.  */
+
+  if (target->n_back_buffers < MaxBackBuffers
+      && (stalled == -1
+	  || (auto_back_buffers
+	      && target->stalls >= StallsBeforeGrowth)))
+    return target->n_back_buffers;
+
+  return stalled;
+}
+
 static BackBuffer *
 GetNextBackBuffer (PictureTarget *target)
 {
+  int index;
+
   /* Return the next back buffer that will be used, but do not create
      any if none exists.  */
 
-  if (target->back_buffers[0]
-      && !IsBufferBusy (target->back_buffers[0]))
-    return target->back_buffers[0];
+  index = PickBackBuffer (target);
+
+  if (index == -1)
+    return NULL;
 
-  return target->back_buffers[1];
+  return target->back_buffers[index];
 }
 
 static void
 EnsurePicture (PictureTarget *target)
 {
   BackBuffer *buffer;
+  int index;
 
   if (target->picture)
     return;
 
   /* Find a back buffer that isn't busy.  */
-  if (!target->back_buffers[0]
-      || !IsBufferBusy (target->back_buffers[0]))
-    {
-      buffer = target->back_buffers[0];
-      target->current_back_buffer = 0;
+  index = PickBackBuffer (target);
+  XLAssert (index != -1);
 
-      if (!buffer)
-	{
-	  /* Create the first back buffer.  */
-	  buffer = CreateBackBuffer (target);
-	  target->back_buffers[0] = buffer;
-	}
-    }
-  else
+  buffer = target->back_buffers[index];
+  target->current_back_buffer = index;
+
+  if (!buffer)
     {
-      buffer = target->back_buffers[1];
-      target->current_back_buffer = 1;
+      /* Create a new back buffer.  */
+      buffer = CreateBackBuffer (target);
+      target->back_buffers[index] = buffer;
 
-      if (!buffer)
+      if (index >= target->n_back_buffers)
 	{
-	  /* Create the second back buffer.  */
-	  buffer = CreateBackBuffer (target);
-	  target->back_buffers[1] = buffer;
+	  /* More back buffers are now in use.  */
+	  target->n_back_buffers = index + 1;
+	  target->stalls = 0;
 	}
     }
+  else if (IsBufferStalled (buffer))
+    /* Using this buffer means waiting for the X server to release
+       it.  */
+    target->stalls++;
 
   /* The selected buffer must not be busy.  */
   XLAssert (!IsBufferBusy (buffer));
@@ -1014,34 +1535,6 @@ EnsurePicture (PictureTarget *target)
 
 
 
-static Visual *
-PickVisual (int *depth)
-{
-  int n_visuals;
-  XVisualInfo vinfo, *visuals;
-  Visual *selection;
-
-  vinfo.screen = DefaultScreen (compositor.display);
-  vinfo.class = TrueColor;
-  vinfo.depth = 32;
-
-  visuals = XGetVisualInfo (compositor.display, (VisualScreenMask
-						 | VisualClassMask
-						 | VisualDepthMask),
-			    &vinfo, &n_visuals);
-
-  if (n_visuals)
-    {
-      selection = visuals[0].visual;
-      *depth = visuals[0].depth;
-      XFree (visuals);
-
-      return selection;
-    }
-
-  return NULL;
-}
-
 static void
 AddAdditionalModifier (const char *name)
 {
@@ -1142,19 +1635,104 @@ InitAdditionalModifiers (void)
     ParseAdditionalModifiers ((const char *) value.addr);
 }
 
-/* Forward declaration.  */
-static void AddRenderFlag (int);
-
-static Bool
-InitRenderFuncs (void)
+static void
+InitBackBuffers (void)
 {
-  int major, minor, error_base, event_base;
-  XSetWindowAttributes attrs;
+  XrmDatabase rdb;
+  XrmName namelist[3];
+  XrmClass classlist[3];
+  XrmValue value;
+  XrmRepresentation type;
+  int count;
 
-  /* Set up the default visual.  */
-  compositor.visual = PickVisual (&compositor.n_planes);
+  /* Use two back buffers by default.  */
+  default_back_buffers = 2;
 
-  /* Initialize the presentation extension.  */
+  rdb = XrmGetDatabase (compositor.display);
+
+  if (!rdb)
+    return;
+
+  namelist[1] = XrmStringToQuark ("backBuffers");
+  namelist[0] = app_quark;
+  namelist[2] = NULLQUARK;
+
+  classlist[1] = XrmStringToQuark ("BackBuffers");
+  classlist[0] = resource_quark;
+  classlist[2] = NULLQUARK;
+
+  if (!XrmQGetResource (rdb, namelist, classlist,
+			&type, &value)
+      || type != QString)
+    return;
+
+  if (!strcmp ((const char *) value.addr, "auto"))
+    {
+      /* Start with two back buffers, and add more when presentation
+	 stalls.  */
+      auto_back_buffers = True;
+      return;
+    }
+
+  count = atoi ((const char *) value.addr);
+
+  if (count < 2 || count > MaxBackBuffers)
+    {
+      fprintf (stderr, "Invalid number of back buffers: %s\n",
+	       (const char *) value.addr);
+      return;
+    }
+
+  default_back_buffers = count;
+}
+
+static void
+InitShmBufferMode (void)
+{
+  XrmDatabase rdb;
+  XrmName namelist[3];
+  XrmClass classlist[3];
+  XrmValue value;
+  XrmRepresentation type;
+
+  rdb = XrmGetDatabase (compositor.display);
+
+  if (!rdb)
+    return;
+
+  namelist[1] = XrmStringToQuark ("shmBuffers");
+  namelist[0] = app_quark;
+  namelist[2] = NULLQUARK;
+
+  classlist[1] = XrmStringToQuark ("ShmBuffers");
+  classlist[0] = resource_quark;
+  classlist[2] = NULLQUARK;
+
+  if (!XrmQGetResource (rdb, namelist, classlist,
+			&type, &value)
+      || type != QString)
+    return;
+
+  if (!strcmp ((const char *) value.addr, "copy"))
+    copy_shm_buffers = True;
+  else if (strcmp ((const char *) value.addr, "shared"))
+    fprintf (stderr, "Invalid shm buffer mode: %s\n",
+	     (const char *) value.addr);
+}
+
+/* Forward declaration.  */
+static void AddRenderFlag (int);
+
+static Bool
+InitRenderFuncs (void)
+{
+  int major, minor, error_base, event_base;
+  XSetWindowAttributes attrs;
+
+  /* Set up the default visual.  */
+  compositor.visual = PickTrueColorVisual (&compositor.n_planes);
+
+  /* Initialize the presentation extension.  */
   if (!XPresentQueryExtension (compositor.display,
 			       &present_opcode,
 			       &error_base, &event_base)
@@ -1169,6 +1747,13 @@ InitRenderFuncs (void)
   /* Find out what additional modifiers the user wants.  */
   InitAdditionalModifiers ();
 
+  if (getenv ("DEBUG_ROUNDTRIP_STATISTICS"))
+    /* Print statistics once the protocol translator exits.  */
+    atexit (PrintRoundtripStatistics);
+
+  /* Find out how many back buffers should be used.  */
+  InitBackBuffers ();
+
   /* Add the direct presentation support flag.  */
   AddRenderFlag (SupportsDirectPresent);
 
@@ -1217,8 +1802,10 @@ TargetFromDrawable (Drawable drawable, Window window,
 					    compositor.argb_format,
 					    0, &picture_attrs);
 
-  /* Initialize the current back buffer.  */
+  /* Initialize the current back buffer and the number of back
+     buffers.  */
   target->current_back_buffer = -1;
+  target->n_back_buffers = default_back_buffers;
 
   /* Initialize the list of release records.  */
   target->pending.target_next = &target->pending;
@@ -1322,6 +1909,74 @@ SetStandardEventMask (RenderTarget target, unsigned long standard_event_mask)
   pict_target->standard_event_mask = standard_event_mask;
 }
 
+static Bool
+KeepBackBuffers (PictureTarget *target, int width, int height)
+{
+  int i;
+  BackBuffer *buffer;
+
+  /* If every back buffer of TARGET has the size of a back buffer
+     created for the given size, keep them, but mark their contents as
+     invalid.  Return whether or not the back buffers were kept.  */
+
+  if (!(target->flags & Resizing))
+    return False;
+
+  width = BackBufferSize (target, width);
+  height = BackBufferSize (target, height);
+
+  for (i = 0; i < ArrayElements (target->back_buffers); ++i)
+    {
+      buffer = target->back_buffers[i];
+
+      if (buffer && (buffer->width != width
+		     || buffer->height != height))
+	return False;
+    }
+
+  for (i = 0; i < ArrayElements (target->back_buffers); ++i)
+    {
+      if (target->back_buffers[i])
+	target->back_buffers[i]->age = 0;
+    }
+
+  return True;
+}
+
+static void
+MaybeFinishResize (PictureTarget *target)
+{
+  int i;
+  BackBuffer *buffer;
+
+  /* If the size of TARGET has not changed for a while, stop rounding
+     up the size of its back buffers.  This is only done after a swap,
+     so that TargetAge and EnsurePicture always agree on which buffer
+     is used next.  */
+
+  if (!(target->flags & Resizing)
+      || (TimespecCmp (TimespecSub (CurrentTimespec (),
+				    target->resize_time),
+		       ResizeSettleTime) < 0))
+    return;
+
+  target->flags &= ~Resizing;
+
+  for (i = 0; i < ArrayElements (target->back_buffers); ++i)
+    {
+      buffer = target->back_buffers[i];
+
+      if (buffer && (buffer->width != target->width
+		     || buffer->height != target->height))
+	{
+	  /* Replace the back buffers with ones of the exact size, so
+	     that they can be flipped to the screen.  */
+	  FreeBackBuffers (target);
+	  return;
+	}
+    }
+}
+
 static void
 NoteTargetSize (RenderTarget target, int width, int height)
 {
@@ -1333,8 +1988,18 @@ NoteTargetSize (RenderTarget target, int width, int height)
   if (width != pict_target->width
       || height != pict_target->height)
     {
-      /* Recreate all the back buffers for the new target size.  */
-      FreeBackBuffers (pict_target);
+      if (pict_target->width && pict_target->height)
+	{
+	  /* The target is being resized.  Round the size of new back
+	     buffers up until the size stops changing.  */
+	  pict_target->flags |= Resizing;
+	  pict_target->resize_time = CurrentTimespec ();
+	}
+
+      /* Recreate all the back buffers for the new target size,
+	 unless they are already large enough.  */
+      if (!KeepBackBuffers (pict_target, width, height))
+	FreeBackBuffers (pict_target);
 
       /* First, remove existing pixels from the client.  */
       if (pict_target->client
@@ -1382,7 +2047,7 @@ RemovePresentRecord (PresentRecord *record)
   record->buffer_next->buffer_last = record->buffer_last;
   record->buffer_last->buffer_next = record->buffer_next;
 
-  XLFree (record);
+  XLSlabFree (&present_record_slab, record);
 }
 
 static void
@@ -1431,7 +2096,7 @@ DestroyRenderTarget (RenderTarget target)
       activity_record = activity_record->target_next;
 
       UnlinkActivityRecord (activity_last);
-      XLFree (activity_last);
+      XLSlabFree (&activity_record_slab, activity_last);
     }
 
   /* Free all idle callbacks on this target.  */
@@ -1618,26 +2283,27 @@ CompareStretch (DrawParams *params, DrawParams *other)
   return True;
 }
 
+static Bool
+CompareParams (DrawParams *params, DrawParams *other)
+{
+  return (GetScale (params) == GetScale (other)
+	  && GetSourceX (params) == GetSourceX (other)
+	  && GetSourceY (params) == GetSourceY (other)
+	  && GetBufferTransform (params) == GetBufferTransform (other)
+	  && CompareStretch (params, other));
+}
+
 static void
-MaybeApplyTransform (PictureBuffer *buffer, DrawParams *params)
+ApplyTransform (PictureBuffer *buffer, Picture picture,
+		DrawParams *params)
 {
   XTransform transform;
   Matrix ftransform;
 
-  if (GetScale (params) == GetScale (&buffer->params)
-      && GetSourceX (params) == GetSourceX (&buffer->params)
-      && GetSourceY (params) == GetSourceY (&buffer->params)
-      && (GetBufferTransform (params)
-	  == GetBufferTransform (&buffer->params))
-      && CompareStretch (params, &buffer->params))
-    /* Nothing changed.  */
-    return;
-
-  /* Otherwise, compute and apply the new transform. */
+  /* Compute and apply the transform.  */
   if (!params->flags)
     /* No transform of any kind is set, use the identity matrix.  */
-    XRenderSetPictureTransform (compositor.display,
-				buffer->picture,
+    XRenderSetPictureTransform (compositor.display, picture,
 				&identity_transform);
   else
     {
@@ -1670,12 +2336,104 @@ MaybeApplyTransform (PictureBuffer *buffer, DrawParams *params)
 
       /* Set the transform.  The transform maps from dest coords to
 	 picture coords, so that [X Y 1] = TRANSFORM * [DX DY 1].  */
-      XRenderSetPictureTransform (compositor.display, buffer->picture,
+      XRenderSetPictureTransform (compositor.display, picture,
 				  &transform);
     }
+}
+
+static Picture
+PictureForParams (PictureBuffer *buffer, DrawParams *params)
+{
+  static DrawParams identity_params;
+  XRenderPictureAttributes picture_attrs;
+  DerivedPicture derived;
+  int i;
+
+  /* Return a picture of BUFFER with the transform described by PARAMS
+     applied.  Pictures with a transform are created on demand and
+     kept, so that drawing the same buffer with different params
+     (i.e. on two outputs with different scales) does not change the
+     transform of a picture back and forth.  */
+
+  if (CompareParams (params, &identity_params))
+    return buffer->picture;
+
+  for (i = 0; i < buffer->n_derived; ++i)
+    {
+      if (CompareParams (params, &buffer->derived[i].params))
+	break;
+    }
+
+  if (i < buffer->n_derived)
+    /* Nothing changed.  */
+    derived = buffer->derived[i];
+  else
+    {
+      if (buffer->n_derived < MaxDerivedPictures)
+	{
+	  /* This is just to pacify GCC.  */
+	  memset (&picture_attrs, 0, sizeof picture_attrs);
+
+	  /* Create a new picture.  */
+	  i = buffer->n_derived++;
+	  derived.picture
+	    = XRenderCreatePicture (compositor.display, buffer->pixmap,
+				    buffer->format, 0, &picture_attrs);
+	}
+      else
+	{
+	  /* Reuse the least recently used picture.  */
+	  i = buffer->n_derived - 1;
+	  derived.picture = buffer->derived[i].picture;
+	}
+
+      ApplyTransform (buffer, derived.picture, params);
+      derived.params = *params;
+    }
+
+  /* Move the picture to the front of the array.  */
+  memmove (&buffer->derived[1], &buffer->derived[0],
+	   sizeof *buffer->derived * i);
+  buffer->derived[0] = derived;
+
+  return derived.picture;
+}
+
+static void
+NoteBufferUsed (PictureTarget *picture_target,
+		PictureBuffer *picture_buffer)
+{
+  XLList *tem;
+
+  for (tem = picture_target->buffers_used; tem; tem = tem->next)
+    {
+      /* Return if the buffer is already in the buffers_used list.  */
+
+      if (tem->data == picture_buffer)
+	return;
+    }
+
+  /* Record pending buffer activity; the roundtrip message is then
+     sent later.  */
+
+  picture_target->buffers_used
+    = XLListPrepend (picture_target->buffers_used, picture_buffer);
+}
+
+/* Forward declaration.  */
+static void ConvertBuffer (PictureBuffer *, pixman_region32_t *,
+			   DrawParams *);
 
-  /* Save the parameters into buffer.  */
-  buffer->params = *params;
+static void
+EnsureContentsConverted (PictureBuffer *buffer)
+{
+  /* The pixmap of a buffer whose contents are converted starts out
+     with undefined contents, and is only filled upon damage.  Convert
+     all of its contents if it is used before any damage was posted,
+     which is the case if it was committed without damage.  */
+  if ((buffer->flags & NeedsConversion)
+      && !(buffer->flags & ContentsConverted))
+    ConvertBuffer (buffer, NULL, NULL);
 }
 
 static void
@@ -1685,7 +2443,7 @@ Composite (RenderBuffer buffer, RenderTarget target,
 {
   PictureBuffer *picture_buffer;
   PictureTarget *picture_target;
-  XLList *tem;
+  Picture picture;
 
   picture_buffer = buffer.pointer;
   picture_target = target.pointer;
@@ -1693,40 +2451,111 @@ Composite (RenderBuffer buffer, RenderTarget target,
   /* Ensure a back buffer is created.  */
   EnsurePicture (picture_target);
 
-  /* Maybe set the transform if the parameters changed.  (draw_params
-     specifies a transform to apply to the buffer, not to the
-     target.)  */
-  MaybeApplyTransform (picture_buffer, draw_params);
+  /* Make sure the buffer has contents.  */
+  EnsureContentsConverted (picture_buffer);
+
+  /* Find a picture with the transform described by draw_params.
+     (draw_params specifies a transform to apply to the buffer, not to
+     the target.)  */
+  picture = PictureForParams (picture_buffer, draw_params);
 
   /* Do the compositing.  */
   XRenderComposite (compositor.display, ConvertOperation (op),
-		    picture_buffer->picture, None,
+		    picture, None,
 		    picture_target->picture,
 		    /* src-x, src-y, mask-x, mask-y.  */
 		    src_x, src_y, 0, 0,
 		    /* dst-x, dst-y, width, height.  */
 		    x, y, width, height);
 
-  for (tem = picture_target->buffers_used; tem; tem = tem->next)
+  NoteBufferUsed (picture_target, picture_buffer);
+}
+
+static void
+CompositeRegion (RenderBuffer buffer, RenderTarget target,
+		 Operation op, pixman_region32_t *region, int src_x,
+		 int src_y, int x, int y, DrawParams *draw_params)
+{
+  PictureBuffer *picture_buffer;
+  PictureTarget *picture_target;
+  pixman_box32_t *boxes, *extents;
+  XRenderPictureAttributes attrs;
+  int nboxes, i;
+  Picture picture;
+
+  boxes = pixman_region32_rectangles (region, &nboxes);
+
+  if (nboxes < 2)
     {
-      /* Return if the buffer is already in the buffers_used list.  */
+      /* A single XRenderComposite suffices without a clip.  */
+      if (nboxes)
+	Composite (buffer, target, op, boxes[0].x1 + src_x,
+		   boxes[0].y1 + src_y, boxes[0].x1 + x,
+		   boxes[0].y1 + y, boxes[0].x2 - boxes[0].x1,
+		   boxes[0].y2 - boxes[0].y1, draw_params);
 
-      if (tem->data == picture_buffer)
-	return;
+      return;
     }
 
-  /* Record pending buffer activity; the roundtrip message is then
-     sent later.  */
+  picture_buffer = buffer.pointer;
+  picture_target = target.pointer;
 
-  picture_target->buffers_used
-    = XLListPrepend (picture_target->buffers_used, picture_buffer);
+  /* Ensure a back buffer is created.  */
+  EnsurePicture (picture_target);
+
+  /* Make sure the buffer has contents.  */
+  EnsureContentsConverted (picture_buffer);
+
+  /* Find a picture with the transform described by draw_params.  */
+  picture = PictureForParams (picture_buffer, draw_params);
+
+  /* Clip the target to the region, and then composite its extents
+     with one request.  */
+
+  if (nboxes > clip_rectangles_size)
+    {
+      clip_rectangles_size = nboxes;
+      clip_rectangles = XLRealloc (clip_rectangles,
+				   sizeof *clip_rectangles * nboxes);
+    }
+
+  for (i = 0; i < nboxes; ++i)
+    {
+      clip_rectangles[i].x = boxes[i].x1 + x;
+      clip_rectangles[i].y = boxes[i].y1 + y;
+      clip_rectangles[i].width = boxes[i].x2 - boxes[i].x1;
+      clip_rectangles[i].height = boxes[i].y2 - boxes[i].y1;
+    }
+
+  XRenderSetPictureClipRectangles (compositor.display,
+				   picture_target->picture, 0, 0,
+				   clip_rectangles, nboxes);
+
+  extents = pixman_region32_extents (region);
+  XRenderComposite (compositor.display, ConvertOperation (op),
+		    picture, None,
+		    picture_target->picture,
+		    /* src-x, src-y, mask-x, mask-y.  */
+		    extents->x1 + src_x, extents->y1 + src_y, 0, 0,
+		    /* dst-x, dst-y, width, height.  */
+		    extents->x1 + x, extents->y1 + y,
+		    extents->x2 - extents->x1,
+		    extents->y2 - extents->y1);
+
+  /* Remove the clip again, as the target picture is also used for
+     clearing and buffer swaps.  */
+  attrs.clip_mask = None;
+  XRenderChangePicture (compositor.display, picture_target->picture,
+			CPClipMask, &attrs);
+
+  NoteBufferUsed (picture_target, picture_buffer);
 }
 
 static RenderCompletionKey
 FinishRender (RenderTarget target, pixman_region32_t *damage,
 	      RenderCompletionFunc function, void *data)
 {
-  XLList *tem, *last;
+  XLList *tem;
   PictureTarget *pict_target;
   uint64_t roundtrip_id;
   PresentCompletionCallback *callback_rec;
@@ -1737,27 +2566,25 @@ FinishRender (RenderTarget target, pixman_region32_t *damage,
     /* No buffers were used.  */
     return NULL;
 
-  /* Finish rendering.  This function then sends a single roundtrip
-     message and records buffer activity for each buffer involved in
-     the update based on that.  */
+  /* Finish rendering.  This function then records buffer activity
+     for each buffer involved in the update based on a single
+     roundtrip message, which is sent when the event loop calls
+     RenderFlush.  */
 
-  roundtrip_id = SendRoundtripMessage ();
+  roundtrip_id = GetRoundtripId ();
   tem = pict_target->buffers_used;
+  roundtrip_statistics.frames++;
 
-  while (tem)
+  for (; tem; tem = tem->next)
     {
-      last = tem;
-      tem = tem->next;
-
       /* Record buffer activity on this one buffer.  */
-      RecordBufferActivity (last->data, pict_target,
+      RecordBufferActivity (tem->data, pict_target,
 			    roundtrip_id);
-
-      /* Free the list element.  */
-      XLFree (last);
+      roundtrip_statistics.buffer_uses++;
     }
 
-  /* Clear buffers_used.  */
+  /* Free and clear buffers_used.  */
+  XLListFree (pict_target->buffers_used, NULL);
   pict_target->buffers_used = NULL;
 
   /* Swap the back buffer to the screen if it was used.  */
@@ -1773,11 +2600,13 @@ FinishRender (RenderTarget target, pixman_region32_t *damage,
 	  callback_rec->function = function;
 	  callback_rec->data = data;
 
+	  MaybeFinishResize (pict_target);
 	  return (RenderCompletionKey) callback_rec;
 	}
 
       /* Otherwise, swap buffers using XCopyArea.  */
       SwapBackBuffersWithCopy (pict_target, damage);
+      MaybeFinishResize (pict_target);
       return NULL;
     }
 
@@ -1875,7 +2704,7 @@ AllocateRecord (PictureBuffer *buffer, PictureTarget *target)
   PresentRecord *record;
 
   /* Allocate a record and link it onto both BUFFER and TARGET.  */
-  record = XLCalloc (1, sizeof *record);
+  record = XLSlabCalloc (&present_record_slab);
   record->buffer_next = buffer->pending.buffer_next;
   record->buffer_last = &buffer->pending;
   buffer->pending.buffer_next->buffer_last = record;
@@ -2020,6 +2849,54 @@ CancelPresentationCallback (PresentCompletionKey key)
   XLFree (callback);
 }
 
+/* Forward declaration.  */
+static void SendDmaBufRoundTrip (void);
+
+static void
+RunPendingIdleCallbacks (void)
+{
+  PictureBuffer *buffer;
+  IdleCallback *callback, *last;
+
+  while (idle_buffers)
+    {
+      buffer = idle_buffers;
+      idle_buffers = buffer->idle_next;
+      buffer->flags &= ~PendingIdle;
+
+      /* The X server never reads from the client's memory once the
+	 contents of this buffer have been copied, so run every idle
+	 callback at once.  */
+      callback = buffer->idle_callbacks.buffer_next;
+      while (callback != &buffer->idle_callbacks)
+	{
+	  callback->buffer_next->buffer_last = callback->buffer_last;
+	  callback->buffer_last->buffer_next = callback->buffer_next;
+	  callback->target_next->target_last = callback->target_last;
+	  callback->target_last->target_next = callback->target_next;
+	  last = callback;
+	  callback = callback->buffer_next;
+
+	  last->function ((RenderBuffer) (void *) buffer, last->data);
+	  XLFree (last);
+	}
+    }
+}
+
+static void
+Flush (void)
+{
+  /* Run idle callbacks of buffers whose contents were copied.  */
+  RunPendingIdleCallbacks ();
+
+  /* Send the roundtrip message for buffer activity recorded during
+     this iteration of the event loop.  */
+  SendRoundtripMessage ();
+
+  /* And the one for buffers whose creation was requested.  */
+  SendDmaBufRoundTrip ();
+}
+
 static RenderFuncs picture_render_funcs =
   {
     .init_render_funcs = InitRenderFuncs,
@@ -2035,6 +2912,7 @@ static RenderFuncs picture_render_funcs =
     .fill_boxes_with_transparency = FillBoxesWithTransparency,
     .clear_rectangle = ClearRectangle,
     .composite = Composite,
+    .composite_region = CompositeRegion,
     .finish_render = FinishRender,
     .cancel_completion_callback = CancelCompletionCallback,
     .target_age = TargetAge,
@@ -2045,6 +2923,7 @@ static RenderFuncs picture_render_funcs =
     .present_to_window = PresentToWindow,
     .notify_msc = NotifyMsc,
     .cancel_presentation_callback = CancelPresentationCallback,
+    .flush = Flush,
   };
 
 static void
@@ -2243,7 +3122,9 @@ InitDrmFormats (void)
 
   /* Allocate the amount of memory we need to store the DRM format
      list.  */
-  drm_formats = XLCalloc (pair_count, sizeof *drm_formats);
+  drm_formats = XLCalloc (pair_count
+			  + ArrayElements (converted_drm_formats),
+			  sizeof *drm_formats);
   n = 0;
 
   /* Populate the format list.  */
@@ -2303,6 +3184,14 @@ InitDrmFormats (void)
   /* Set the number of supported formats to the pair count.  */
   n_drm_formats = pair_count;
 
+  /* Add the formats that are converted.  */
+  for (i = 0; i < ArrayElements (converted_drm_formats); ++i)
+    {
+      drm_formats[n_drm_formats].drm_format = converted_drm_formats[i];
+      drm_formats[n_drm_formats].drm_modifier = DRM_FORMAT_MOD_LINEAR;
+      n_drm_formats++;
+    }
+
   /* Return.  */
   return;
 }
@@ -2431,9 +3320,10 @@ GetRenderDevices (int *num_devices)
 static ShmFormat *
 GetShmFormats (int *num_formats)
 {
-  /* Return the two mandatory shm formats.  */
-  *num_formats = ArrayElements (default_formats);
-  return default_formats;
+  /* Return the two mandatory shm formats, and those that are
+     converted.  */
+  *num_formats = num_shm_formats;
+  return shm_formats;
 }
 
 static int
@@ -2493,20 +3383,146 @@ PictFormatIsPresentable (XRenderPictFormat *format)
   return False;
 }
 
-static RenderBuffer
-BufferFromDmaBuf (DmaBufAttributes *attributes, Bool *error)
+static Bool
+IsConvertedDmabufFormat (uint32_t drm_format)
 {
-  int depth, bpp;
-  Pixmap pixmap;
-  Picture picture;
-  xcb_void_cookie_t check_cookie;
-  xcb_generic_error_t *xerror;
-  XRenderPictFormat *format;
-  XRenderPictureAttributes picture_attrs;
-  PictureBuffer *buffer;
+  int i;
 
-  /* Find the depth and bpp corresponding to the format.  */
-  depth = DepthForDmabufFormat (attributes->drm_format, &bpp);
+  for (i = 0; i < ArrayElements (converted_drm_formats); ++i)
+    {
+      if (converted_drm_formats[i] == drm_format)
+	return True;
+    }
+
+  return False;
+}
+
+static void
+UnmapDmabufPlanes (PictureBuffer *buffer)
+{
+  int i;
+
+  for (i = 0; i < buffer->n_dmabuf_planes; ++i)
+    munmap (buffer->dmabuf_maps[i], buffer->dmabuf_map_sizes[i]);
+}
+
+static RenderBuffer
+BufferFromConvertedDmaBuf (DmaBufAttributes *attributes, Bool *error)
+{
+  XRenderPictureAttributes picture_attrs;
+  PictureBuffer *buffer;
+  size_t min_stride, size;
+  off_t fd_size;
+  int n_planes, i, rows;
+  void *map;
+
+  GetConversionFormatInfo (attributes->drm_format, NULL, &n_planes,
+			   NULL);
+
+  /* Flags are not supported, and only linear buffers can be read by
+     the CPU.  */
+  if (attributes->flags
+      || attributes->modifier != DRM_FORMAT_MOD_LINEAR
+      || attributes->n_planes != n_planes)
+    goto error;
+
+  buffer = XLCalloc (1, sizeof *buffer);
+
+  for (i = 0; i < n_planes; ++i)
+    {
+      GetConversionPlaneSize (attributes->drm_format, i,
+			      attributes->width, attributes->height,
+			      &min_stride, &rows);
+
+      if (attributes->strides[i] < min_stride)
+	goto error_unmap;
+
+      /* Map the buffer up to the end of the plane, after checking
+	 that the plane fits inside.  */
+      if (IntMultiplyWrapv ((size_t) attributes->strides[i], rows, &size)
+	  || IntAddWrapv (size, attributes->offsets[i], &size))
+	goto error_unmap;
+
+      fd_size = lseek (attributes->fds[i], 0, SEEK_END);
+
+      if (fd_size < 0 || size > fd_size)
+	goto error_unmap;
+
+      map = mmap (NULL, size, PROT_READ, MAP_SHARED,
+		  attributes->fds[i], 0);
+
+      if (map == MAP_FAILED)
+	goto error_unmap;
+
+      buffer->dmabuf_maps[i] = map;
+      buffer->dmabuf_map_sizes[i] = size;
+      buffer->dmabuf_fds[i] = attributes->fds[i];
+      buffer->n_dmabuf_planes = i + 1;
+
+      buffer->dmabuf_source.planes[i]
+	= (unsigned char *) map + attributes->offsets[i];
+      buffer->dmabuf_source.strides[i] = attributes->strides[i];
+    }
+
+  /* Create the pixmap and picture the contents are converted into.
+     The file descriptors are kept open until the buffer is freed, as
+     they are needed to synchronize access to the mappings.  */
+  buffer->pixmap = XCreatePixmap (compositor.display,
+				  DefaultRootWindow (compositor.display),
+				  attributes->width, attributes->height,
+				  24);
+  buffer->picture = XRenderCreatePicture (compositor.display,
+					  buffer->pixmap,
+					  compositor.xrgb_format, 0,
+					  &picture_attrs);
+  buffer->depth = 24;
+  buffer->width = attributes->width;
+  buffer->height = attributes->height;
+  buffer->format = compositor.xrgb_format;
+  buffer->conversion_format = attributes->drm_format;
+  buffer->flags |= NeedsConversion | IsOpaque;
+
+  /* Initialize the list of release records.  */
+  buffer->pending.buffer_next = &buffer->pending;
+  buffer->pending.buffer_last = &buffer->pending;
+
+  /* And the list of idle funcs.  */
+  buffer->idle_callbacks.buffer_next = &buffer->idle_callbacks;
+  buffer->idle_callbacks.buffer_last = &buffer->idle_callbacks;
+
+  /* And the list of pending activity.  */
+  buffer->activity.buffer_next = &buffer->activity;
+  buffer->activity.buffer_last = &buffer->activity;
+
+  return (RenderBuffer) (void *) buffer;
+
+ error_unmap:
+  UnmapDmabufPlanes (buffer);
+  XLFree (buffer);
+ error:
+  CloseFileDescriptors (attributes);
+  *error = True;
+  return (RenderBuffer) NULL;
+}
+
+static RenderBuffer
+BufferFromDmaBuf (DmaBufAttributes *attributes, Bool *error)
+{
+  int depth, bpp;
+  Pixmap pixmap;
+  Picture picture;
+  xcb_void_cookie_t check_cookie;
+  xcb_generic_error_t *xerror;
+  XRenderPictFormat *format;
+  XRenderPictureAttributes picture_attrs;
+  PictureBuffer *buffer;
+
+  /* Buffers in YUV formats are converted by the CPU.  */
+  if (IsConvertedDmabufFormat (attributes->drm_format))
+    return BufferFromConvertedDmaBuf (attributes, error);
+
+  /* Find the depth and bpp corresponding to the format.  */
+  depth = DepthForDmabufFormat (attributes->drm_format, &bpp);
 
   /* Flags are not supported.  */
   if (attributes->flags || depth == -1)
@@ -2555,6 +3571,7 @@ BufferFromDmaBuf (DmaBufAttributes *attributes, Bool *error)
   buffer->depth = depth;
   buffer->width = attributes->width;
   buffer->height = attributes->height;
+  buffer->format = format;
 
   /* Initialize the list of release records.  */
   buffer->pending.buffer_next = &buffer->pending;
@@ -2585,18 +3602,24 @@ BufferFromDmaBuf (DmaBufAttributes *attributes, Bool *error)
 }
 
 static void
-ForceRoundTrip (void)
+SendDmaBufRoundTrip (void)
 {
   uint64_t id;
   XEvent event;
 
   /* Send an event with a monotonically increasing identifier to
-     ourselves.
+     ourselves.  All buffers whose creation was requested during this
+     iteration of the event loop share one event.
 
-     Once the last event is received, create the actual buffers for
-     each buffer resource for which error handlers have not run.  */
+     Once the event is received, create the actual buffers for each
+     buffer resource requested before it for which error handlers have
+     not run.  */
 
-  id = next_roundtrip_id++;
+  if (!pending_dma_buf_id)
+    return;
+
+  id = pending_dma_buf_id;
+  pending_dma_buf_id = 0;
 
   memset (&event, 0, sizeof event);
 
@@ -2636,6 +3659,7 @@ FinishDmaBufRecord (DmaBufRecord *pending, Bool success)
       buffer->depth = pending->depth;
       buffer->width = pending->width;
       buffer->height = pending->height;
+      buffer->format = pending->format;
 
       /* Initialize the list of release records.  */
       buffer->pending.buffer_next = &buffer->pending;
@@ -2673,21 +3697,15 @@ FinishDmaBufRecord (DmaBufRecord *pending, Bool success)
 }
 
 static void
-FinishBufferCreation (void)
+FinishBufferCreation (uint64_t id)
 {
-  DmaBufRecord *next, *last;
+  /* It is now known that all records in pending_success up to ID have
+     been created.  The list is sorted by id, so create pictures and
+     call the success function for each record at its start.  */
 
-  /* It is now known that all records in pending_success have been
-     created.  Create pictures and call the success function for
-     each.  */
-  next = pending_success.next;
-  while (next != &pending_success)
-    {
-      last = next;
-      next = next->next;
-
-      FinishDmaBufRecord (last, True);
-    }
+  while (pending_success.next != &pending_success
+	 && pending_success.next->id <= id)
+    FinishDmaBufRecord (pending_success.next, True);
 }
 
 /* N.B. that the caller is supposed to keep callback_data around until
@@ -2702,6 +3720,23 @@ BufferFromDmaBufAsync (DmaBufAttributes *attributes,
   DmaBufRecord *record;
   int depth, bpp;
   Pixmap pixmap;
+  RenderBuffer buffer;
+  Bool error;
+
+  if (IsConvertedDmabufFormat (attributes->drm_format))
+    {
+      /* Such buffers are mapped immediately, so there is nothing to
+	 wait for.  */
+      error = False;
+      buffer = BufferFromConvertedDmaBuf (attributes, &error);
+
+      if (error)
+	failure_func (callback_data);
+      else
+	success_func (buffer, callback_data);
+
+      return;
+    }
 
   /* Find the depth and bpp corresponding to the format.  */
   depth = DepthForDmabufFormat (attributes->drm_format, &bpp);
@@ -2747,12 +3782,16 @@ BufferFromDmaBufAsync (DmaBufAttributes *attributes,
 
   XLAssert (record->format != NULL);
 
-  record->next = pending_success.next;
-  record->last = &pending_success;
-  pending_success.next->last = record;
-  pending_success.next = record;
+  /* Link the record onto the end of the list, which keeps it sorted
+     by id.  The event itself is sent by Flush.  */
+  if (!pending_dma_buf_id)
+    pending_dma_buf_id = ++last_dma_buf_id;
 
-  ForceRoundTrip ();
+  record->id = pending_dma_buf_id;
+  record->next = &pending_success;
+  record->last = pending_success.last;
+  pending_success.last->next = record;
+  pending_success.last = record;
 
   return;
 
@@ -2798,51 +3837,128 @@ PictFormatForFormat (uint32_t format)
     }
 }
 
+/* Return the shared memory segment attached for the pool described by
+   ATTRIBUTES, attaching it first if necessary.  Return NULL upon
+   failure.  */
+
+static ShmSegment *
+GetShmSegment (SharedMemoryAttributes *attributes)
+{
+  ShmSegment *segment;
+  int fd;
+
+  if (*attributes->renderer_data)
+    return *attributes->renderer_data;
+
+  /* Duplicate the fd, since XCB closes file descriptors after sending
+     them.  */
+  fd = fcntl (attributes->fd, F_DUPFD_CLOEXEC, 0);
+
+  if (fd < 0)
+    return NULL;
+
+  segment = XLMalloc (sizeof *segment);
+  segment->seg = xcb_generate_id (compositor.conn);
+  xcb_shm_attach_fd (compositor.conn, segment->seg, fd, false);
+
+  /* Keep the segment around for subsequent buffers created from the
+     same pool.  It is detached by FreeShmPoolData once the pool is
+     resized or destroyed.  */
+  *attributes->renderer_data = segment;
+  return segment;
+}
+
+static void
+FreeShmPoolData (void *data)
+{
+  ShmSegment *segment;
+
+  segment = data;
+  xcb_shm_detach (compositor.conn, segment->seg);
+  XLFree (segment);
+}
+
 static RenderBuffer
 BufferFromShm (SharedMemoryAttributes *attributes, Bool *error)
 {
   XRenderPictureAttributes picture_attrs;
-  xcb_shm_seg_t seg;
+  ShmSegment *segment;
   Pixmap pixmap;
   Picture picture;
-  int fd, depth, format, bpp;
+  int depth, format, bpp;
   PictureBuffer *buffer;
   XRenderPictFormat *pict_format;
+  Bool converted, copied, has_alpha;
 
-  depth = DepthForFormat (attributes->format, &bpp);
   format = attributes->format;
 
+  /* If the X server cannot use the format directly, the contents are
+     converted into a pixmap of the native format whenever they are
+     damaged.  */
+  converted = GetConversionFormatInfo (format, &bpp, NULL, &has_alpha);
+  copied = False;
+
+  if (converted)
+    depth = has_alpha ? 32 : 24;
+  else
+    {
+      depth = DepthForFormat (format, &bpp);
+
+      /* If the user asked for it, copy the contents of the buffer
+	 into a pixmap owned by the compositor upon commit, so that it
+	 can be released immediately.  Without MIT-SHM, there is no
+	 other way to get the contents to the X server.  */
+      copied = copy_shm_buffers || !have_mit_shm;
+    }
+
   if (!depth)
     {
       *error = True;
       return (RenderBuffer) NULL;
     }
 
-  /* Duplicate the fd, since XCB closes file descriptors after sending
-     them.  */
-  fd = fcntl (attributes->fd, F_DUPFD_CLOEXEC, 0);
-
-  if (fd < 0)
+  if (converted || copied)
     {
-      *error = True;
-      return (RenderBuffer) NULL;
+      /* Obtain the picture format of the converted contents.  */
+      if (converted)
+	pict_format = (has_alpha ? compositor.argb_format
+		       : compositor.xrgb_format);
+      else
+	pict_format = PictFormatForFormat (format);
+
+      /* Create a pixmap owned by the compositor.  Its contents are
+	 uploaded by UpdateBufferForDamage.  */
+      pixmap = XCreatePixmap (compositor.display,
+			      DefaultRootWindow (compositor.display),
+			      attributes->width, attributes->height,
+			      depth);
     }
+  else
+    {
+      /* Find or attach the segment for the pool.  */
+      segment = GetShmSegment (attributes);
 
-  /* Obtain the picture format.  */
-  pict_format = PictFormatForFormat (format);
-  XLAssert (pict_format != NULL);
+      if (!segment)
+	{
+	  *error = True;
+	  return (RenderBuffer) NULL;
+	}
 
-  /* Now, allocate the XIDs for the shm segment and pixmap.  */
-  seg = xcb_generate_id (compositor.conn);
-  pixmap = xcb_generate_id (compositor.conn);
+      /* Obtain the picture format.  */
+      pict_format = PictFormatForFormat (format);
+      XLAssert (pict_format != NULL);
+
+      /* Now, allocate the XID for the pixmap.  */
+      pixmap = xcb_generate_id (compositor.conn);
 
-  /* Create the segment and attach the pixmap to it.  */
-  xcb_shm_attach_fd (compositor.conn, seg, fd, false);
-  xcb_shm_create_pixmap (compositor.conn, pixmap,
-			 DefaultRootWindow (compositor.display),
-			 attributes->width, attributes->height,
-			 depth, seg, attributes->offset);
-  xcb_shm_detach (compositor.conn, seg);
+      /* Create the pixmap from the segment.  The server keeps the
+	 segment mapped for as long as the pixmap exists, even after
+	 the segment is detached.  */
+      xcb_shm_create_pixmap (compositor.conn, pixmap,
+			     DefaultRootWindow (compositor.display),
+			     attributes->width, attributes->height,
+			     depth, segment->seg, attributes->offset);
+    }
 
   /* Create the picture for the pixmap.  */
   picture = XRenderCreatePicture (compositor.display, pixmap,
@@ -2855,6 +3971,7 @@ BufferFromShm (SharedMemoryAttributes *attributes, Bool *error)
   buffer->depth = depth;
   buffer->width = attributes->width;
   buffer->height = attributes->height;
+  buffer->format = pict_format;
 
   /* Initialize the list of release records.  */
   buffer->pending.buffer_next = &buffer->pending;
@@ -2868,8 +3985,24 @@ BufferFromShm (SharedMemoryAttributes *attributes, Bool *error)
   buffer->activity.buffer_next = &buffer->activity;
   buffer->activity.buffer_last = &buffer->activity;
 
-  /* If the format is presentable, mark the buffer as presentable.  */
-  if (PictFormatIsPresentable (pict_format))
+  if (converted || copied)
+    {
+      /* Record where the contents to convert are.  The pixmap is
+	 not presentable, since later updates would then overwrite
+	 contents that are still being presented.  */
+      buffer->flags |= NeedsConversion;
+
+      if (copied)
+	buffer->flags |= CopyContents;
+
+      buffer->conversion_format = format;
+      buffer->shm_data = attributes->data;
+      buffer->shm_offset = attributes->offset;
+      buffer->shm_stride = attributes->stride;
+    }
+  else if (PictFormatIsPresentable (pict_format))
+    /* If the format is presentable, mark the buffer as
+       presentable.  */
     buffer->flags |= CanPresent;
 
   /* And mark it as opaque if it is.  */
@@ -2900,6 +4033,45 @@ GetScanlinePad (int depth)
    working with such images.  */
 #define Roundup(nbytes, pad) ((((nbytes) + ((pad) - 1)) / (pad)) * ((pad) >> 3))
 
+static Bool
+ValidateConvertedShmParams (uint32_t format, uint32_t width,
+			    uint32_t height, int32_t offset,
+			    int32_t stride, size_t pool_size)
+{
+  size_t offsets[3], strides[3], min_stride, total_size;
+  int n_planes, i, rows;
+
+  /* If any signed values are negative, return.  */
+  if (offset < 0 || stride < 0)
+    return False;
+
+  /* Compute where each plane of the buffer lies.  */
+  if (!GetShmConversionLayout (format, stride, height, offsets,
+			       strides, &total_size))
+    return False;
+
+  if (IntAddWrapv (offset, total_size, &total_size))
+    return False;
+
+  if (total_size > pool_size)
+    return False;
+
+  /* The contents are only read by the compositor, so any stride
+     large enough to hold a row of each plane is fine.  */
+  GetConversionFormatInfo (format, NULL, &n_planes, NULL);
+
+  for (i = 0; i < n_planes; ++i)
+    {
+      GetConversionPlaneSize (format, i, width, height, &min_stride,
+			      &rows);
+
+      if (strides[i] < min_stride)
+	return False;
+    }
+
+  return True;
+}
+
 static Bool
 ValidateShmParams (uint32_t format, uint32_t width, uint32_t height,
 		   int32_t offset, int32_t stride, size_t pool_size)
@@ -2908,6 +4080,12 @@ ValidateShmParams (uint32_t format, uint32_t width, uint32_t height,
   long wanted_stride;
   size_t total_size;
 
+  /* Buffers whose contents are converted have different
+     requirements.  */
+  if (GetConversionFormatInfo (format, NULL, NULL, NULL))
+    return ValidateConvertedShmParams (format, width, height, offset,
+				       stride, pool_size);
+
   /* Obtain the depth and bpp.  */
   depth = DepthForFormat (format, &bpp);
   XLAssert (depth != 0);
@@ -2971,6 +4149,7 @@ BufferFromSinglePixel (uint32_t red, uint32_t green, uint32_t blue,
   buffer->picture = picture;
   buffer->pixmap = pixmap;
   buffer->depth = compositor.n_planes;
+  buffer->format = compositor.argb_format;
 
   /* Initialize the list of release records.  */
   buffer->pending.buffer_next = &buffer->pending;
@@ -2995,14 +4174,38 @@ FreeAnyBuffer (RenderBuffer buffer)
   PresentRecord *record, *last;
   IdleCallback *idle, *last_idle;
   BufferActivityRecord *activity_record, *activity_last;
+  PictureBuffer **pending;
+  int i;
 
   picture_buffer = buffer.pointer;
 
+  /* Remove the buffer from the list of buffers with pending idle
+     callbacks.  They are run below.  */
+  if (picture_buffer->flags & PendingIdle)
+    {
+      for (pending = &idle_buffers; *pending != picture_buffer;
+	   pending = &(*pending)->idle_next)
+	/* Look for the buffer.  */;
+
+      *pending = picture_buffer->idle_next;
+    }
+
+  /* Unmap and close a dmabuf whose contents are converted.  */
+  UnmapDmabufPlanes (picture_buffer);
+
+  for (i = 0; i < picture_buffer->n_dmabuf_planes; ++i)
+    close (picture_buffer->dmabuf_fds[i]);
+
   XFreePixmap (compositor.display,
 	       picture_buffer->pixmap);
   XRenderFreePicture (compositor.display,
 		      picture_buffer->picture);
 
+  /* Free the pictures with a transform applied.  */
+  for (i = 0; i < picture_buffer->n_derived; ++i)
+    XRenderFreePicture (compositor.display,
+			picture_buffer->derived[i].picture);
+
   /* Free attached presentation records.  */
   record = picture_buffer->pending.buffer_next;
   while (record != &picture_buffer->pending)
@@ -3022,7 +4225,7 @@ FreeAnyBuffer (RenderBuffer buffer)
       activity_record = activity_record->buffer_next;
 
       UnlinkActivityRecord (activity_last);
-      XLFree (activity_last);
+      XLSlabFree (&activity_record_slab, activity_last);
     }
 
   /* Run and free all idle callbacks.  */
@@ -3065,11 +4268,12 @@ FreeSinglePixelBuffer (RenderBuffer buffer)
   FreeAnyBuffer (buffer);
 }
 
-static void
-SetupMitShm (void)
+static Bool
+QueryMitShm (void)
 {
   xcb_shm_query_version_reply_t *reply;
   xcb_shm_query_version_cookie_t cookie;
+  Bool rc;
 
   /* This shouldn't be freed.  */
   const xcb_query_extension_reply_t *ext;
@@ -3077,31 +4281,37 @@ SetupMitShm (void)
   ext = xcb_get_extension_data (compositor.conn, &xcb_shm_id);
 
   if (!ext || !ext->present)
-    {
-      fprintf (stderr, "The MIT-SHM extension is not supported by this X server.\n");
-      exit (1);
-    }
+    return False;
 
   cookie = xcb_shm_query_version (compositor.conn);
   reply = xcb_shm_query_version_reply (compositor.conn,
 				       cookie, NULL);
 
   if (!reply)
-    {
-      fprintf (stderr, "The MIT-SHM extension on this X server is too old.\n");
-      exit (1);
-    }
-  else if (reply->major_version < 1
-	   || (reply->major_version == 1
-	       && reply->minor_version < 2))
-    {
-      fprintf (stderr, "The MIT-SHM extension on this X server is too old"
-	       " to support POSIX shared memory.\n");
-      exit (1);
-    }
+    return False;
 
+  /* Version 1.2 is required to support POSIX shared memory.  */
+  rc = (reply->major_version > 1
+	|| (reply->major_version == 1
+	    && reply->minor_version >= 2));
   free (reply);
 
+  return rc;
+}
+
+static void
+SetupMitShm (void)
+{
+  have_mit_shm = QueryMitShm ();
+
+  if (!have_mit_shm)
+    /* Buffer contents will be copied to the X server through
+       ordinary requests instead, which is slower but works over the
+       network.  */
+    fprintf (stderr, "Warning: the X server does not support a new enough"
+	     " version of the MIT-SHM extension.\nShared memory buffers"
+	     " will be uploaded with XPutImage.\n");
+
   /* Now check that the mandatory image formats are supported.  */
 
   if (!HavePixmapFormat (24, 32))
@@ -3125,6 +4335,7 @@ InitBufferFuncs (void)
   xcb_dri3_query_version_cookie_t cookie;
   xcb_dri3_query_version_reply_t *reply;
   const xcb_query_extension_reply_t *ext;
+  int n;
 
   /* Obtain the list of supported pixmap formats from the X
      server.  */
@@ -3137,10 +4348,27 @@ InitBufferFuncs (void)
       return;
     }
 
-  /* Set up the MIT shared memory extension.  It is required to
-     work.  */
+  /* Set up the MIT shared memory extension.  Without it, buffer
+     contents are uploaded more slowly.  */
   SetupMitShm ();
 
+  /* Find out whether shm buffers should be copied.  */
+  InitShmBufferMode ();
+
+  /* Build the list of supported shm formats.  */
+  n = 0;
+
+  while (GetConversionFormat (n))
+    ++n;
+
+  shm_formats = XLMalloc (sizeof *shm_formats
+			  * (ArrayElements (default_formats) + n));
+  memcpy (shm_formats, default_formats, sizeof default_formats);
+  num_shm_formats = ArrayElements (default_formats);
+
+  for (n = 0; GetConversionFormat (n); ++n)
+    shm_formats[num_shm_formats++].format = GetConversionFormat (n);
+
   /* XRender should already have been set up; it is used for things
      other than rendering as well.  */
 
@@ -3175,10 +4403,360 @@ InitBufferFuncs (void)
     free (reply);
 }
 
+static Bool
+EnsureConversionSegment (size_t size)
+{
+  void *data;
+  int fd;
+
+  if (!have_mit_shm)
+    {
+      /* XPutImage copies the contents into the request, so the
+	 buffer can be reused immediately.  */
+      if (size > conversion_size)
+	{
+	  conversion_data = XLRealloc (conversion_data, size);
+	  conversion_size = size;
+	}
+
+      return True;
+    }
+
+  /* Wait for the X server to finish reading from the segment, since
+     it is about to be overwritten or detached.  */
+  if (conversion_last_put
+      && ((long) (LastKnownRequestProcessed (compositor.display)
+		  - conversion_last_put) < 0))
+    XSync (compositor.display, False);
+
+  conversion_last_put = 0;
+
+  if (size <= conversion_size)
+    return True;
+
+  /* The segment is too small.  Detach it and make a new one.  */
+  if (conversion_size)
+    {
+      xcb_shm_detach (compositor.conn, conversion_shminfo.shmseg);
+      munmap (conversion_data, conversion_size);
+      conversion_size = 0;
+    }
+
+  fd = XLOpenShm ();
+
+  if (fd < 0)
+    return False;
+
+  if (ftruncate (fd, size) < 0)
+    {
+      close (fd);
+      return False;
+    }
+
+  data = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+  if (data == MAP_FAILED)
+    {
+      close (fd);
+      return False;
+    }
+
+  /* XCB closes the file descriptor after sending it.  */
+  conversion_data = data;
+  conversion_shminfo.shmseg = xcb_generate_id (compositor.conn);
+  conversion_shminfo.shmaddr = data;
+  conversion_shminfo.readOnly = True;
+  xcb_shm_attach_fd (compositor.conn, conversion_shminfo.shmseg,
+		     fd, true);
+  conversion_size = size;
+
+  return True;
+}
+
+static GC
+GetConversionGC (PictureBuffer *buffer)
+{
+  int index;
+
+  index = buffer->depth == 32;
+
+  if (!conversion_gcs[index])
+    conversion_gcs[index] = XCreateGC (compositor.display,
+				       buffer->pixmap, 0, NULL);
+
+  return conversion_gcs[index];
+}
+
+static void
+GetConversionSource (PictureBuffer *buffer, ConversionSource *source)
+{
+  size_t offsets[3], strides[3], size;
+  unsigned char *data;
+  int i, n_planes;
+
+  if (!buffer->shm_data)
+    {
+      /* The buffer is a dmabuf mapped when it was created.  */
+      *source = buffer->dmabuf_source;
+      return;
+    }
+
+  /* The pool may have been remapped since the buffer was created, so
+     compute the location of each plane every time.  */
+  memset (source, 0, sizeof *source);
+  data = (unsigned char *) *buffer->shm_data + buffer->shm_offset;
+
+  if (buffer->flags & CopyContents)
+    {
+      /* The buffer is in a native format, and has one plane.  */
+      source->planes[0] = data;
+      source->strides[0] = buffer->shm_stride;
+      return;
+    }
+
+  GetConversionFormatInfo (buffer->conversion_format, NULL, &n_planes,
+			   NULL);
+  GetShmConversionLayout (buffer->conversion_format,
+			  buffer->shm_stride, buffer->height,
+			  offsets, strides, &size);
+
+  for (i = 0; i < n_planes; ++i)
+    {
+      source->planes[i] = data + offsets[i];
+      source->strides[i] = strides[i];
+    }
+}
+
+static void
+SyncDmabufPlanes (PictureBuffer *buffer, uint64_t flags)
+{
+  struct dma_buf_sync sync;
+  int i, rc;
+
+  /* Tell the kernel that the CPU is starting or ending access to the
+     mapped planes, so that caches are flushed as necessary.  */
+  sync.flags = flags | DMA_BUF_SYNC_READ;
+
+  for (i = 0; i < buffer->n_dmabuf_planes; ++i)
+    {
+      do
+	rc = ioctl (buffer->dmabuf_fds[i], DMA_BUF_IOCTL_SYNC, &sync);
+      while (rc < 0 && (errno == EINTR || errno == EAGAIN));
+    }
+}
+
+static void
+CopyRectangle (ConversionSource *source, int x, int y,
+	       void *dst, int width, int height)
+{
+  const unsigned char *src;
+  unsigned char *dst_row;
+  int row;
+
+  /* Copy the WIDTH by HEIGHT rectangle of 32 bit pixels at X, Y in
+     SOURCE to DST, without gaps between rows.  */
+  src = (source->planes[0] + (size_t) y * source->strides[0]
+	 + (size_t) x * 4);
+
+  dst_row = dst;
+
+  for (row = 0; row < height; ++row)
+    {
+      memcpy (dst_row, src, (size_t) width * 4);
+
+      src += source->strides[0];
+      dst_row += (size_t) width * 4;
+    }
+}
+
+static void
+ConvertBuffer (PictureBuffer *buffer, pixman_region32_t *damage,
+	       DrawParams *params)
+{
+  pixman_region32_t region;
+  pixman_box32_t *boxes, *work, extents;
+  int nboxes, i, width, height;
+  size_t size, offset;
+  ConversionSource source;
+  XImage image;
+  GC gc;
+
+  if (!damage)
+    pixman_region32_init_rect (&region, 0, 0, buffer->width,
+			       buffer->height);
+  else
+    {
+      /* Transform the damage into buffer coordinates, and clip it to
+	 the buffer.  */
+      boxes = pixman_region32_rectangles (damage, &nboxes);
+      work = alloca (sizeof *work * MAX (1, nboxes));
+
+      for (i = 0; i < nboxes; ++i)
+	{
+	  work[i] = boxes[i];
+	  ReverseTransformToBox (params, &work[i]);
+	}
+
+      pixman_region32_init_rects (&region, work, nboxes);
+      pixman_region32_intersect_rect (&region, &region, 0, 0,
+				      buffer->width, buffer->height);
+    }
+
+  boxes = pixman_region32_rectangles (&region, &nboxes);
+
+  /* Converting many small rectangles costs more in requests than it
+     saves in copying.  */
+  if (nboxes > MaxConversionBoxes)
+    {
+      extents = *pixman_region32_extents (&region);
+      boxes = &extents;
+      nboxes = 1;
+    }
+
+  /* Compute the size of the converted data.  */
+  size = 0;
+
+  for (i = 0; i < nboxes; ++i)
+    size += ((size_t) (boxes[i].x2 - boxes[i].x1)
+	     * (boxes[i].y2 - boxes[i].y1) * 4);
+
+  if (!size)
+    goto done;
+
+  if (!EnsureConversionSegment (size))
+    {
+      /* Leave the contents alone, and convert all of them upon the
+	 next update or use, which would otherwise only convert the
+	 damage posted then.  The buffer cannot be released early
+	 either.  */
+      buffer->flags &= ~(ContentsConverted | CanRelease);
+      goto end;
+    }
+
+  GetConversionSource (buffer, &source);
+  gc = GetConversionGC (buffer);
+  offset = 0;
+
+  if (buffer->n_dmabuf_planes)
+    SyncDmabufPlanes (buffer, DMA_BUF_SYNC_START);
+
+  for (i = 0; i < nboxes; ++i)
+    {
+      width = boxes[i].x2 - boxes[i].x1;
+      height = boxes[i].y2 - boxes[i].y1;
+
+      /* Convert the rectangle into the segment...  */
+      if (buffer->flags & CopyContents)
+	CopyRectangle (&source, boxes[i].x1, boxes[i].y1,
+		       conversion_data + offset, width,
+		       height);
+      else
+	ConvertPixels (buffer->conversion_format, &source, boxes[i].x1,
+		       boxes[i].y1, conversion_data + offset,
+		       width * 4, width, height);
+
+      /* ...and copy it to the pixmap.  */
+      memset (&image, 0, sizeof image);
+      image.width = width;
+      image.height = height;
+      image.format = ZPixmap;
+      image.data = conversion_data + offset;
+      image.byte_order = HostByteOrder;
+      image.bitmap_unit = BitmapUnit (compositor.display);
+      image.bitmap_bit_order = BitmapBitOrder (compositor.display);
+      image.bitmap_pad = 32;
+      image.depth = buffer->depth;
+      image.bytes_per_line = width * 4;
+      image.bits_per_pixel = 32;
+
+      if (have_mit_shm)
+	{
+	  image.obdata = (XPointer) &conversion_shminfo;
+	  XInitImage (&image);
+
+	  XShmPutImage (compositor.display, buffer->pixmap, gc, &image,
+			0, 0, boxes[i].x1, boxes[i].y1, width, height,
+			False);
+	}
+      else
+	{
+	  /* XPutImage splits the upload into several requests if it
+	     is larger than the maximum request size.  */
+	  XInitImage (&image);
+	  XPutImage (compositor.display, buffer->pixmap, gc, &image,
+		     0, 0, boxes[i].x1, boxes[i].y1, width, height);
+	}
+
+      offset += (size_t) width * height * 4;
+    }
+
+  conversion_last_put = NextRequest (compositor.display) - 1;
+
+  if (buffer->n_dmabuf_planes)
+    SyncDmabufPlanes (buffer, DMA_BUF_SYNC_END);
+
+ done:
+  /* The contents have been copied out of the client buffer, so it
+     can be released now.  */
+  buffer->flags |= ContentsConverted | CanRelease;
+
+ end:
+  pixman_region32_fini (&region);
+}
+
+static void
+UpdateBufferForDamage (RenderBuffer buffer, pixman_region32_t *damage,
+		       DrawParams *params)
+{
+  PictureBuffer *pict_buffer;
+
+  pict_buffer = buffer.pointer;
+
+  /* Only buffers whose contents are converted need updates; the
+     other buffers share memory with the client.  */
+  if (!(pict_buffer->flags & NeedsConversion))
+    return;
+
+  if (!(pict_buffer->flags & ContentsConverted)
+      || !damage || params->flags & TransformSet)
+    /* Convert the whole buffer.  */
+    ConvertBuffer (pict_buffer, NULL, params);
+  else if (pixman_region32_not_empty (damage))
+    ConvertBuffer (pict_buffer, damage, params);
+}
+
 static Bool
 CanReleaseNow (RenderBuffer buffer)
 {
-  return False;
+  PictureBuffer *pict_buffer;
+  Bool rc;
+
+  pict_buffer = buffer.pointer;
+
+  /* Return if the buffer contents were converted.  */
+  rc = (pict_buffer->flags & CanRelease) != 0;
+
+  /* Clear that flag now.  */
+  pict_buffer->flags &= ~CanRelease;
+
+  return rc;
+}
+
+static Bool
+IsDmabufFormatDirect (uint32_t drm_format)
+{
+  /* Dma-bufs in converted formats are copied to a pixmap.  */
+  return !IsConvertedDmabufFormat (drm_format);
+}
+
+static Bool
+IsBufferCopied (PictureBuffer *buffer)
+{
+  /* Return whether or not the contents of BUFFER have been copied
+     out of client memory, in which case the X server never reads
+     from the buffer itself.  */
+  return ((buffer->flags & NeedsConversion)
+	  && (buffer->flags & ContentsConverted));
 }
 
 static IdleCallbackKey
@@ -3205,6 +4783,17 @@ AddIdleCallback (RenderBuffer buffer, RenderTarget target,
   key->target->idle_callbacks.target_next->target_last = key;
   key->target->idle_callbacks.target_next = key;
 
+  if (IsBufferCopied (pict_buffer)
+      && !(pict_buffer->flags & PendingIdle))
+    {
+      /* The buffer is already idle, but the callback cannot be run
+	 before the caller receives the key.  Run it upon the next
+	 flush instead.  */
+      pict_buffer->idle_next = idle_buffers;
+      idle_buffers = pict_buffer;
+      pict_buffer->flags |= PendingIdle;
+    }
+
   return key;
 }
 
@@ -3233,6 +4822,11 @@ IsBufferIdle (RenderBuffer buffer, RenderTarget target)
   pict_buffer = buffer.pointer;
   pict_target = target.pointer;
 
+  /* A buffer whose contents have been copied is always idle, since
+     the activity records refer to the copy.  */
+  if (IsBufferCopied (pict_buffer))
+    return True;
+
   /* A buffer is idle if it has no pending activity or
      presentation on the given target.  */
   record = pict_buffer->activity.buffer_next;
@@ -3277,6 +4871,10 @@ WaitForIdle (RenderBuffer buffer, RenderTarget target)
 {
   XEvent event;
 
+  /* The roundtrip message for the last frame might not have been sent
+     yet.  Send it now, or the loop below will never finish.  */
+  SendRoundtripMessage ();
+
   while (!IsBufferIdle (buffer, target))
     {
       XIfEvent (compositor.display, &event, IdleEventPredicate,
@@ -3335,9 +4933,12 @@ static BufferFuncs picture_buffer_funcs =
     .validate_shm_params = ValidateShmParams,
     .buffer_from_single_pixel = BufferFromSinglePixel,
     .free_shm_buffer = FreeShmBuffer,
+    .free_shm_pool_data = FreeShmPoolData,
     .free_dmabuf_buffer = FreeDmabufBuffer,
     .free_single_pixel_buffer = FreeSinglePixelBuffer,
+    .update_buffer_for_damage = UpdateBufferForDamage,
     .can_release_now = CanReleaseNow,
+    .is_dmabuf_format_direct = IsDmabufFormatDirect,
     .add_idle_callback = AddIdleCallback,
     .cancel_idle_callback = CancelIdleCallback,
     .is_buffer_idle = IsBufferIdle,
@@ -3353,7 +4954,7 @@ HandleErrorForPictureRenderer (XErrorEvent *error)
   DmaBufRecord *record, *next;
 
   if (error->request_code == dri3_opcode
-      && error->minor_code == xDRI3BuffersFromPixmap)
+      && error->minor_code == xDRI3PixmapFromBuffers)
     {
       /* Something chouldn't be created.  Find what failed and unlink
 	 it.  */
@@ -3516,11 +5117,10 @@ HandleOneXEventForPictureRenderer (XEvent *event)
       low = event->xclient.data.l[1] & 0xffffffff;
       id = low | (high << 32);
 
-      /* Ignore the message if the id is too old.  */
-      if (id < next_roundtrip_id)
-	/* Otherwise, it means buffer creation was successful.
-	   Complete all pending buffer creation.  */
-	FinishBufferCreation ();
+      /* Buffer creation was successful for each record that is
+	 still pending and was sent before this message.  Complete
+	 it.  */
+      FinishBufferCreation (id);
 
       return True;
     }
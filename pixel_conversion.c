@@ -0,0 +1,505 @@
+/* Wayland compositor running on top of an X server.
+
+Copyright (C) 2022 to various contributors.
+
+This file is part of 12to11.
+
+12to11 is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+12to11 is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+for more details.
+
+You should have received a copy of the GNU General Public License
+along with 12to11.  If not, see <https://www.gnu.org/licenses/>.  */
+
+/* Conversion of buffer contents in formats the X server cannot use
+   directly to native ARGB8888 pixels.
+
+   The kernels are written with GCC vector extensions, which are
+   compiled to SSE2 on x86_64, NEON on ARM, and plain integer code
+   everywhere else.  On x86, each kernel is also compiled for AVX2,
+   and the dynamic linker picks the variant the CPU supports when
+   the program starts.  */
+
+#include <string.h>
+
+#include "compositor.h"
+
+#if defined __GNUC__ && !defined __clang__ && __GNUC__ >= 6	\
+  && (defined __x86_64__ || defined __i386__)
+#define ConversionKernel __attribute__ ((target_clones ("avx2", "default")))
+#define HaveAvx2Clones
+#else
+#define ConversionKernel
+#endif
+
+/* A vector of 8 pixels.  This is two registers with SSE2 or NEON,
+   and one with AVX2.  */
+typedef uint32_t PixelVector __attribute__ ((vector_size (32)));
+#define VectorPixels (sizeof (PixelVector) / sizeof (uint32_t))
+
+#if defined __GNUC__ && (__GNUC__ >= 9 || defined __clang__)
+/* A vector of 8 16 bit pixels, which is widened to a PixelVector
+   with __builtin_convertvector.  */
+typedef uint16_t PixelVector16 __attribute__ ((vector_size (16)));
+
+/* A vector of 8 luma samples, which is widened to a SampleVector
+   the same way.  */
+typedef uint8_t PixelVector8 __attribute__ ((vector_size (8)));
+#define HaveConvertVector
+#endif
+
+/* A vector of 8 signed intermediate values used by the YUV
+   conversion.  */
+typedef int32_t SampleVector __attribute__ ((vector_size (32)));
+
+typedef void (*ConversionFunc) (uint32_t *, const unsigned char *, int);
+typedef void (*YuvConversionFunc) (uint32_t *, const unsigned char *,
+				   const unsigned char *,
+				   const unsigned char *, int, int, int);
+
+typedef struct _ConversionFormat ConversionFormat;
+
+struct _ConversionFormat
+{
+  /* The wl_shm format.  This is also the DRM format, except for
+     ARGB8888 and XRGB8888, which are never converted.  */
+  uint32_t format;
+
+  /* The number of bits per pixel of the format, or of its first
+     plane.  */
+  int bpp;
+
+  /* The number of planes.  Formats with more than one plane are YUV
+     formats with chroma subsampled by 2 in both directions.  */
+  int n_planes;
+
+  /* Whether or not the format has an alpha channel.  */
+  Bool has_alpha;
+
+  /* Function that converts a row of WIDTH pixels.  */
+  ConversionFunc convert_row;
+
+  /* Function that converts a row of a YUV format instead.  */
+  YuvConversionFunc convert_yuv_row;
+};
+
+/* Each of these macros converts P, which is either a uint32_t or a
+   PixelVector, from the source format to ARGB8888.  Operands are
+   evaluated more than once.  */
+
+#define SwapRedBlue(p)						\
+  (((p) & 0xff00ff00) | (((p) >> 16) & 0xff) | (((p) & 0xff) << 16))
+#define SwapRedBlueOpaque(p) (SwapRedBlue (p) | 0xff000000)
+
+/* The 2101010 formats keep the 8 most significant bits of each
+   color channel, and scale the 2 bit alpha channel to 8 bits.  */
+#define Alpha2(p) ((((p) >> 30) * 0x55) << 24)
+#define Rgb2101010(p)						\
+  ((((p) >> 6) & 0xff0000) | (((p) >> 4) & 0xff00) | (((p) >> 2) & 0xff))
+#define Bgr2101010(p)						\
+  ((((p) << 14) & 0xff0000) | (((p) >> 4) & 0xff00) | (((p) >> 22) & 0xff))
+#define Argb2101010(p) (Alpha2 (p) | Rgb2101010 (p))
+#define Xrgb2101010(p) (0xff000000 | Rgb2101010 (p))
+#define Abgr2101010(p) (Alpha2 (p) | Bgr2101010 (p))
+#define Xbgr2101010(p) (0xff000000 | Bgr2101010 (p))
+
+/* RGB565 replicates the most significant bits of each channel into
+   the low bits, so that white stays white.  */
+#define Expand5(c) (((c) << 3) | ((c) >> 2))
+#define Expand6(c) (((c) << 2) | ((c) >> 4))
+#define Rgb565(p)						\
+  (0xff000000							\
+   | (Expand5 (((p) >> 11) & 0x1f) << 16)			\
+   | (Expand6 (((p) >> 5) & 0x3f) << 8)				\
+   | Expand5 ((p) & 0x1f))
+
+/* Define NAME as a function converting a row of 32 bit pixels with
+   the macro CONVERT.  The pixels are loaded and stored with memcpy,
+   as neither the source nor the destination are necessarily
+   aligned.  */
+
+#define DefineConversion32(name, convert)				\
+  ConversionKernel static void						\
+  name (uint32_t *dst, const unsigned char *src, int width)		\
+  {									\
+    PixelVector vector;							\
+    uint32_t pixel;							\
+    int i;								\
+									\
+    for (i = 0; i + (int) VectorPixels <= width; i += VectorPixels)	\
+      {									\
+	memcpy (&vector, src + i * 4, sizeof vector);			\
+	vector = convert (vector);					\
+	memcpy (dst + i, &vector, sizeof vector);			\
+      }									\
+									\
+    for (; i < width; ++i)						\
+      {									\
+	memcpy (&pixel, src + i * 4, sizeof pixel);			\
+	dst[i] = convert (pixel);					\
+      }									\
+  }
+
+DefineConversion32 (ConvertAbgr8888, SwapRedBlue)
+DefineConversion32 (ConvertXbgr8888, SwapRedBlueOpaque)
+DefineConversion32 (ConvertArgb2101010, Argb2101010)
+DefineConversion32 (ConvertXrgb2101010, Xrgb2101010)
+DefineConversion32 (ConvertAbgr2101010, Abgr2101010)
+DefineConversion32 (ConvertXbgr2101010, Xbgr2101010)
+
+ConversionKernel static void
+ConvertRgb565 (uint32_t *dst, const unsigned char *src, int width)
+{
+#ifdef HaveConvertVector
+  PixelVector16 narrow;
+  PixelVector vector;
+#endif
+  uint16_t pixel;
+  uint32_t wide;
+  int i;
+
+  i = 0;
+
+#ifdef HaveConvertVector
+  for (; i + (int) VectorPixels <= width; i += VectorPixels)
+    {
+      memcpy (&narrow, src + i * 2, sizeof narrow);
+      vector = __builtin_convertvector (narrow, PixelVector);
+      vector = Rgb565 (vector);
+      memcpy (dst + i, &vector, sizeof vector);
+    }
+#endif
+
+  for (; i < width; ++i)
+    {
+      memcpy (&pixel, src + i * 2, sizeof pixel);
+      wide = pixel;
+      dst[i] = Rgb565 (wide);
+    }
+}
+
+/* The YUV formats are converted with the BT.601 matrix, assuming
+   limited range, in 8 bit fixed point.  */
+
+#define YuvRed(c, d, e) (((c) + 409 * (e)) >> 8)
+#define YuvGreen(c, d, e) (((c) - 100 * (d) - 208 * (e)) >> 8)
+#define YuvBlue(c, d, e) (((c) + 516 * (d)) >> 8)
+
+static uint32_t
+YuvToXrgb (int y, int u, int v)
+{
+  int c, d, e, r, g, b;
+
+  c = (y - 16) * 298 + 128;
+  d = u - 128;
+  e = v - 128;
+
+  r = YuvRed (c, d, e);
+  g = YuvGreen (c, d, e);
+  b = YuvBlue (c, d, e);
+
+  r = MIN (MAX (r, 0), 255);
+  g = MIN (MAX (g, 0), 255);
+  b = MIN (MAX (b, 0), 255);
+
+  return 0xff000000 | (r << 16) | (g << 8) | b;
+}
+
+#ifdef HaveConvertVector
+
+/* Clamp each element of VECTOR to the range 0 to 255.  Comparisons
+   yield -1 for true and 0 for false, so they can be used as
+   masks.  */
+
+static inline void
+ClampVector (SampleVector *vector)
+{
+  SampleVector mask;
+
+  *vector &= *vector > 0;
+  mask = *vector > 255;
+  *vector = (*vector & ~mask) | (mask & 255);
+}
+
+#endif
+
+/* Convert WIDTH pixels of a YUV row starting at column X.  Y_ROW
+   points to the luma sample for column X.  U_ROW and V_ROW point to
+   the start of the chroma rows, whose samples are STEP bytes
+   apart.  */
+
+ConversionKernel static void
+ConvertYuvRow (uint32_t *dst, const unsigned char *y_row,
+	       const unsigned char *u_row, const unsigned char *v_row,
+	       int step, int x, int width)
+{
+#ifdef HaveConvertVector
+  PixelVector8 luma;
+  SampleVector c, d, e, r, g, b;
+  PixelVector vector;
+  int u0, u1, u2, u3, v0, v1, v2, v3, k;
+#endif
+  int i;
+
+  i = 0;
+
+  /* Convert the first pixel separately if it does not begin a pair
+     of pixels sharing chroma samples.  */
+  if (x & 1 && width)
+    {
+      dst[0] = YuvToXrgb (y_row[0], u_row[x / 2 * step],
+			  v_row[x / 2 * step]);
+      i = 1;
+    }
+
+#ifdef HaveConvertVector
+  for (; i + (int) VectorPixels <= width; i += VectorPixels)
+    {
+      memcpy (&luma, y_row + i, sizeof luma);
+      k = (x + i) / 2 * step;
+
+      u0 = u_row[k];
+      u1 = u_row[k + step];
+      u2 = u_row[k + step * 2];
+      u3 = u_row[k + step * 3];
+      v0 = v_row[k];
+      v1 = v_row[k + step];
+      v2 = v_row[k + step * 2];
+      v3 = v_row[k + step * 3];
+
+      c = __builtin_convertvector (luma, SampleVector);
+      c = (c - 16) * 298 + 128;
+      d = ((SampleVector) { u0, u0, u1, u1, u2, u2, u3, u3 }) - 128;
+      e = ((SampleVector) { v0, v0, v1, v1, v2, v2, v3, v3 }) - 128;
+
+      r = YuvRed (c, d, e);
+      g = YuvGreen (c, d, e);
+      b = YuvBlue (c, d, e);
+
+      ClampVector (&r);
+      ClampVector (&g);
+      ClampVector (&b);
+
+      vector = (PixelVector) (0xff000000 | (r << 16) | (g << 8) | b);
+      memcpy (dst + i, &vector, sizeof vector);
+    }
+#endif
+
+  for (; i < width; ++i)
+    dst[i] = YuvToXrgb (y_row[i], u_row[(x + i) / 2 * step],
+			v_row[(x + i) / 2 * step]);
+}
+
+static ConversionFormat conversion_formats[] =
+  {
+    { WL_SHM_FORMAT_ABGR8888, 32, 1, True, ConvertAbgr8888, NULL },
+    { WL_SHM_FORMAT_XBGR8888, 32, 1, False, ConvertXbgr8888, NULL },
+    { WL_SHM_FORMAT_RGB565, 16, 1, False, ConvertRgb565, NULL },
+    { WL_SHM_FORMAT_ARGB2101010, 32, 1, True, ConvertArgb2101010, NULL },
+    { WL_SHM_FORMAT_XRGB2101010, 32, 1, False, ConvertXrgb2101010, NULL },
+    { WL_SHM_FORMAT_ABGR2101010, 32, 1, True, ConvertAbgr2101010, NULL },
+    { WL_SHM_FORMAT_XBGR2101010, 32, 1, False, ConvertXbgr2101010, NULL },
+    { WL_SHM_FORMAT_NV12, 8, 2, False, NULL, ConvertYuvRow },
+    { WL_SHM_FORMAT_YUV420, 8, 3, False, NULL, ConvertYuvRow },
+  };
+
+static ConversionFormat *
+FindConversionFormat (uint32_t format)
+{
+  int i;
+
+  for (i = 0; i < ArrayElements (conversion_formats); ++i)
+    {
+      if (conversion_formats[i].format == format)
+	return &conversion_formats[i];
+    }
+
+  return NULL;
+}
+
+/* Return whether or not FORMAT can be converted to ARGB8888.  If it
+   can, set *BPP to its number of bits per pixel (of the first plane),
+   *N_PLANES to its number of planes, and *HAS_ALPHA to whether or not
+   it has an alpha channel.  */
+
+Bool
+GetConversionFormatInfo (uint32_t format, int *bpp, int *n_planes,
+			 Bool *has_alpha)
+{
+  ConversionFormat *info;
+
+  info = FindConversionFormat (format);
+
+  if (!info)
+    return False;
+
+  if (bpp)
+    *bpp = info->bpp;
+
+  if (n_planes)
+    *n_planes = info->n_planes;
+
+  if (has_alpha)
+    *has_alpha = info->has_alpha;
+
+  return True;
+}
+
+/* Return the Nth format that can be converted, or 0 if N is past the
+   end of the list.  */
+
+uint32_t
+GetConversionFormat (int n)
+{
+  if (n < 0 || n >= ArrayElements (conversion_formats))
+    return 0;
+
+  return conversion_formats[n].format;
+}
+
+/* Set *MIN_STRIDE to the minimum stride and *ROWS to the number of
+   rows of PLANE of a WIDTH by HEIGHT buffer in FORMAT.  */
+
+void
+GetConversionPlaneSize (uint32_t format, int plane, int width,
+			int height, size_t *min_stride, int *rows)
+{
+  ConversionFormat *info;
+
+  info = FindConversionFormat (format);
+  XLAssert (info != NULL && plane < info->n_planes);
+
+  if (!plane)
+    {
+      *min_stride = (size_t) width * info->bpp / 8;
+      *rows = height;
+      return;
+    }
+
+  /* The chroma planes are subsampled.  NV12 has one plane of
+     interleaved U and V samples, and YUV420 one plane for each.  */
+  *min_stride = ((size_t) width + 1) / 2 * (info->n_planes == 2 ? 2 : 1);
+  *rows = (height + 1) / 2;
+}
+
+/* Compute the layout of a buffer in FORMAT with the given STRIDE and
+   HEIGHT inside a shared memory pool, where the planes follow each
+   other.  Set OFFSETS and STRIDES to the offset and stride of each
+   plane, and *SIZE to the size of the buffer.  Return False if the
+   size overflows.  */
+
+Bool
+GetShmConversionLayout (uint32_t format, int32_t stride, int height,
+			size_t offsets[3], size_t strides[3],
+			size_t *size)
+{
+  ConversionFormat *info;
+  size_t plane_size;
+  int i;
+
+  info = FindConversionFormat (format);
+  XLAssert (info != NULL);
+
+  *size = 0;
+
+  for (i = 0; i < info->n_planes; ++i)
+    {
+      /* The U and V planes of YUV420 are half as wide as the Y
+	 plane, while the UV plane of NV12 is as wide.  */
+      strides[i] = (i && info->n_planes == 3) ? stride / 2 : stride;
+      offsets[i] = *size;
+
+      if (IntMultiplyWrapv (strides[i], (i ? (height + 1) / 2 : height),
+			    &plane_size)
+	  || IntAddWrapv (*size, plane_size, size))
+	return False;
+    }
+
+  return True;
+}
+
+/* Convert the WIDTH by HEIGHT pixels at X, Y in SOURCE, which is in
+   FORMAT, to ARGB8888 pixels at DST, whose rows are DST_STRIDE bytes
+   apart.  FORMAT must be a format for which GetConversionFormatInfo
+   returns True.  */
+
+void
+ConvertPixels (uint32_t format, ConversionSource *source, int x,
+	       int y, void *dst, size_t dst_stride, int width,
+	       int height)
+{
+  ConversionFormat *info;
+  const unsigned char *src_row, *u_row, *v_row;
+  unsigned char *dst_row;
+  int row, step;
+
+  info = FindConversionFormat (format);
+  XLAssert (info != NULL);
+
+  dst_row = dst;
+
+  if (info->n_planes == 1)
+    {
+      src_row = (source->planes[0] + (size_t) y * source->strides[0]
+		 + (size_t) x * info->bpp / 8);
+
+      for (row = 0; row < height; ++row)
+	{
+	  info->convert_row ((uint32_t *) dst_row, src_row, width);
+
+	  src_row += source->strides[0];
+	  dst_row += dst_stride;
+	}
+
+      return;
+    }
+
+  for (row = y; row < y + height; ++row)
+    {
+      src_row = source->planes[0] + (size_t) row * source->strides[0];
+      u_row = source->planes[1] + (size_t) (row / 2) * source->strides[1];
+
+      if (info->n_planes == 2)
+	{
+	  /* U and V are interleaved in the second plane.  */
+	  v_row = u_row + 1;
+	  step = 2;
+	}
+      else
+	{
+	  v_row = (source->planes[2]
+		   + (size_t) (row / 2) * source->strides[2]);
+	  step = 1;
+	}
+
+      info->convert_yuv_row ((uint32_t *) dst_row, src_row + x, u_row,
+			     v_row, step, x, width);
+      dst_row += dst_stride;
+    }
+}
+
+/* Return a description of the instruction set the conversion kernels
+   use on this machine.  */
+
+const char *
+GetConversionKernelName (void)
+{
+#ifdef HaveAvx2Clones
+  if (__builtin_cpu_supports ("avx2"))
+    return "AVX2";
+#endif
+
+#if defined __SSE2__
+  return "SSE2";
+#elif defined __ARM_NEON
+  return "NEON";
+#else
+  return "generic";
+#endif
+}
@@ -0,0 +1,961 @@
+/* Wayland compositor running on top of an X server.
+
+Copyright (C) 2022 to various contributors.
+
+This file is part of 12to11.
+
+12to11 is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+12to11 is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+for more details.
+
+You should have received a copy of the GNU General Public License
+along with 12to11.  If not, see <https://www.gnu.org/licenses/>.  */
+
+#include <alloca.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include "compositor.h"
+
+#include <X11/extensions/XShm.h>
+
+/* This renderer composites with pixman into an image in shared
+   memory owned by the compositor, and then copies the damaged parts
+   of that image to the X server with XShmPutImage.  It does not rely
+   on the X server accelerating the Render extension, which makes it
+   useful on servers such as Xvfb and Xvnc.  */
+
+typedef struct _PixmanTarget PixmanTarget;
+typedef struct _PixmanBuffer PixmanBuffer;
+typedef struct _FormatInfo FormatInfo;
+
+typedef enum _PixmanBufferType PixmanBufferType;
+
+enum
+  {
+    /* The target is a pixmap.  */
+    IsPixmap	  = 1,
+    /* The image of the target has been drawn to at least once.  */
+    ContentsValid = 2,
+  };
+
+enum _PixmanBufferType
+  {
+    ShmBuffer,
+    SinglePixelBuffer,
+  };
+
+struct _FormatInfo
+{
+  /* The Wayland format.  */
+  uint32_t wl_format;
+
+  /* The corresponding pixman format.  */
+  pixman_format_code_t pixman_format;
+
+  /* The number of bits per pixel.  */
+  int bpp;
+};
+
+struct _PixmanTarget
+{
+  /* The drawable the image is copied to.  */
+  Drawable drawable;
+
+  /* The graphics context used to copy to that drawable.  */
+  GC gc;
+
+  /* The width and height of the drawable.  */
+  int width, height;
+
+  /* The image holding the contents of the target, the XImage
+     describing it, and the shared memory segment it is stored in, or
+     NULL if the image has not been created yet.  */
+  pixman_image_t *image;
+  XImage *ximage;
+  XShmSegmentInfo shminfo;
+
+  /* The size of the shared memory segment.  */
+  size_t size;
+
+  /* The serial of the last request that copied from the image.  */
+  unsigned long last_put;
+
+  /* Some flags.  */
+  int flags;
+};
+
+struct _PixmanBuffer
+{
+  /* The type of this buffer.  */
+  PixmanBufferType type;
+
+  /* The width and height of this buffer.  */
+  int width, height;
+
+  /* The image of this buffer, or NULL.  */
+  pixman_image_t *image;
+
+  /* The format of the buffer.  NULL for single pixel buffers.  */
+  FormatInfo *format;
+
+  /* Pointer to the pool data of a shared memory buffer, and the pool
+     data the image was created for.  The pool data changes each time
+     the pool is resized.  */
+  void **data, *image_data;
+
+  /* The offset and stride of a shared memory buffer.  */
+  int32_t offset, stride;
+
+  /* Whether or not the buffer is opaque.  */
+  Bool opaque;
+};
+
+/* All known SHM formats.  */
+static FormatInfo known_shm_formats[] =
+  {
+    {
+      .wl_format = WL_SHM_FORMAT_ARGB8888,
+      .pixman_format = PIXMAN_a8r8g8b8,
+      .bpp = 32,
+    },
+    {
+      .wl_format = WL_SHM_FORMAT_XRGB8888,
+      .pixman_format = PIXMAN_x8r8g8b8,
+      .bpp = 32,
+    },
+    {
+      .wl_format = WL_SHM_FORMAT_ABGR8888,
+      .pixman_format = PIXMAN_a8b8g8r8,
+      .bpp = 32,
+    },
+    {
+      .wl_format = WL_SHM_FORMAT_XBGR8888,
+      .pixman_format = PIXMAN_x8b8g8r8,
+      .bpp = 32,
+    },
+    {
+      .wl_format = WL_SHM_FORMAT_ARGB2101010,
+      .pixman_format = PIXMAN_a2r10g10b10,
+      .bpp = 32,
+    },
+    {
+      .wl_format = WL_SHM_FORMAT_XRGB2101010,
+      .pixman_format = PIXMAN_x2r10g10b10,
+      .bpp = 32,
+    },
+    {
+      .wl_format = WL_SHM_FORMAT_ABGR2101010,
+      .pixman_format = PIXMAN_a2b10g10r10,
+      .bpp = 32,
+    },
+    {
+      .wl_format = WL_SHM_FORMAT_XBGR2101010,
+      .pixman_format = PIXMAN_x2b10g10r10,
+      .bpp = 32,
+    },
+  };
+
+/* The list of SHM formats advertised to clients.  */
+static ShmFormat *shm_formats;
+
+/* The number of those formats.  */
+static int n_shm_formats;
+
+/* The picture format used to create cursors from targets.  */
+static XRenderPictFormat *cursor_format;
+
+/* The pixman format of target images.  */
+static pixman_format_code_t target_format;
+
+static Bool
+InitRenderFuncs (void)
+{
+  int major, minor;
+  Bool pixmaps;
+  unsigned int byte_order;
+
+  /* Set up the default visual.  */
+  compositor.visual = PickTrueColorVisual (&compositor.n_planes);
+
+  if (!compositor.visual)
+    return False;
+
+  /* Only the common ARGB layout is supported for target images.  */
+  if (compositor.visual->red_mask != 0xff0000
+      || compositor.visual->green_mask != 0xff00
+      || compositor.visual->blue_mask != 0xff)
+    {
+      fprintf (stderr, "The pixman renderer does not support the"
+	       " layout of the default visual\n");
+      return False;
+    }
+
+  target_format = PIXMAN_a8r8g8b8;
+
+  /* Images are written in the byte order of this machine, which must
+     also be that of the X server.  */
+  byte_order = 1;
+
+  if (ImageByteOrder (compositor.display)
+      != (*(unsigned char *) &byte_order ? LSBFirst : MSBFirst))
+    {
+      fprintf (stderr, "The pixman renderer requires the X server"
+	       " to use the same byte order as the compositor\n");
+      return False;
+    }
+
+  /* Target images are copied to the X server through shared
+     memory.  */
+  if (!XShmQueryVersion (compositor.display, &major, &minor, &pixmaps)
+      || major < 1 || (major == 1 && minor < 2))
+    {
+      fprintf (stderr, "The pixman renderer requires version 1.2 of"
+	       " the MIT-SHM extension\n");
+      return False;
+    }
+
+  cursor_format = XRenderFindVisualFormat (compositor.display,
+					   compositor.visual);
+
+  if (!cursor_format)
+    return False;
+
+  return True;
+}
+
+static RenderTarget
+TargetFromDrawable (Drawable drawable, int width, int height)
+{
+  PixmanTarget *target;
+
+  target = XLCalloc (1, sizeof *target);
+  target->drawable = drawable;
+  target->gc = XCreateGC (compositor.display, drawable, 0, NULL);
+  target->width = width;
+  target->height = height;
+
+  return (RenderTarget) (void *) target;
+}
+
+static RenderTarget
+TargetFromWindow (Window window, unsigned long standard_event_mask)
+{
+  /* The size of the window is provided later by NoteTargetSize.  */
+  return TargetFromDrawable (window, 0, 0);
+}
+
+static RenderTarget
+TargetFromPixmap (Pixmap pixmap)
+{
+  Window root;
+  int x, y;
+  unsigned int width, height, border_width, depth;
+  RenderTarget target;
+
+  /* The size of a pixmap never changes, so obtain it now.  This is
+     only used for cursors, which are not created very often.  */
+  if (!XGetGeometry (compositor.display, pixmap, &root, &x, &y,
+		     &width, &height, &border_width, &depth))
+    width = height = 0;
+
+  target = TargetFromDrawable (pixmap, width, height);
+  ((PixmanTarget *) target.pointer)->flags |= IsPixmap;
+
+  return target;
+}
+
+static void
+SetStandardEventMask (RenderTarget target, unsigned long standard_event_mask)
+{
+  /* Nothing to do here.  */
+}
+
+static void
+NoteTargetSize (RenderTarget target, int width, int height)
+{
+  PixmanTarget *pixman_target;
+
+  pixman_target = target.pointer;
+  pixman_target->width = width;
+  pixman_target->height = height;
+}
+
+static Picture
+PictureFromTarget (RenderTarget target)
+{
+  PixmanTarget *pixman_target;
+  XRenderPictureAttributes picture_attrs;
+
+  /* This is just to pacify GCC; picture_attrs is not used as mask is
+     0.  */
+  memset (&picture_attrs, 0, sizeof picture_attrs);
+  pixman_target = target.pointer;
+
+  return XRenderCreatePicture (compositor.display,
+			       pixman_target->drawable,
+			       cursor_format, 0, &picture_attrs);
+}
+
+static void
+FreePictureFromTarget (Picture picture)
+{
+  XRenderFreePicture (compositor.display, picture);
+}
+
+static void
+FreeTargetImage (PixmanTarget *target)
+{
+  if (!target->image)
+    return;
+
+  pixman_image_unref (target->image);
+
+  /* Detach the segment.  The X server processes requests in order,
+     so it will not read from the segment after it is detached.  */
+  XShmDetach (compositor.display, &target->shminfo);
+  munmap (target->shminfo.shmaddr, target->size);
+
+  /* The data is not owned by the XImage.  */
+  target->ximage->data = NULL;
+  XDestroyImage (target->ximage);
+
+  target->image = NULL;
+  target->ximage = NULL;
+  target->last_put = 0;
+  target->flags &= ~ContentsValid;
+}
+
+static Bool
+CreateTargetImage (PixmanTarget *target)
+{
+  XImage *ximage;
+  size_t size;
+  void *data;
+  int fd;
+
+  ximage = XShmCreateImage (compositor.display, compositor.visual,
+			    compositor.n_planes, ZPixmap, NULL,
+			    &target->shminfo, target->width,
+			    target->height);
+
+  if (!ximage)
+    return False;
+
+  if (IntMultiplyWrapv ((size_t) ximage->bytes_per_line,
+			(size_t) target->height, &size))
+    goto error;
+
+  /* Allocate the shared memory segment.  */
+  fd = XLOpenShm ();
+
+  if (fd < 0)
+    goto error;
+
+  if (ftruncate (fd, size) < 0)
+    {
+      close (fd);
+      goto error;
+    }
+
+  data = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+  if (data == MAP_FAILED)
+    {
+      close (fd);
+      goto error;
+    }
+
+  /* Attach the segment.  XCB closes the file descriptor after it is
+     sent.  */
+  target->shminfo.shmseg = xcb_generate_id (compositor.conn);
+  target->shminfo.shmid = -1;
+  target->shminfo.shmaddr = data;
+  target->shminfo.readOnly = True;
+  xcb_shm_attach_fd (compositor.conn, target->shminfo.shmseg, fd, true);
+
+  ximage->data = data;
+  target->ximage = ximage;
+  target->size = size;
+  target->image
+    = pixman_image_create_bits (target_format, target->width,
+				target->height, data,
+				ximage->bytes_per_line);
+  return True;
+
+ error:
+  XDestroyImage (ximage);
+  return False;
+}
+
+/* Make sure the image of TARGET has the size of its drawable, and
+   that the X server is no longer reading from it.  Return whether or
+   not an image is available.  */
+
+static Bool
+EnsureTargetImage (PixmanTarget *target)
+{
+  if (target->image
+      && target->ximage->width == target->width
+      && target->ximage->height == target->height)
+    {
+      /* The X server might still be copying the last frame out of
+	 the image.  Wait for it to finish, which only involves a
+	 round trip if no event or reply has arrived since the copy
+	 was requested.  */
+      if (target->last_put
+	  && ((long) (LastKnownRequestProcessed (compositor.display)
+		      - target->last_put) < 0))
+	XSync (compositor.display, False);
+
+      target->last_put = 0;
+      return True;
+    }
+
+  FreeTargetImage (target);
+
+  if (target->width <= 0 || target->height <= 0)
+    return False;
+
+  return CreateTargetImage (target);
+}
+
+static void
+DestroyRenderTarget (RenderTarget target)
+{
+  PixmanTarget *pixman_target;
+
+  pixman_target = target.pointer;
+
+  FreeTargetImage (pixman_target);
+  XFreeGC (compositor.display, pixman_target->gc);
+  XLFree (pixman_target);
+}
+
+static void
+StartRender (RenderTarget target)
+{
+  EnsureTargetImage (target.pointer);
+}
+
+static void
+FillBoxesWithTransparency (RenderTarget target, pixman_box32_t *boxes,
+			   int nboxes, int min_x, int min_y)
+{
+  PixmanTarget *pixman_target;
+  pixman_box32_t *translated;
+  pixman_color_t color;
+  int i;
+
+  pixman_target = target.pointer;
+
+  if (!pixman_target->image)
+    return;
+
+  translated = alloca (sizeof *translated * nboxes);
+
+  for (i = 0; i < nboxes; ++i)
+    {
+      translated[i].x1 = boxes[i].x1 - min_x;
+      translated[i].y1 = boxes[i].y1 - min_y;
+      translated[i].x2 = boxes[i].x2 - min_x;
+      translated[i].y2 = boxes[i].y2 - min_y;
+    }
+
+  memset (&color, 0, sizeof color);
+  pixman_image_fill_boxes (PIXMAN_OP_SRC, pixman_target->image,
+			   &color, nboxes, translated);
+}
+
+static void
+ClearRectangle (RenderTarget target, int x, int y, int width, int height)
+{
+  pixman_box32_t box;
+
+  box.x1 = x;
+  box.x2 = x + width;
+  box.y1 = y;
+  box.y2 = y + height;
+
+  FillBoxesWithTransparency (target, &box, 1, 0, 0);
+}
+
+static pixman_op_t
+ConvertOperation (Operation op)
+{
+  switch (op)
+    {
+    case OperationOver:
+      return PIXMAN_OP_OVER;
+
+    case OperationSource:
+      return PIXMAN_OP_SRC;
+    }
+
+  abort ();
+}
+
+static pixman_image_t *
+GetBufferImage (PixmanBuffer *buffer)
+{
+  char *data;
+
+  if (buffer->type == SinglePixelBuffer)
+    return buffer->image;
+
+  /* Create the image for a shared memory buffer again if the pool
+     was moved by a resize.  */
+  data = (char *) *buffer->data + buffer->offset;
+
+  if (buffer->image && buffer->image_data == data)
+    return buffer->image;
+
+  if (buffer->image)
+    pixman_image_unref (buffer->image);
+
+  buffer->image
+    = pixman_image_create_bits (buffer->format->pixman_format,
+				buffer->width, buffer->height,
+				(uint32_t *) data, buffer->stride);
+  buffer->image_data = data;
+
+  return buffer->image;
+}
+
+static void
+ApplyTransform (PixmanBuffer *buffer, pixman_image_t *image,
+		DrawParams *params)
+{
+  pixman_transform_t transform;
+  XTransform xtransform;
+  Matrix ftransform;
+  int i, j;
+
+  if (buffer->type == SinglePixelBuffer)
+    /* Solid fills look the same under any transform.  */
+    return;
+
+  if (!params->flags)
+    {
+      pixman_image_set_transform (image, NULL);
+      return;
+    }
+
+  MatrixIdentity (&ftransform);
+
+  /* The buffer transform must always be applied first.  */
+
+  if (params->flags & TransformSet)
+    ApplyInverseTransform (buffer->width, buffer->height,
+			   &ftransform, params->transform);
+
+  /* Then, the scale, the offset, and finally the stretch.  */
+
+  if (params->flags & ScaleSet)
+    MatrixScale (&ftransform, 1.0 / params->scale,
+		 1.0 / params->scale);
+
+  if (params->flags & OffsetSet)
+    MatrixTranslate (&ftransform, params->off_x, params->off_y);
+
+  if (params->flags & StretchSet)
+    MatrixScale (&ftransform,
+		 params->crop_width / params->stretch_width,
+		 params->crop_height / params->stretch_height);
+
+  /* pixman transforms have the same layout as XTransforms.  */
+  MatrixExport (&ftransform, &xtransform);
+
+  for (i = 0; i < 3; ++i)
+    {
+      for (j = 0; j < 3; ++j)
+	transform.matrix[i][j] = xtransform.matrix[i][j];
+    }
+
+  pixman_image_set_transform (image, &transform);
+}
+
+static void
+Composite (RenderBuffer buffer, RenderTarget target,
+	   Operation op, int src_x, int src_y, int x, int y,
+	   int width, int height, DrawParams *params)
+{
+  PixmanBuffer *pixman_buffer;
+  PixmanTarget *pixman_target;
+  pixman_image_t *image;
+
+  pixman_buffer = buffer.pointer;
+  pixman_target = target.pointer;
+
+  if (!pixman_target->image)
+    return;
+
+  image = GetBufferImage (pixman_buffer);
+
+  if (!image)
+    return;
+
+  ApplyTransform (pixman_buffer, image, params);
+  pixman_image_composite32 (ConvertOperation (op), image, NULL,
+			    pixman_target->image, src_x, src_y,
+			    0, 0, x, y, width, height);
+}
+
+static void
+CompositeRegion (RenderBuffer buffer, RenderTarget target,
+		 Operation op, pixman_region32_t *region, int src_x,
+		 int src_y, int x, int y, DrawParams *params)
+{
+  PixmanBuffer *pixman_buffer;
+  PixmanTarget *pixman_target;
+  pixman_image_t *image;
+  pixman_box32_t *boxes;
+  pixman_op_t pixman_op;
+  int nboxes, i;
+
+  pixman_buffer = buffer.pointer;
+  pixman_target = target.pointer;
+
+  if (!pixman_target->image)
+    return;
+
+  image = GetBufferImage (pixman_buffer);
+
+  if (!image)
+    return;
+
+  /* Set the transform once for every box.  */
+  ApplyTransform (pixman_buffer, image, params);
+  pixman_op = ConvertOperation (op);
+  boxes = pixman_region32_rectangles (region, &nboxes);
+
+  for (i = 0; i < nboxes; ++i)
+    pixman_image_composite32 (pixman_op, image, NULL,
+			      pixman_target->image,
+			      boxes[i].x1 + src_x, boxes[i].y1 + src_y,
+			      0, 0, boxes[i].x1 + x, boxes[i].y1 + y,
+			      boxes[i].x2 - boxes[i].x1,
+			      boxes[i].y2 - boxes[i].y1);
+}
+
+static RenderCompletionKey
+FinishRender (RenderTarget target, pixman_region32_t *damage,
+	      RenderCompletionFunc callback, void *data)
+{
+  PixmanTarget *pixman_target;
+  pixman_box32_t *boxes, box;
+  int nboxes, i;
+
+  pixman_target = target.pointer;
+
+  if (!pixman_target->image)
+    return NULL;
+
+  if (damage)
+    boxes = pixman_region32_rectangles (damage, &nboxes);
+  else
+    {
+      box.x1 = 0;
+      box.y1 = 0;
+      box.x2 = pixman_target->width;
+      box.y2 = pixman_target->height;
+      boxes = &box;
+      nboxes = 1;
+    }
+
+  /* Copy only the damaged parts of the image to the drawable.  */
+  for (i = 0; i < nboxes; ++i)
+    {
+      box.x1 = MAX (0, boxes[i].x1);
+      box.y1 = MAX (0, boxes[i].y1);
+      box.x2 = MIN (pixman_target->width, boxes[i].x2);
+      box.y2 = MIN (pixman_target->height, boxes[i].y2);
+
+      if (box.x2 <= box.x1 || box.y2 <= box.y1)
+	continue;
+
+      XShmPutImage (compositor.display, pixman_target->drawable,
+		    pixman_target->gc, pixman_target->ximage,
+		    box.x1, box.y1, box.x1, box.y1,
+		    box.x2 - box.x1, box.y2 - box.y1, False);
+      pixman_target->last_put = NextRequest (compositor.display) - 1;
+    }
+
+  pixman_target->flags |= ContentsValid;
+
+  /* The contents are copied by the time the X server processes the
+     requests, so there is nothing to wait for.  */
+  return NULL;
+}
+
+static int
+TargetAge (RenderTarget target)
+{
+  PixmanTarget *pixman_target;
+
+  pixman_target = target.pointer;
+
+  /* The image keeps its contents until the target is resized.  */
+  if (!(pixman_target->flags & ContentsValid)
+      || pixman_target->ximage->width != pixman_target->width
+      || pixman_target->ximage->height != pixman_target->height)
+    return -1;
+
+  return 0;
+}
+
+static RenderFuncs pixman_render_funcs =
+  {
+    .init_render_funcs = InitRenderFuncs,
+    .target_from_window = TargetFromWindow,
+    .target_from_pixmap = TargetFromPixmap,
+    .set_standard_event_mask = SetStandardEventMask,
+    .note_target_size = NoteTargetSize,
+    .picture_from_target = PictureFromTarget,
+    .free_picture_from_target = FreePictureFromTarget,
+    .destroy_render_target = DestroyRenderTarget,
+    .start_render = StartRender,
+    .fill_boxes_with_transparency = FillBoxesWithTransparency,
+    .clear_rectangle = ClearRectangle,
+    .composite = Composite,
+    .composite_region = CompositeRegion,
+    .finish_render = FinishRender,
+    .target_age = TargetAge,
+    .flags = ImmediateRelease | NeverAges,
+  };
+
+static DrmFormat *
+GetDrmFormats (int *num_formats)
+{
+  /* dma-buf buffers cannot be read from the CPU.  */
+  *num_formats = 0;
+  return NULL;
+}
+
+static dev_t *
+GetRenderDevices (int *num_devices)
+{
+  *num_devices = 0;
+  return NULL;
+}
+
+static ShmFormat *
+GetShmFormats (int *num_formats)
+{
+  *num_formats = n_shm_formats;
+  return shm_formats;
+}
+
+static void
+CloseFileDescriptors (DmaBufAttributes *attributes)
+{
+  int i;
+
+  for (i = 0; i < attributes->n_planes; ++i)
+    close (attributes->fds[i]);
+}
+
+static RenderBuffer
+BufferFromDmaBuf (DmaBufAttributes *attributes, Bool *error)
+{
+  /* No DRM formats are advertised, so this should not be called.  */
+  CloseFileDescriptors (attributes);
+  *error = True;
+  return (RenderBuffer) NULL;
+}
+
+static void
+BufferFromDmaBufAsync (DmaBufAttributes *attributes,
+		       DmaBufSuccessFunc success_func,
+		       DmaBufFailureFunc failure_func,
+		       void *callback_data)
+{
+  CloseFileDescriptors (attributes);
+  failure_func (callback_data);
+}
+
+static FormatInfo *
+FindFormatInfo (uint32_t wl_format)
+{
+  int i;
+
+  for (i = 0; i < ArrayElements (known_shm_formats); ++i)
+    {
+      if (known_shm_formats[i].wl_format == wl_format)
+	return &known_shm_formats[i];
+    }
+
+  return NULL;
+}
+
+static RenderBuffer
+BufferFromShm (SharedMemoryAttributes *attributes, Bool *error)
+{
+  PixmanBuffer *buffer;
+
+  buffer = XLCalloc (1, sizeof *buffer);
+  buffer->type = ShmBuffer;
+  buffer->width = attributes->width;
+  buffer->height = attributes->height;
+  buffer->format = FindFormatInfo (attributes->format);
+  XLAssert (buffer->format != NULL);
+
+  buffer->data = attributes->data;
+  buffer->offset = attributes->offset;
+  buffer->stride = attributes->stride;
+  buffer->opaque = !PIXMAN_FORMAT_A (buffer->format->pixman_format);
+
+  /* The image is created upon first use.  */
+  return (RenderBuffer) (void *) buffer;
+}
+
+static Bool
+ValidateShmParams (uint32_t format, uint32_t width, uint32_t height,
+		   int32_t offset, int32_t stride, size_t pool_size)
+{
+  size_t total, after, min_stride;
+  FormatInfo *info;
+
+  if (stride < 0 || offset < 0)
+    /* Return False if any signed values are less than 0.  */
+    return False;
+
+  /* Calculate the total size of the buffer, and make sure it is
+     smaller than the pool size.  */
+  if (IntMultiplyWrapv ((size_t) height, stride, &total))
+    return False;
+
+  if (IntAddWrapv (offset, total, &after)
+      || after > pool_size)
+    return False;
+
+  info = FindFormatInfo (format);
+
+  if (!info)
+    return False;
+
+  /* If the stride is not enough to hold width, or is not a multiple
+     of the pixel size, return.  Every format has 4 byte pixels, so
+     the stride is also suitable for pixman.  */
+  if (IntMultiplyWrapv ((size_t) width, info->bpp / 8, &min_stride)
+      || stride < min_stride || stride % (info->bpp / 8))
+    return False;
+
+  return True;
+}
+
+static RenderBuffer
+BufferFromSinglePixel (uint32_t red, uint32_t green, uint32_t blue,
+		       uint32_t alpha, Bool *error)
+{
+  PixmanBuffer *buffer;
+  pixman_color_t color;
+
+  color.red = red >> 16;
+  color.green = green >> 16;
+  color.blue = blue >> 16;
+  color.alpha = alpha >> 16;
+
+  buffer = XLCalloc (1, sizeof *buffer);
+  buffer->type = SinglePixelBuffer;
+  buffer->width = 1;
+  buffer->height = 1;
+  buffer->image = pixman_image_create_solid_fill (&color);
+  buffer->opaque = color.alpha == 0xffff;
+
+  return (RenderBuffer) (void *) buffer;
+}
+
+static void
+FreeAnyBuffer (RenderBuffer buffer)
+{
+  PixmanBuffer *pixman_buffer;
+
+  pixman_buffer = buffer.pointer;
+
+  if (pixman_buffer->image)
+    pixman_image_unref (pixman_buffer->image);
+
+  XLFree (pixman_buffer);
+}
+
+static void
+FreeShmBuffer (RenderBuffer buffer)
+{
+  FreeAnyBuffer (buffer);
+}
+
+static void
+FreeDmabufBuffer (RenderBuffer buffer)
+{
+  FreeAnyBuffer (buffer);
+}
+
+static void
+FreeSinglePixelBuffer (RenderBuffer buffer)
+{
+  FreeAnyBuffer (buffer);
+}
+
+static Bool
+CanReleaseNow (RenderBuffer buffer)
+{
+  /* Buffer contents are read directly when compositing.  */
+  return False;
+}
+
+static Bool
+IsBufferOpaque (RenderBuffer buffer)
+{
+  PixmanBuffer *pixman_buffer;
+
+  pixman_buffer = buffer.pointer;
+  return pixman_buffer->opaque;
+}
+
+static void
+InitBufferFuncs (void)
+{
+  int i;
+
+  n_shm_formats = ArrayElements (known_shm_formats);
+  shm_formats = XLMalloc (sizeof *shm_formats * n_shm_formats);
+
+  for (i = 0; i < n_shm_formats; ++i)
+    shm_formats[i].format = known_shm_formats[i].wl_format;
+}
+
+static BufferFuncs pixman_buffer_funcs =
+  {
+    .get_drm_formats = GetDrmFormats,
+    .get_render_devices = GetRenderDevices,
+    .get_shm_formats = GetShmFormats,
+    .buffer_from_dma_buf = BufferFromDmaBuf,
+    .buffer_from_dma_buf_async = BufferFromDmaBufAsync,
+    .buffer_from_shm = BufferFromShm,
+    .validate_shm_params = ValidateShmParams,
+    .buffer_from_single_pixel = BufferFromSinglePixel,
+    .free_shm_buffer = FreeShmBuffer,
+    .free_dmabuf_buffer = FreeDmabufBuffer,
+    .free_single_pixel_buffer = FreeSinglePixelBuffer,
+    .can_release_now = CanReleaseNow,
+    .is_buffer_opaque = IsBufferOpaque,
+    .init_buffer_funcs = InitBufferFuncs,
+  };
+
+void
+InitPixmanRenderer (void)
+{
+  RegisterStaticRenderer ("pixman", &pixman_render_funcs,
+			  &pixman_buffer_funcs);
+}
@@ -57,7 +57,7 @@ int renderer_flags;
 static Renderer *
 AllocateRenderer (void)
 {
-  static Renderer renderers[2];
+  static Renderer renderers[3];
   static int used;
 
   if (used < ArrayElements (renderers))
@@ -164,6 +164,32 @@ RenderComposite (RenderBuffer source, RenderTarget target, Operation op,
 			  width, height, draw_params);
 }
 
+void
+RenderCompositeRegion (RenderBuffer source, RenderTarget target,
+		       Operation op, pixman_region32_t *region,
+		       int src_x, int src_y, int x, int y,
+		       DrawParams *draw_params)
+{
+  pixman_box32_t *boxes;
+  int nboxes, i;
+
+  if (render_funcs.composite_region)
+    {
+      render_funcs.composite_region (source, target, op, region,
+				     src_x, src_y, x, y, draw_params);
+      return;
+    }
+
+  boxes = pixman_region32_rectangles (region, &nboxes);
+
+  for (i = 0; i < nboxes; ++i)
+    render_funcs.composite (source, target, op,
+			    boxes[i].x1 + src_x, boxes[i].y1 + src_y,
+			    boxes[i].x1 + x, boxes[i].y1 + y,
+			    boxes[i].x2 - boxes[i].x1,
+			    boxes[i].y2 - boxes[i].y1, draw_params);
+}
+
 RenderCompletionKey
 RenderFinishRender (RenderTarget target, pixman_region32_t *damage,
 		    RenderCompletionFunc function, void *data)
@@ -244,6 +270,13 @@ RenderCancelPresentationCallback (PresentCompletionKey key)
   render_funcs.cancel_presentation_callback (key);
 }
 
+void
+RenderFlush (void)
+{
+  if (render_funcs.flush)
+    render_funcs.flush ();
+}
+
 DrmFormat *
 RenderGetDrmFormats (int *n_formats)
 {
@@ -308,6 +341,13 @@ RenderFreeShmBuffer (RenderBuffer buffer)
   return buffer_funcs.free_shm_buffer (buffer);
 }
 
+void
+RenderFreeShmPoolData (void *data)
+{
+  if (buffer_funcs.free_shm_pool_data)
+    buffer_funcs.free_shm_pool_data (data);
+}
+
 void
 RenderFreeDmabufBuffer (RenderBuffer buffer)
 {
@@ -336,6 +376,15 @@ RenderCanReleaseNow (RenderBuffer buffer)
   return buffer_funcs.can_release_now (buffer);
 }
 
+Bool
+RenderIsDmabufFormatDirect (uint32_t drm_format)
+{
+  if (!buffer_funcs.is_dmabuf_format_direct)
+    return True;
+
+  return buffer_funcs.is_dmabuf_format_direct (drm_format);
+}
+
 IdleCallbackKey
 RenderAddIdleCallback (RenderBuffer buffer, RenderTarget target,
 		       BufferIdleFunc function, void *data)
@@ -379,6 +428,38 @@ RenderIsBufferOpaque (RenderBuffer buffer)
   return buffer_funcs.is_buffer_opaque (buffer);
 }
 
+Visual *
+PickTrueColorVisual (int *depth)
+{
+  int n_visuals;
+  XVisualInfo vinfo, *visuals;
+  Visual *selection;
+
+  /* Return a 32-bit TrueColor visual on the default screen, and set
+     *DEPTH to its depth, or return NULL if there is none.  Renderers
+     that composite with XRender or on the CPU use it.  */
+
+  vinfo.screen = DefaultScreen (compositor.display);
+  vinfo.class = TrueColor;
+  vinfo.depth = 32;
+
+  visuals = XGetVisualInfo (compositor.display, (VisualScreenMask
+						 | VisualClassMask
+						 | VisualDepthMask),
+			    &vinfo, &n_visuals);
+
+  if (n_visuals)
+    {
+      selection = visuals[0].visual;
+      *depth = visuals[0].depth;
+      XFree (visuals);
+
+      return selection;
+    }
+
+  return NULL;
+}
+
 void
 RegisterStaticRenderer (const char *name,
 			RenderFuncs *render_funcs,
@@ -512,6 +593,7 @@ PickRenderer (void)
 void
 InitRenderers (void)
 {
+  InitPixmanRenderer ();
 #ifdef HaveEglSupport
   InitEgl ();
 #endif
@@ -18,23 +18,40 @@ You should have received a copy of the GNU General Public License
 along with 12to11.  If not, see <https://www.gnu.org/licenses/>.  */
 
 #include <sys/param.h>
+#include <sys/epoll.h>
 
 #include <stdio.h>
+#include <errno.h>
 #include <poll.h>
-#include <alloca.h>
+#include <unistd.h>
 
 #include "compositor.h"
 
+/* Maximum number of events read from the epoll descriptor at once.
+   Descriptors that remain ready after that are picked up by the next
+   iteration of the event loop, since they are level-triggered.  */
+#define MaxEpollEvents 64
+
 typedef struct _PollFd PollFd;
 
 struct _PollFd
 {
-  /* The next and last writable fd in this chain.  */
-  PollFd *next, *last;
+  /* The next record in the list of removed records waiting to be
+     freed.  */
+  PollFd *next;
+
+  /* The next and last records in the list of descriptors that epoll
+     cannot watch, or NULL if this descriptor is watched by epoll.  */
+  PollFd *next_ready, *last_ready;
 
   /* The file descriptor itself.  */
   int write_fd;
 
+  /* The file descriptor actually registered with epoll.  This is
+     normally write_fd, but is a duplicate of it if write_fd is
+     already being watched by another record.  */
+  int epoll_fd;
+
   /* Callback run with the fd number and data when the fd becomes
      writable or readable.  */
   void (*poll_callback) (int, void *, PollFd *);
@@ -46,83 +63,202 @@ struct _PollFd
   int direction;
 };
 
-/* Number of file descriptors for which we are waiting for something
-   to be written.  */
-static int num_poll_fd;
+/* The epoll descriptor holding every file descriptor that is being
+   waited on.  */
+static int epoll_fd;
 
-/* Linked list of file descriptors and write callbacks.  */
-static PollFd poll_fds;
+/* List of records that were removed, and are waiting to be freed
+   once the event loop can no longer refer to them.  */
+static PollFd *dead_poll_fds;
 
-WriteFd *
-XLAddWriteFd (int fd, void *data, void (*poll_callback) (int, void *,
-							 WriteFd *))
+/* List of records for descriptors that epoll cannot watch, such as
+   regular files.  Such descriptors are always ready for reading and
+   writing, so their callbacks are run every iteration of the event
+   loop.  */
+static PollFd always_ready_fds;
+
+static PollFd *
+AddPollFd (int fd, void *data, void (*poll_callback) (int, void *,
+						      PollFd *),
+	   int direction)
 {
-  WriteFd *record;
+  PollFd *record;
+  struct epoll_event event;
 
   record = XLMalloc (sizeof *record);
-  record->next = poll_fds.next;
-  record->last = &poll_fds;
+  record->next = NULL;
+  record->next_ready = NULL;
+  record->last_ready = NULL;
   record->write_fd = fd;
+  record->epoll_fd = fd;
   record->poll_callback = poll_callback;
   record->data = data;
-  record->direction = 1;
+  record->direction = direction;
+
+  event.data.ptr = record;
 
-  poll_fds.next->last = record;
-  poll_fds.next = record;
+  if (direction)
+    event.events = EPOLLOUT;
+  else
+    /* See https://www.greenend.org.uk/rjk/tech/poll.html for why
+       POLLHUP.  EPOLLHUP is always reported anyway.  */
+    event.events = EPOLLIN | EPOLLHUP;
 
-  num_poll_fd++;
+  if (epoll_ctl (epoll_fd, EPOLL_CTL_ADD, fd, &event))
+    {
+      if (errno == EPERM)
+	{
+	  /* epoll does not support this kind of file, which is always
+	     ready.  Clients can legitimately pass regular files to
+	     data transfer requests, so link the record onto the list
+	     of descriptors dispatched every iteration instead.  */
+	  record->next_ready = always_ready_fds.next_ready;
+	  record->last_ready = &always_ready_fds;
+	  always_ready_fds.next_ready->last_ready = record;
+	  always_ready_fds.next_ready = record;
+
+	  return record;
+	}
+
+      if (errno != EEXIST)
+	{
+	  perror ("epoll_ctl");
+	  abort ();
+	}
+
+      /* The same file descriptor is already being watched by another
+	 record.  epoll can only hold one registration per descriptor,
+	 so register a duplicate instead.  */
+      record->epoll_fd = dup (fd);
+
+      if (record->epoll_fd == -1
+	  || epoll_ctl (epoll_fd, EPOLL_CTL_ADD, record->epoll_fd,
+			&event))
+	{
+	  perror ("epoll_ctl");
+	  abort ();
+	}
+    }
 
   return record;
 }
 
-ReadFd *
-XLAddReadFd (int fd, void *data, void (*poll_callback) (int, void *,
-							ReadFd *))
+static void
+RemovePollFd (PollFd *fd)
 {
-  WriteFd *record;
+  if (fd->next_ready)
+    {
+      /* Unlink the record from the list of always ready descriptors.
+	 Its own links are left intact, so that DispatchAlwaysReadyFds
+	 can continue past it if it is removed by a callback.  */
+      fd->next_ready->last_ready = fd->last_ready;
+      fd->last_ready->next_ready = fd->next_ready;
 
-  record = XLMalloc (sizeof *record);
-  record->next = poll_fds.next;
-  record->last = &poll_fds;
-  record->write_fd = fd;
-  record->poll_callback = poll_callback;
-  record->data = data;
-  record->direction = 0;
+      goto finish;
+    }
 
-  poll_fds.next->last = record;
-  poll_fds.next = record;
+  /* Stop watching the descriptor immediately.  This can fail if the
+     caller has already closed the file descriptor, which also removes
+     it from the epoll set.  */
+  epoll_ctl (epoll_fd, EPOLL_CTL_DEL, fd->epoll_fd, NULL);
 
-  num_poll_fd++;
+  if (fd->epoll_fd != fd->write_fd)
+    close (fd->epoll_fd);
 
-  return record;
+ finish:
+  /* Mark this record as invalid.  Events for it might still be
+     pending dispatch in this iteration of the event loop, so it is
+     only freed after dispatch completes.  */
+  fd->write_fd = -1;
+  fd->next = dead_poll_fds;
+  dead_poll_fds = fd;
+}
+
+static void
+FreeDeadPollFds (void)
+{
+  PollFd *fd, *next;
+
+  fd = dead_poll_fds;
+
+  while (fd)
+    {
+      next = fd->next;
+      XLFree (fd);
+      fd = next;
+    }
+
+  dead_poll_fds = NULL;
+}
+
+WriteFd *
+XLAddWriteFd (int fd, void *data, void (*poll_callback) (int, void *,
+							 WriteFd *))
+{
+  return AddPollFd (fd, data, poll_callback, 1);
+}
+
+ReadFd *
+XLAddReadFd (int fd, void *data, void (*poll_callback) (int, void *,
+							ReadFd *))
+{
+  return AddPollFd (fd, data, poll_callback, 0);
 }
 
 void
 XLRemoveWriteFd (WriteFd *fd)
 {
-  /* Mark this record as invalid.  Records cannot safely change while
-     the event loop is in progress, so we remove all invalid records
-     immediately before polling.  */
-  fd->write_fd = -1;
+  RemovePollFd (fd);
 }
 
 void
 XLRemoveReadFd (ReadFd *fd)
 {
-  /* Mark this record as invalid.  Records cannot safely change while
-     the event loop is in progress, so we remove all invalid records
-     immediately before polling.  */
-  fd->write_fd = -1;
+  RemovePollFd (fd);
+}
+
+static void
+DispatchPollFds (void)
+{
+  struct epoll_event events[MaxEpollEvents];
+  PollFd *record;
+  int n_events, i;
+
+  n_events = epoll_wait (epoll_fd, events, MaxEpollEvents, 0);
+
+  for (i = 0; i < n_events; ++i)
+    {
+      record = events[i].data.ptr;
+
+      /* Check that the record is still valid, and wasn't removed
+	 while handling X events or a previous callback.  */
+      if (record->write_fd != -1)
+	/* Then call the poll callback.  */
+	record->poll_callback (record->write_fd, record->data,
+			       record);
+    }
 }
 
 static void
-RemoveWriteFd (WriteFd *fd)
+DispatchAlwaysReadyFds (void)
 {
-  fd->next->last = fd->last;
-  fd->last->next = fd->next;
+  PollFd *record, *next;
 
-  num_poll_fd--;
-  XLFree (fd);
+  record = always_ready_fds.next_ready;
+
+  while (record != &always_ready_fds)
+    {
+      next = record->next_ready;
+
+      /* Records removed by a callback are only freed after dispatch
+	 completes, and keep pointing to the record that followed
+	 them, so NEXT remains usable here.  */
+      if (record->write_fd != -1)
+	record->poll_callback (record->write_fd, record->data,
+			       record);
+
+      record = next;
+    }
 }
 
 static void
@@ -196,20 +332,13 @@ ReadXEvents (void)
 static void
 RunStep (void)
 {
-  int x_connection, wl_connection, rc, i, j;
+  int x_connection, wl_connection, rc;
   struct timespec timeout;
-  struct pollfd *fds;
-  PollFd **pollfds, *item, *last;
-
-  fds = alloca (sizeof *fds * (num_poll_fd + 2));
-
-  /* This is used as an optimization to not have to loop over the
-     entire descriptor list twice.  */
-  pollfds = alloca (sizeof *pollfds * num_poll_fd);
+  struct pollfd fds[3];
 
   /* Run timers.  This, and draining selection transfers, must be done
-     before setting up poll file descriptors, since timer callbacks
-     can change the write fd list.  */
+     before polling, since timer callbacks can change the write fd
+     list.  */
   timeout = TimerCheck ();
 
   /* Drain complete selection transfers.  */
@@ -220,7 +349,9 @@ RunStep (void)
   ProcessPendingDisconnectClients ();
 
   /* FinishTransfers can potentially send events to Wayland clients
-     and make X requests.  Flush after it is called.  */
+     and make X requests.  Flush after it is called, along with any
+     requests the renderer deferred until now.  */
+  RenderFlush ();
   XFlush (compositor.display);
   wl_display_flush_clients (compositor.wl_display);
 
@@ -230,42 +361,13 @@ RunStep (void)
 
   fds[0].fd = x_connection;
   fds[1].fd = wl_connection;
+  fds[2].fd = epoll_fd;
   fds[0].events = POLLIN;
   fds[1].events = POLLIN;
+  fds[2].events = POLLIN;
   fds[0].revents = 0;
   fds[1].revents = 0;
-
-  /* Copy valid write file descriptors into the pollfd array, while
-     removing invalid ones.  */
-  item = poll_fds.next;
-  i = 0;
-
-  while (item != &poll_fds)
-    {
-      last = item;
-      item = item->next;
-
-      if (last->write_fd == -1)
-	{
-	  /* Remove this invalid pollfd.  */
-	  RemoveWriteFd (last);
-	  continue;
-	}
-
-      /* Otherwise, add the fd and bump i.  */
-
-      fds[2 + i].fd = last->write_fd;
-      fds[2 + i].events = POLLOUT;
-      fds[2 + i].revents = 0;
-      pollfds[i] = last;
-
-      if (!last->direction)
-	/* See https://www.greenend.org.uk/rjk/tech/poll.html for why
-	   POLLHUP.  */
-	fds[2 + i].events = POLLIN | POLLHUP;
-
-      i += 1;
-    }
+  fds[2].revents = 0;
 
   /* Handle any events already in the queue, which can happen if
      something inside ReadXEvents synced.  */
@@ -273,6 +375,7 @@ RunStep (void)
     {
       ReadXEvents ();
 
+      RenderFlush ();
       XFlush (compositor.display);
       wl_display_flush_clients (compositor.wl_display);
     }
@@ -281,7 +384,12 @@ RunStep (void)
      errors.  */
   ProcessPendingDisconnectClients ();
 
-  rc = ProcessPoll (fds, 2 + i, &timeout);
+  /* Don't wait at all if there are descriptors that are always
+     ready.  */
+  if (always_ready_fds.next_ready != &always_ready_fds)
+    timeout = MakeTimespec (0, 0);
+
+  rc = ProcessPoll (fds, ArrayElements (fds), &timeout);
 
   if (rc > 0)
     {
@@ -291,19 +399,19 @@ RunStep (void)
       if (fds[1].revents & POLLIN)
 	wl_event_loop_dispatch (compositor.wl_event_loop, -1);
 
-      /* Now see how many write fds are set.  */
-      for (j = 0; j < i; ++j)
-	{
-	  if (fds[2 + j].revents & (POLLOUT | POLLIN | POLLHUP)
-	      /* Check that pollfds[j] is still valid, and wasn't
-		 removed while handling X events.  */
-	      && pollfds[j]->write_fd != -1)
-	    /* Then call the poll callback.  */
-	    pollfds[j]->poll_callback (pollfds[j]->write_fd,
-				       pollfds[j]->data, pollfds[j]);
-	}
+      /* The epoll descriptor becomes readable once any of the read
+	 or write fds is ready.  */
+      if (fds[2].revents & POLLIN)
+	DispatchPollFds ();
     }
 
+  /* Run the callbacks of descriptors that epoll cannot watch.  */
+  DispatchAlwaysReadyFds ();
+
+  /* Free records that were removed, now that nothing refers to
+     them.  */
+  FreeDeadPollFds ();
+
   /* Disconnect clients that have experienced out-of-memory
      errors.  */
   ProcessPendingDisconnectClients ();
@@ -312,10 +420,19 @@ RunStep (void)
 void __attribute__ ((noreturn))
 XLRunCompositor (void)
 {
-  /* Set up the sentinel node for file descriptors that are being
+  /* Set up the epoll descriptor for file descriptors that are being
      polled from.  */
-  poll_fds.next = &poll_fds;
-  poll_fds.last = &poll_fds;
+  epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+
+  if (epoll_fd == -1)
+    {
+      perror ("epoll_create1");
+      exit (1);
+    }
+
+  /* Initialize the list of descriptors that are always ready.  */
+  always_ready_fds.next_ready = &always_ready_fds;
+  always_ready_fds.last_ready = &always_ready_fds;
 
   while (True)
     RunStep ();
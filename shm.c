@@ -49,6 +49,10 @@ typedef struct _Pool
   /* Pointer to the raw data in this pool.  */
   void *data;
 
+  /* Data the renderer associates with this pool, such as a shared
+     memory segment attached to the X server.  */
+  void *renderer_data;
+
   /* The wl_resource corresponding to this pool.  */
   struct wl_resource *resource;
 } Pool;
@@ -86,6 +90,10 @@ DereferencePool (Pool *pool)
   if (--pool->refcount)
     return;
 
+  /* Release anything the renderer attached to the pool.  */
+  if (pool->renderer_data)
+    RenderFreeShmPoolData (pool->renderer_data);
+
   munmap (pool->data, pool->size);
 
   /* Cancel the busfault trap.  */
@@ -291,6 +299,10 @@ CreateBuffer (struct wl_client *client, struct wl_resource *resource,
   attrs.data = &pool->data;
   attrs.pool_size = pool->size;
 
+  /* Likewise for the renderer data, which is shared between every
+     buffer in the pool.  */
+  attrs.renderer_data = &pool->renderer_data;
+
   /* Now, create the renderer buffer.  */
   failure = False;
   render_buffer = RenderBufferFromShm (&attrs, &failure);
@@ -398,6 +410,12 @@ ResizePool (struct wl_client *client, struct wl_resource *resource,
   pool->size = size;
   pool->data = data;
 
+  /* Renderer data might describe the pool at its old size, so release
+     it.  The renderer will create it again for the next buffer.  */
+  if (pool->renderer_data)
+    RenderFreeShmPoolData (pool->renderer_data);
+  pool->renderer_data = NULL;
+
   /* And add a new handler.  */
   if (pool->size && !(pool->flags & PoolCannotSigbus))
     XLRecordBusfault (pool->data, pool->size);
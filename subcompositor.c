@@ -135,6 +135,9 @@ enum
     SubcompositorIsTargetAttached  = (1 << 5),
     /* This means the subcompositor is always garbaged.  */
     SubcompositorIsAlwaysGarbaged  = (1 << 6),
+    /* This means that the grid used to look up views must be
+       rebuilt.  */
+    SubcompositorIsHitGridDirty	   = (1 << 7),
   };
 
 #define IsGarbaged(subcompositor)				\
@@ -167,6 +170,11 @@ enum
 #define IsAlwaysGarbaged(subcompositor)				\
   ((subcompositor)->state & SubcompositorIsAlwaysGarbaged)
 
+#define SetHitGridDirty(subcompositor)				\
+  ((subcompositor)->state |= SubcompositorIsHitGridDirty)
+#define IsHitGridDirty(subcompositor)				\
+  ((subcompositor)->state & SubcompositorIsHitGridDirty)
+
 enum
   {
     /* This means that the view and all its inferiors should be
@@ -304,6 +312,72 @@ struct _SubcompositorDestroyCallback
   SubcompositorDestroyCallback *next, *last;
 };
 
+/* Maximum number of columns and rows in a hit grid.  */
+#define MaxHitGridSide 16
+
+typedef struct _HitGrid HitGrid;
+
+struct _HitGrid
+{
+  /* Views that can receive input, ordered from top to bottom, and
+     the extents of their input regions in subcompositor
+     coordinates.  */
+  View **views;
+  pixman_box32_t *boxes;
+
+  /* Number of views, and the allocated size of those arrays.  */
+  int n_views, views_size;
+
+  /* Views overlapping each cell, ordered from top to bottom.  The
+     views in cell N are cell_views[cell_start[N]] to
+     cell_views[cell_start[N + 1] - 1].  */
+  View **cell_views;
+  int *cell_start;
+
+  /* Allocated size of cell_views.  */
+  int cell_views_size;
+
+  /* The origin of the grid, the size of each cell, and the number of
+     columns and rows.  */
+  int x, y, cell_width, cell_height, columns, rows;
+};
+
+/* Number of previous updates whose damage is recorded, which is
+   the maximum age of a render target that can be updated
+   incrementally.  */
+#define MaxPriorDamage 4
+
+/* Number of regions in each chunk of a region arena.  */
+#define ArenaChunkSize 16
+
+typedef struct _RegionArena RegionArena;
+typedef struct _RegionArenaChunk RegionArenaChunk;
+
+struct _RegionArenaChunk
+{
+  /* The next chunk in the arena.  */
+  RegionArenaChunk *next;
+
+  /* The regions in this chunk.  They are initialized when the chunk
+     is created and only finalized with the arena, so the rectangle
+     storage pixman allocates for them is reused from frame to
+     frame.  */
+  pixman_region32_t regions[ArenaChunkSize];
+};
+
+struct _RegionArena
+{
+  /* List of chunks, and the last chunk in that list.  */
+  RegionArenaChunk *chunks, *last_chunk;
+
+  /* The chunk from which regions are currently being handed out, or
+     NULL if no region has been handed out since the last reset.  */
+  RegionArenaChunk *current;
+
+  /* Index of the next free region in that chunk.  */
+  int next_region;
+};
+
 struct _Subcompositor
 {
   /* List of all inferiors in compositing order.  */
@@ -343,16 +417,24 @@ struct _Subcompositor
   /* Data for the fourth.  */
   void *note_frame_data;
 
-  /* Buffers used to store that damage.  */
-  pixman_region32_t prior_damage[2];
+  /* Ring of buffers used to store that damage.  */
+  pixman_region32_t prior_damage[MaxPriorDamage];
 
   /* Any additional damage to be applied to the subcompositor.  */
   pixman_region32_t additional_damage;
 
-  /* The damage region of previous updates.  last_damage is what the
-     damage region was 1 update ago, and before_damage is what the
-     damage region was 2 updates ago.  */
-  pixman_region32_t *last_damage, *before_damage;
+  /* Arena holding cull regions and other regions that only live for
+     the duration of a single frame.  */
+  RegionArena frame_arena;
+
+  /* Uniform grid used to look up the view under a point.  */
+  HitGrid hit_grid;
+
+  /* The index into prior_damage of the damage region of the last
+     update, and the number of previous updates whose damage is
+     recorded in the ring.  The damage region of the update N updates
+     ago is prior_damage[(last_damage - N + 1) % MaxPriorDamage].  */
+  int last_damage, n_prior_damage;
 
   /* The last attached presentation callback, if any.  */
   PresentCompletionKey present_key;
@@ -565,6 +647,7 @@ Subcompositor *
 MakeSubcompositor (void)
 {
   Subcompositor *subcompositor;
+  int i;
 
   subcompositor = XLCalloc (1, sizeof *subcompositor);
   subcompositor->inferiors = ListInit (NULL);
@@ -580,12 +663,15 @@ MakeSubcompositor (void)
     = &subcompositor->destroy_callbacks;
 
   /* Initialize the buffers used to store previous damage.  */
-  pixman_region32_init (&subcompositor->prior_damage[0]);
-  pixman_region32_init (&subcompositor->prior_damage[1]);
+  for (i = 0; i < MaxPriorDamage; ++i)
+    pixman_region32_init (&subcompositor->prior_damage[i]);
 
   /* And the buffer used to store additional damage.  */
   pixman_region32_init (&subcompositor->additional_damage);
 
+  /* The hit grid is built upon the first lookup.  */
+  SetHitGridDirty (subcompositor);
+
   return subcompositor;
 }
 
@@ -649,6 +735,17 @@ ViewIsMapped (View *view)
   return True;
 }
 
+/* Note that the position, size, stacking order, visibility or input
+   region of VIEW changed, so the hit grid of its subcompositor must
+   be rebuilt.  */
+
+static void
+InvalidateHitGrid (View *view)
+{
+  if (view->subcompositor)
+    SetHitGridDirty (view->subcompositor);
+}
+
 static void
 SubcompositorUpdateBounds (Subcompositor *subcompositor, int doflags)
 {
@@ -880,6 +977,7 @@ SubcompositorInsert (Subcompositor *compositor, View *view)
 
   /* And update bounds.  */
   SubcompositorUpdateBoundsForInsert (compositor, view);
+  SetHitGridDirty (compositor);
 
   /* Now, if the subcompositor is still not garbaged, damage each
      inferior of the view.  */
@@ -907,6 +1005,7 @@ SubcompositorInsertBefore (Subcompositor *compositor, View *view,
 
   /* And update bounds.  */
   SubcompositorUpdateBoundsForInsert (compositor, view);
+  SetHitGridDirty (compositor);
 
   /* Now, if the subcompositor is still not garbaged, damage each
      inferior of the view.  */
@@ -933,6 +1032,7 @@ SubcompositorInsertAfter (Subcompositor *compositor, View *view,
 
   /* And update bounds.  */
   SubcompositorUpdateBoundsForInsert (compositor, view);
+  SetHitGridDirty (compositor);
 
   /* Now, if the subcompositor is still not garbaged, damage each
      inferior of the view.  */
@@ -1046,6 +1146,9 @@ ViewUpdateBoundsForInsert (View *view)
   if (view->subcompositor)
     SubcompositorUpdateBoundsForInsert (view->subcompositor,
 					view);
+
+  /* The stacking order changed.  */
+  InvalidateHitGrid (view);
 }
 
 void
@@ -1224,6 +1327,10 @@ ViewUnparent (View *child)
   attached = (ViewVisibilityState (child, &mapped)
 	      && mapped);
 
+  /* The view and its inferiors are about to be removed from the
+     subcompositor.  */
+  InvalidateHitGrid (child);
+
   if (attached && child->subcompositor)
     {
       /* Init the damage region.  */
@@ -1306,6 +1413,10 @@ ViewSetSubcompositor (View *view, Subcompositor *subcompositor)
       list = list->next;
     }
   while (list != view->link);
+
+  /* The view's inferiors are now part of SUBCOMPOSITOR.  */
+  if (subcompositor)
+    SetHitGridDirty (subcompositor);
 }
 
 
@@ -1332,6 +1443,9 @@ ViewAfterSizeUpdate (View *view)
   view->width = ViewWidth (view);
   view->height = ViewHeight (view);
 
+  /* The size or the presence of a buffer changed.  */
+  InvalidateHitGrid (view);
+
   if (!view->subcompositor || !ViewVisibilityState (view, &mapped)
       || !mapped)
     return;
@@ -1399,6 +1513,7 @@ ViewAttachBuffer (View *view, ExtBuffer *buffer)
       /* A buffer is now attached.  Automatically map the view, should
 	 it be unmapped.  */
       ClearUnmapped (view);
+      InvalidateHitGrid (view);
 
       if (view->subcompositor)
 	{
@@ -1437,6 +1552,9 @@ ViewMove (View *view, int x, int y)
       view->x = x;
       view->y = y;
 
+      /* The view and its inferiors moved.  */
+      InvalidateHitGrid (view);
+
       /* If the subcompositor is not garbaged, then damage the union
 	 of the previous view bounds and the current view bounds.
 	 This part calculates the previous view bounds.  */
@@ -1579,6 +1697,7 @@ ViewMap (View *view)
     return;
 
   ClearUnmapped (view);
+  InvalidateHitGrid (view);
 
   if (view->subcompositor
       && (view->link != view->inferior || view->buffer))
@@ -1608,6 +1727,7 @@ ViewUnmap (View *view)
 
   /* Mark the view as unmapped.  */
   SetUnmapped (view);
+  InvalidateHitGrid (view);
 
   if (view->subcompositor)
     {
@@ -1816,6 +1936,10 @@ ViewSetInput (View *view, pixman_region32_t *input)
 
   if (view->subcompositor)
     SetInputDirty (view->subcompositor);
+
+  /* The grid only holds the extents of each input region, so this
+     need not be done if they stay the same, but that is rare.  */
+  InvalidateHitGrid (view);
 }
 
 Subcompositor *
@@ -2136,46 +2260,38 @@ static void
 StorePreviousDamage (Subcompositor *subcompositor,
 		     pixman_region32_t *update_region)
 {
-  pixman_region32_t *prior;
+  pixman_region32_t *last;
 
   if (renderer_flags & NeverAges)
     /* Aging never happens, so recording prior damage is
        unnecessary.  */
     return;
 
-  /* Move last_damage to prior_damage if it already exists, and find
-     something to hold more damage and set it as last_damage.  There
-     is no need to do this if the render target age never exceeds
-     0.  */
+  /* Advance the damage ring, overwriting the oldest damage once the
+     ring is full.  There is no need to do this if the render target
+     age never exceeds 0.  */
 
-  if (!subcompositor->last_damage)
-    subcompositor->last_damage = &subcompositor->prior_damage[0];
-  else if (!subcompositor->before_damage)
-    {
-      subcompositor->before_damage = subcompositor->last_damage;
-      subcompositor->last_damage = &subcompositor->prior_damage[1];
-    }
-  else
-    {
-      prior = subcompositor->before_damage;
-      subcompositor->before_damage = subcompositor->last_damage;
-      subcompositor->last_damage = prior;
-    }
+  subcompositor->last_damage = ((subcompositor->last_damage + 1)
+				% MaxPriorDamage);
+
+  if (subcompositor->n_prior_damage < MaxPriorDamage)
+    subcompositor->n_prior_damage++;
+
+  last = &subcompositor->prior_damage[subcompositor->last_damage];
 
   /* NULL means use the bounds of the subcompositor.  */
   if (!update_region)
     {
-      pixman_region32_fini (subcompositor->last_damage);
-      pixman_region32_init_rect (subcompositor->last_damage,
+      pixman_region32_fini (last);
+      pixman_region32_init_rect (last,
 				 subcompositor->min_x,
 				 subcompositor->min_y,
 				 subcompositor->max_x,
 				 subcompositor->max_y);
     }
   else
-    /* Copy the update region to last_damage.  */
-    pixman_region32_copy (subcompositor->last_damage,
-			  update_region);
+    /* Copy the update region to the ring.  */
+    pixman_region32_copy (last, update_region);
 }
 
 static void
@@ -2312,23 +2428,90 @@ SubcompositorUpdateAncillary (Subcompositor *subcompositor)
   subcompositor->state &= ~SubcompositorIsInputDirty;
 }
 
+/* Return a region from the frame arena of SUBCOMPOSITOR.  Its
+   contents are undefined; the caller must overwrite it before use.
+   The region remains valid until ResetArena is called.  */
+
+static pixman_region32_t *
+ArenaRegion (Subcompositor *subcompositor)
+{
+  RegionArena *arena;
+  RegionArenaChunk *chunk;
+  int i;
+
+  arena = &subcompositor->frame_arena;
+
+  if (!arena->current || arena->next_region == ArenaChunkSize)
+    {
+      chunk = (arena->current ? arena->current->next
+	       : arena->chunks);
+
+      if (!chunk)
+	{
+	  /* Every chunk is in use; allocate a new one.  It is kept
+	     until the subcompositor is destroyed.  */
+	  chunk = XLMalloc (sizeof *chunk);
+	  chunk->next = NULL;
+
+	  for (i = 0; i < ArenaChunkSize; ++i)
+	    pixman_region32_init (&chunk->regions[i]);
+
+	  if (arena->last_chunk)
+	    arena->last_chunk->next = chunk;
+	  else
+	    arena->chunks = chunk;
+
+	  arena->last_chunk = chunk;
+	}
+
+      arena->current = chunk;
+      arena->next_region = 0;
+    }
+
+  return &arena->current->regions[arena->next_region++];
+}
+
 static pixman_region32_t *
-CopyRegion (pixman_region32_t *source)
+ArenaCopyRegion (Subcompositor *subcompositor,
+		 pixman_region32_t *source)
 {
   pixman_region32_t *region;
 
-  region = XLMalloc (sizeof *region);
-  pixman_region32_init (region);
-  pixman_region32_copy (region, source);
+  region = ArenaRegion (subcompositor);
 
+  /* pixman_region32_copy only allocates if the storage already
+     attached to REGION is too small.  */
+  pixman_region32_copy (region, source);
   return region;
 }
 
 static void
-FreeRegion (pixman_region32_t *region)
+ResetArena (Subcompositor *subcompositor)
+{
+  /* Hand out regions from the first chunk again.  Nothing is
+     finalized, so their storage is retained.  */
+  subcompositor->frame_arena.current = NULL;
+  subcompositor->frame_arena.next_region = 0;
+}
+
+static void
+FreeArena (Subcompositor *subcompositor)
 {
-  pixman_region32_fini (region);
-  XLFree (region);
+  RegionArenaChunk *chunk, *last;
+  int i;
+
+  chunk = subcompositor->frame_arena.chunks;
+
+  while (chunk)
+    {
+      last = chunk;
+      chunk = chunk->next;
+
+      for (i = 0; i < ArenaChunkSize; ++i)
+	pixman_region32_fini (&last->regions[i]);
+
+      XLFree (last);
+    }
 }
 
 static Bool
@@ -2366,7 +2549,7 @@ DoCull (Subcompositor *subcompositor, pixman_region32_t *damage,
 {
   List *list;
   View *view;
-  pixman_region32_t temp;
+  pixman_region32_t *temp;
   RenderBuffer buffer;
 
   view = NULL;
@@ -2381,7 +2564,7 @@ DoCull (Subcompositor *subcompositor, pixman_region32_t *damage,
      damage as its "clip region", and then subtract its opaque region
      from damage.  */
 
-  pixman_region32_init (&temp);
+  temp = ArenaRegion (subcompositor);
   list = subcompositor->inferiors->last;
   while (list != subcompositor->inferiors)
     {
@@ -2400,7 +2583,7 @@ DoCull (Subcompositor *subcompositor, pixman_region32_t *damage,
 
       /* Set view's cull region to the intersection of the current
 	 region and its bounds.  */
-      pixman_region32_intersect_rect (&temp, damage,
+      pixman_region32_intersect_rect (temp, damage,
 				      view->abs_x,
 				      view->abs_y,
 				      view->width,
@@ -2411,8 +2594,8 @@ DoCull (Subcompositor *subcompositor, pixman_region32_t *damage,
       XLAssert (view->cull_region == NULL);
 
       /* Don't set the cull region if it is empty.  */
-      if (pixman_region32_not_empty (&temp))
-	view->cull_region = CopyRegion (&temp);
+      if (pixman_region32_not_empty (temp))
+	view->cull_region = ArenaCopyRegion (subcompositor, temp);
 
       /* Subtract the damage region by the view's opaque region.  */
 
@@ -2423,22 +2606,22 @@ DoCull (Subcompositor *subcompositor, pixman_region32_t *damage,
 	{
 	  /* If the buffer is opaque, we can just ignore its opaque
 	     region.  */
-	  pixman_region32_clear (&temp);
-	  pixman_region32_union_rect (&temp, &temp, view->abs_x,
+	  pixman_region32_clear (temp);
+	  pixman_region32_union_rect (temp, temp, view->abs_x,
 				      view->abs_y, view->width,
 				      view->height);
 	}
       else
 	{
-	  pixman_region32_intersect_rect (&temp, &view->opaque, 0, 0,
+	  pixman_region32_intersect_rect (temp, &view->opaque, 0, 0,
 					  view->width, view->height);
-	  pixman_region32_translate (&temp, view->abs_x, view->abs_y);
+	  pixman_region32_translate (temp, view->abs_x, view->abs_y);
 	}
 
-      pixman_region32_subtract (damage, damage, &temp);
+      pixman_region32_subtract (damage, damage, temp);
 
       /* Also subtract the opaque region from the background.  */
-      pixman_region32_subtract (background, background, &temp);
+      pixman_region32_subtract (background, background, temp);
 
       /* If damage is already empty, finish early.  */
       if (!pixman_region32_not_empty (damage))
@@ -2452,8 +2635,6 @@ DoCull (Subcompositor *subcompositor, pixman_region32_t *damage,
     /* Also subtract the region of the bottommost view that will be
        drawn from the background, as it will use PictOpCopy.  */
     pixman_region32_subtract (background, background, view->cull_region);
-
-  pixman_region32_fini (&temp);
 }
 
 static void
@@ -2474,8 +2655,6 @@ static void
 CompositeSingleView (View *view, pixman_region32_t *region,
 		     Operation op, DrawParams *transform)
 {
-  pixman_box32_t *boxes;
-  int nboxes, i;
   RenderBuffer buffer;
   int min_x, min_y, tx, ty;
   Subcompositor *subcompositor;
@@ -2486,25 +2665,17 @@ CompositeSingleView (View *view, pixman_region32_t *region,
   tx = subcompositor->tx;
   ty = subcompositor->ty;
 
-  boxes = pixman_region32_rectangles (region, &nboxes);
   buffer = XLRenderBufferFromBuffer (view->buffer);
 
-  for (i = 0; i < nboxes; ++i)
-    RenderComposite (buffer, view->subcompositor->target, op,
-		     /* src-x.  */
-		     boxes[i].x1 - view->abs_x,
-		     /* src-y.  */
-		     boxes[i].y1 - view->abs_y,
-		     /* dst-x.  */
-		     boxes[i].x1 - min_x + tx,
-		     /* dst-y.  */
-		     boxes[i].y1 - min_y + ty,
-		     /* width.  */
-		     boxes[i].x2 - boxes[i].x1,
-		     /* height.  */
-		     boxes[i].y2 - boxes[i].y1,
-		     /* draw-params.  */
-		     transform);
+  /* Composite every rectangle in the region at once.  */
+  RenderCompositeRegion (buffer, view->subcompositor->target, op,
+			 region,
+			 /* src-x, src-y.  */
+			 -view->abs_x, -view->abs_y,
+			 /* dst-x, dst-y.  */
+			 tx - min_x, ty - min_y,
+			 /* draw-params.  */
+			 transform);
 }
 
 static void
@@ -2611,16 +2782,14 @@ ClearCull (Subcompositor *subcompositor)
   List *list;
   View *view;
 
-  /* Free the cull region of every view.  */
+  /* Clear the cull region of every view.  The regions themselves
+     belong to the frame arena.  */
   list = subcompositor->inferiors->next;
   view = NULL;
 
   while (list != subcompositor->inferiors)
     {
       SkipSlug (list, view, next);
-
-      if (view->cull_region)
-	FreeRegion (view->cull_region);
       view->cull_region = NULL;
 
     next:
@@ -2671,15 +2840,14 @@ SubcompositorComposite1 (Subcompositor *subcompositor,
   View *view;
   pixman_region32_t background;
   Operation op;
-  pixman_region32_t copy;
+  pixman_region32_t *copy;
   DrawParams transform;
   Bool success, presented;
   RenderCompletionKey key;
 
   /* Draw the first view by copying.  */
   op = OperationSource;
-  pixman_region32_init (&copy);
-  pixman_region32_copy (&copy, damage);
+  copy = ArenaCopyRegion (subcompositor, damage);
 
   /* Initialize the background region.  */
   InitBackground (subcompositor, &background);
@@ -2694,9 +2862,8 @@ SubcompositorComposite1 (Subcompositor *subcompositor,
 	 presentation is not possible.  Return if bail_on_draw.  */
       if (bail_on_draw)
 	{
-	  /* Free the cull regions and temp regions.  */
+	  /* Free the background region and clear the cull regions.  */
 	  pixman_region32_fini (&background);
-	  pixman_region32_fini (&copy);
 	  ClearCull (subcompositor);
 
 	  return False;
@@ -2714,12 +2881,7 @@ SubcompositorComposite1 (Subcompositor *subcompositor,
      cannot be presented.  */
 
   if (bail_on_draw && !CheckBailOnDraw (subcompositor))
-    {
-      /* Free the temp region.  */
-      pixman_region32_fini (&copy);
-
-      return False;
-    }
+    return False;
 
   list = subcompositor->inferiors->next;
 
@@ -2747,8 +2909,7 @@ SubcompositorComposite1 (Subcompositor *subcompositor,
 	  CompositeSingleView (view, view->cull_region, op,
 			       &transform);
 
-	  /* And free the cull region.  */
-	  FreeRegion (view->cull_region);
+	  /* And clear the cull region.  */
 	  view->cull_region = NULL;
 
 	  /* Subsequent views should be composited.  */
@@ -2785,8 +2946,7 @@ SubcompositorComposite1 (Subcompositor *subcompositor,
 	   over the presentation callback.  */
 	presented = True;
 
-      /* And free the cull region.  */
-      FreeRegion (view->cull_region);
+      /* And clear the cull region.  */
       view->cull_region = NULL;
     }
 
@@ -2808,9 +2968,8 @@ SubcompositorComposite1 (Subcompositor *subcompositor,
 
       pixman_region32_translate (damage, -subcompositor->min_x,
 				 -subcompositor->min_y);
-      key = RenderFinishRender (subcompositor->target, &copy,
+      key = RenderFinishRender (subcompositor->target, copy,
 				RenderCompletedCallback, subcompositor);
-      pixman_region32_fini (&copy);
 
       subcompositor->render_key = key;
     }
@@ -2833,8 +2992,7 @@ SubcompositorComposite1 (Subcompositor *subcompositor,
 	 returned, as the given callback is NULL.  */
       pixman_region32_translate (damage, -subcompositor->min_x,
 				 -subcompositor->min_y);
-      RenderFinishRender (subcompositor->target, &copy, NULL, NULL);
-      pixman_region32_fini (&copy);
+      RenderFinishRender (subcompositor->target, copy, NULL, NULL);
     }
 
   if (success)
@@ -2847,18 +3005,19 @@ SubcompositorComposite1 (Subcompositor *subcompositor,
 static Bool
 SubcompositorComposite (Subcompositor *subcompositor)
 {
-  pixman_region32_t damage, temp;
+  pixman_region32_t *damage, *temp;
   List *list;
   View *view;
-  int age;
+  int age, i, index;
   Bool rc;
 
   age = RenderTargetAge (subcompositor->target);
 
   /* First, calculate a global damage region.  */
 
-  pixman_region32_init (&damage);
-  pixman_region32_init (&temp);
+  damage = ArenaRegion (subcompositor);
+  temp = ArenaRegion (subcompositor);
+  pixman_region32_clear (damage);
   list = subcompositor->inferiors->next;
 
   while (list != subcompositor->inferiors)
@@ -2872,84 +3031,69 @@ SubcompositorComposite (Subcompositor *subcompositor)
 	{
 	  /* Avoid reporting damage that will be covered up by views
 	     above.  */
-	  pixman_region32_intersect_rect (&temp, &view->opaque,
+	  pixman_region32_intersect_rect (temp, &view->opaque,
 					  0, 0, view->width,
 					  view->height);
-	  pixman_region32_translate (&temp, view->abs_x, view->abs_y);
-	  pixman_region32_subtract (&damage, &damage, &temp);
+	  pixman_region32_translate (temp, view->abs_x, view->abs_y);
+	  pixman_region32_subtract (damage, damage, temp);
 	}
 
       /* Add the view's damage region to the output damage region.  */
-      pixman_region32_intersect_rect (&temp, &view->damage, 0, 0,
+      pixman_region32_intersect_rect (temp, &view->damage, 0, 0,
 				      view->width, view->height);
-      pixman_region32_translate (&temp, view->abs_x, view->abs_y);
-      pixman_region32_union (&damage, &damage, &temp);
+      pixman_region32_translate (temp, view->abs_x, view->abs_y);
+      pixman_region32_union (damage, damage, temp);
 
     next:
       list = list->next;
     }
 
   /* Add damage caused by i.e. movement.  */
-  pixman_region32_union (&damage, &damage,
+  pixman_region32_union (damage, damage,
 			 &subcompositor->additional_damage);
 
   /* If there is no damage, just return without drawing anything.  */
-  if (!pixman_region32_not_empty (&damage))
-    {
-      pixman_region32_fini (&damage);
-      pixman_region32_fini (&temp);
-      return True;
-    }
+  if (!pixman_region32_not_empty (damage))
+    return True;
 
-  if (age == -1 || age > 2)
-    {
-      /* The target is too old.  */
-      pixman_region32_fini (&damage);
-      pixman_region32_fini (&temp);
-      return False;
-    }
+  if (age == -1 || age > MaxPriorDamage)
+    /* The target is too old.  */
+    return False;
 
-  if ((age > 0 && !subcompositor->last_damage)
-      || (age > 1 && !subcompositor->before_damage))
-    {
-      /* Damage required for incremental update is missing.  */
-      pixman_region32_fini (&damage);
-      pixman_region32_fini (&temp);
-      return False;
-    }
+  if (age > subcompositor->n_prior_damage)
+    /* Damage required for incremental update is missing.  */
+    return False;
 
   /* Copy the damage so StorePreviousDamage gets the damage before it
      was unioned.  */
-  pixman_region32_copy (&temp, &damage);
+  pixman_region32_copy (temp, damage);
 
   /* Now, damage contains the current damage of each view.  Add any
      previous damage if required.  */
 
-  if (age > 0)
-    pixman_region32_union (&damage, &damage,
-			   subcompositor->last_damage);
+  index = subcompositor->last_damage;
 
-  if (age > 1)
-    pixman_region32_union (&damage, &damage,
-			   subcompositor->before_damage);
+  for (i = 0; i < age; ++i)
+    {
+      pixman_region32_union (damage, damage,
+			     &subcompositor->prior_damage[index]);
+      index = (index + MaxPriorDamage - 1) % MaxPriorDamage;
+    }
 
   /* If the damage is too complicated, simplify it.  */
-  if (IsDamageComplicated (&damage))
-    SimplifyDamage (&damage,
+  if (IsDamageComplicated (damage))
+    SimplifyDamage (damage,
 		    subcompositor->min_x,
 		    subcompositor->min_y,
 		    subcompositor->max_x,
 		    subcompositor->max_y);
 
   /* Add this damage onto the damage ring.  */
-  StorePreviousDamage (subcompositor, &temp);
-  pixman_region32_fini (&temp);
+  StorePreviousDamage (subcompositor, temp);
 
   /* Finally, paint.  If age is -2, then we must bail if the
      background could be drawn or the view is not presentable.  */
-  rc = SubcompositorComposite1 (subcompositor, &damage, age == -2);
-
-  pixman_region32_fini (&damage);
+  rc = SubcompositorComposite1 (subcompositor, damage, age == -2);
 
   if (rc)
     /* Clear any additional damage applied.  */
@@ -3003,6 +3147,9 @@ BeginFrame (Subcompositor *subcompositor)
 static void
 EndFrame (Subcompositor *subcompositor)
 {
+  /* Nothing allocated from the frame arena outlives the frame.  */
+  ResetArena (subcompositor);
+
   if (!subcompositor->note_frame)
     return;
 
@@ -3110,6 +3257,10 @@ SubcompositorExpose (Subcompositor *subcompositor, XEvent *event)
 			       event->xgraphicsexpose.height);
   SubcompositorComposite1 (subcompositor, &damage, False);
   pixman_region32_fini (&damage);
+
+  /* Exposures are drawn outside BeginFrame and EndFrame, so reset the
+     frame arena here.  */
+  ResetArena (subcompositor);
 }
 
 void
@@ -3126,10 +3277,194 @@ SubcompositorSetProjectiveTransform (Subcompositor *subcompositor,
   subcompositor->ty = ty;
 }
 
+static void
+GrowHitGridViews (HitGrid *grid)
+{
+  grid->views_size = MAX (16, grid->views_size * 2);
+  grid->views = XLRealloc (grid->views,
+			   sizeof *grid->views * grid->views_size);
+  grid->boxes = XLRealloc (grid->boxes,
+			   sizeof *grid->boxes * grid->views_size);
+}
+
+/* Compute the range of cells in GRID covered by BOX.  */
+
+static void
+HitGridCells (HitGrid *grid, pixman_box32_t *box, int *x1, int *y1,
+	      int *x2, int *y2)
+{
+  *x1 = (box->x1 - grid->x) / grid->cell_width;
+  *y1 = (box->y1 - grid->y) / grid->cell_height;
+  *x2 = MIN ((box->x2 - 1 - grid->x) / grid->cell_width,
+	     grid->columns - 1);
+  *y2 = MIN ((box->y2 - 1 - grid->y) / grid->cell_height,
+	     grid->rows - 1);
+}
+
+static void
+RebuildHitGrid (Subcompositor *subcompositor)
+{
+  HitGrid *grid;
+  List *list;
+  View *view;
+  pixman_box32_t box, extents, *input;
+  int i, x, y, x1, y1, x2, y2, n_cells, n_entries;
+
+  grid = &subcompositor->hit_grid;
+  grid->n_views = 0;
+
+  /* Collect every view that can receive input from bottom to top.
+     Walking in this direction allows skipping the inferiors of an
+     unmapped view by moving to its last inferior.  */
+
+  for (list = subcompositor->inferiors->next;
+       list != subcompositor->inferiors;
+       list = list->next)
+    {
+      view = list->view;
+
+      if (!view)
+	continue;
+
+      if (IsViewUnmapped (view))
+	{
+	  list = view->inferior;
+	  continue;
+	}
+
+      if (!view->buffer)
+	continue;
+
+      /* Intersect the extents of the input region with the bounds of
+	 the view.  */
+      input = pixman_region32_extents (&view->input);
+      box.x1 = MAX (input->x1, 0) + view->abs_x;
+      box.y1 = MAX (input->y1, 0) + view->abs_y;
+      box.x2 = MIN (input->x2, view->width) + view->abs_x;
+      box.y2 = MIN (input->y2, view->height) + view->abs_y;
+
+      if (box.x1 >= box.x2 || box.y1 >= box.y2)
+	/* The view cannot receive input.  */
+	continue;
+
+      if (grid->n_views == grid->views_size)
+	GrowHitGridViews (grid);
+
+      if (!grid->n_views)
+	extents = box;
+      else
+	{
+	  extents.x1 = MIN (extents.x1, box.x1);
+	  extents.y1 = MIN (extents.y1, box.y1);
+	  extents.x2 = MAX (extents.x2, box.x2);
+	  extents.y2 = MAX (extents.y2, box.y2);
+	}
+
+      grid->views[grid->n_views] = view;
+      grid->boxes[grid->n_views++] = box;
+    }
+
+  subcompositor->state &= ~SubcompositorIsHitGridDirty;
+
+  /* Put the views in top to bottom order.  */
+
+  for (i = 0; i < grid->n_views / 2; ++i)
+    {
+      view = grid->views[i];
+      box = grid->boxes[i];
+      grid->views[i] = grid->views[grid->n_views - 1 - i];
+      grid->boxes[i] = grid->boxes[grid->n_views - 1 - i];
+      grid->views[grid->n_views - 1 - i] = view;
+      grid->boxes[grid->n_views - 1 - i] = box;
+    }
+
+  if (!grid->n_views)
+    {
+      grid->columns = 0;
+      grid->rows = 0;
+      return;
+    }
+
+  /* Use about as many cells as there are views, up to a limit.  */
+  for (i = 1; i * i < grid->n_views && i < MaxHitGridSide; ++i)
+    ;
+
+  grid->x = extents.x1;
+  grid->y = extents.y1;
+  grid->columns = i;
+  grid->rows = i;
+  grid->cell_width = ((extents.x2 - extents.x1 + grid->columns - 1)
+		      / grid->columns);
+  grid->cell_height = ((extents.y2 - extents.y1 + grid->rows - 1)
+		       / grid->rows);
+  n_cells = grid->columns * grid->rows;
+
+  /* Count the views overlapping each cell, and turn that into the
+     index of each cell's first view.  */
+
+  grid->cell_start = XLRealloc (grid->cell_start,
+				sizeof *grid->cell_start
+				* (n_cells + 1));
+  memset (grid->cell_start, 0, sizeof *grid->cell_start
+	  * (n_cells + 1));
+
+  for (i = 0; i < grid->n_views; ++i)
+    {
+      HitGridCells (grid, &grid->boxes[i], &x1, &y1, &x2, &y2);
+
+      for (y = y1; y <= y2; ++y)
+	for (x = x1; x <= x2; ++x)
+	  grid->cell_start[y * grid->columns + x + 1]++;
+    }
+
+  for (i = 0; i < n_cells; ++i)
+    grid->cell_start[i + 1] += grid->cell_start[i];
+
+  n_entries = grid->cell_start[n_cells];
+
+  if (n_entries > grid->cell_views_size)
+    {
+      grid->cell_views_size = n_entries;
+      grid->cell_views = XLRealloc (grid->cell_views,
+				    sizeof *grid->cell_views
+				    * n_entries);
+    }
+
+  /* Fill in each cell, advancing cell_start as views are added.
+     Views are added from top to bottom, so that order is kept within
+     each cell.  */
+
+  for (i = 0; i < grid->n_views; ++i)
+    {
+      HitGridCells (grid, &grid->boxes[i], &x1, &y1, &x2, &y2);
+
+      for (y = y1; y <= y2; ++y)
+	for (x = x1; x <= x2; ++x)
+	  grid->cell_views[grid->cell_start[y * grid->columns + x]++]
+	    = grid->views[i];
+    }
+
+  /* Each cell_start now holds the start of the next cell; shift them
+     back.  */
+  memmove (grid->cell_start + 1, grid->cell_start,
+	   sizeof *grid->cell_start * n_cells);
+  grid->cell_start[0] = 0;
+}
+
+static void
+FreeHitGrid (Subcompositor *subcompositor)
+{
+  XLFree (subcompositor->hit_grid.views);
+  XLFree (subcompositor->hit_grid.boxes);
+  XLFree (subcompositor->hit_grid.cell_views);
+  XLFree (subcompositor->hit_grid.cell_start);
+}
+
 void
 SubcompositorFree (Subcompositor *subcompositor)
 {
   SubcompositorDestroyCallback *next, *last;
+  int i;
 
   /* It isn't valid to call this function with children attached.  */
   XLAssert (subcompositor->children->next
@@ -3154,12 +3489,16 @@ SubcompositorFree (Subcompositor *subcompositor)
     }
 
   /* Finalize the buffers used to store previous damage.  */
-  pixman_region32_fini (&subcompositor->prior_damage[0]);
-  pixman_region32_fini (&subcompositor->prior_damage[1]);
+  for (i = 0; i < MaxPriorDamage; ++i)
+    pixman_region32_fini (&subcompositor->prior_damage[i]);
 
   /* Finalize the region used to store additional damage.  */
   pixman_region32_fini (&subcompositor->additional_damage);
 
+  /* And release the frame arena and hit grid.  */
+  FreeArena (subcompositor);
+  FreeHitGrid (subcompositor);
+
   /* Remove the presentation key.  */
   if (subcompositor->present_key)
     RenderCancelPresentationCallback (subcompositor->present_key);
@@ -3175,49 +3514,54 @@ View *
 SubcompositorLookupView (Subcompositor *subcompositor, int x, int y,
 			 int *view_x, int *view_y)
 {
-  List *list;
-  int temp_x, temp_y;
+  HitGrid *grid;
+  View *view;
+  int temp_x, temp_y, cell, i;
   pixman_box32_t box;
 
   x += subcompositor->min_x;
   y += subcompositor->min_y;
 
-  for (list = subcompositor->inferiors->last;
-       list != subcompositor->inferiors;
-       list = list->last)
-    {
-      if (!list->view)
-	continue;
+  grid = &subcompositor->hit_grid;
 
-      if (IsViewUnmapped (list->view))
-	{
-	  list = list->view->inferior;
-	  continue;
-	}
+  if (IsHitGridDirty (subcompositor))
+    RebuildHitGrid (subcompositor);
 
-      if (!list->view->buffer)
-	continue;
+  if (x < grid->x || y < grid->y
+      || x >= grid->x + grid->cell_width * grid->columns
+      || y >= grid->y + grid->cell_height * grid->rows)
+    /* The point lies outside every view.  */
+    return NULL;
+
+  cell = ((y - grid->y) / grid->cell_height * grid->columns
+	  + (x - grid->x) / grid->cell_width);
+
+  /* Search the views overlapping that cell, from top to bottom.  */
+
+  for (i = grid->cell_start[cell]; i < grid->cell_start[cell + 1]; ++i)
+    {
+      view = grid->cell_views[i];
 
-      temp_x = x - list->view->abs_x;
-      temp_y = y - list->view->abs_y;
+      temp_x = x - view->abs_x;
+      temp_y = y - view->abs_y;
 
       /* If the coordinates don't fit in the view bounds, skip the
 	 view.  This test is the equivalent to intersecting the view's
 	 input region with the bounds of the view.  */
       if (temp_x < 0 || temp_y < 0
-	  || temp_x >= list->view->width
-	  || temp_y >= list->view->height)
+	  || temp_x >= view->width
+	  || temp_y >= view->height)
 	continue;
 
       /* Now see if the input region contains the given
 	 coordinates.  If it does, return the view.  */
-      if (pixman_region32_contains_point (&list->view->input, temp_x,
+      if (pixman_region32_contains_point (&view->input, temp_x,
 					  temp_y, &box))
 	{
-	  *view_x = list->view->abs_x - subcompositor->min_x;
-	  *view_y = list->view->abs_y - subcompositor->min_y;
+	  *view_x = view->abs_x - subcompositor->min_x;
+	  *view_y = view->abs_y - subcompositor->min_y;
 
-	  return list->view;
+	  return view;
 	}
     }
 
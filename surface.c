@@ -29,6 +29,9 @@ along with 12to11.  If not, see <https://www.gnu.org/licenses/>.  */
 /* List of all currently existing surfaces.  */
 Surface all_surfaces;
 
+/* Slab from which frame callbacks are allocated.  */
+static XLSlab frame_callback_slab = XLSlabInitializer (FrameCallback);
+
 static DestroyCallback *
 AddDestroyCallbackAfter (DestroyCallback *after)
 {
@@ -201,7 +204,7 @@ AddCallbackAfter (FrameCallback *after)
 {
   FrameCallback *callback;
 
-  callback = XLSafeMalloc (sizeof *callback);
+  callback = XLSafeSlabAlloc (&frame_callback_slab);
 
   if (!callback)
     return callback;
@@ -245,7 +248,7 @@ HandleCallbackResourceDestroy (struct wl_resource *resource)
 
   callback = wl_resource_get_user_data (resource);
   UnlinkCallbacks (callback, callback);
-  XLFree (callback);
+  XLSlabFree (&frame_callback_slab, callback);
 }
 
 static void
@@ -410,7 +413,7 @@ Frame (struct wl_client *client, struct wl_resource *resource,
     {
       wl_client_post_no_memory (client);
       UnlinkCallbacks (callback, callback);
-      XLFree (callback);
+      XLSlabFree (&frame_callback_slab, callback);
 
       return;
     }
@@ -0,0 +1,168 @@
+/* Tests for the Wayland compositor running on the X server.
+
+Copyright (C) 2022 to various contributors.
+
+This file is part of 12to11.
+
+12to11 is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+12to11 is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+for more details.
+
+You should have received a copy of the GNU General Public License
+along with 12to11.  If not, see <https://www.gnu.org/licenses/>.  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../compositor.h"
+
+/* assoc_bench -- micro-benchmark for XLAssocTable.  It links with
+   fns.o and alloc.o from the protocol translator, and times
+   insertion, lookup and deletion of XIDs laid out the way the X
+   server allocates them to a handful of clients.  The number of XIDs
+   can be given as the first argument.  */
+
+/* fns.o refers to these, but the table code does not use them.  */
+Compositor compositor;
+Atom _XL_SERVER_TIME_ATOM;
+Window selection_transfer_window;
+
+void
+TransformBox (pixman_box32_t *box, BufferTransform transform,
+	      int width, int height)
+{
+  abort ();
+}
+
+/* Number of times each lookup pass is repeated.  */
+#define LOOKUP_PASSES 16
+
+static XID *xids;
+
+static double
+current_time (void)
+{
+  struct timespec timespec;
+
+  clock_gettime (CLOCK_MONOTONIC, &timespec);
+  return timespec.tv_sec * 1e9 + timespec.tv_nsec;
+}
+
+static void
+report (const char *what, double start, long n_operations)
+{
+  printf ("%-24s %8.2f ns/op\n", what,
+	  (current_time () - start) / n_operations);
+}
+
+static void
+make_xids (long n_xids)
+{
+  long i;
+
+  xids = malloc (sizeof *xids * n_xids);
+
+  if (!xids)
+    abort ();
+
+  /* Give each of eight clients a resource ID base, and allocate IDs
+     sequentially within it, as the X server does.  */
+  for (i = 0; i < n_xids; ++i)
+    xids[i] = ((i % 8 + 1) << 21) | (i / 8 + 1);
+
+  /* Shuffle the XIDs, so the order of insertion does not favor any
+     particular layout.  */
+  for (i = n_xids - 1; i > 0; --i)
+    {
+      long j;
+      XID temp;
+
+      j = random () % (i + 1);
+      temp = xids[i];
+      xids[i] = xids[j];
+      xids[j] = temp;
+    }
+}
+
+int
+main (int argc, char **argv)
+{
+  XLAssocTable *table;
+  long n_xids, i, pass;
+  double start;
+  void *sink;
+
+  n_xids = 10000;
+
+  if (argc > 1)
+    n_xids = atol (argv[1]);
+
+  if (n_xids <= 0)
+    {
+      fprintf (stderr, "usage: %s [number of XIDs]\n", argv[0]);
+      return 1;
+    }
+
+  make_xids (n_xids);
+
+  /* Use the size the window cache in dnd.c uses, so the table must
+     grow when there are more windows than that.  */
+  table = XLCreateAssocTable (2048);
+
+  start = current_time ();
+  for (i = 0; i < n_xids; ++i)
+    XLMakeAssoc (table, xids[i], &xids[i]);
+  report ("insert", start, n_xids);
+
+  start = current_time ();
+  for (pass = 0; pass < LOOKUP_PASSES; ++pass)
+    {
+      for (i = 0; i < n_xids; ++i)
+	{
+	  sink = XLLookUpAssoc (table, xids[i]);
+
+	  if (sink != &xids[i])
+	    abort ();
+	}
+    }
+  report ("lookup (present)", start, n_xids * LOOKUP_PASSES);
+
+  start = current_time ();
+  for (pass = 0; pass < LOOKUP_PASSES; ++pass)
+    {
+      for (i = 0; i < n_xids; ++i)
+	{
+	  /* These XIDs are outside any client's resource ID base.  */
+	  sink = XLLookUpAssoc (table, xids[i] | (1 << 28));
+
+	  if (sink)
+	    abort ();
+	}
+    }
+  report ("lookup (absent)", start, n_xids * LOOKUP_PASSES);
+
+  /* Delete and reinsert every other XID, which is what happens as
+     windows are created and destroyed.  */
+  start = current_time ();
+  for (i = 0; i < n_xids; i += 2)
+    XLDeleteAssoc (table, xids[i]);
+  for (i = 0; i < n_xids; i += 2)
+    XLMakeAssoc (table, xids[i], &xids[i]);
+  report ("delete and reinsert", start, n_xids);
+
+  start = current_time ();
+  for (i = 0; i < n_xids; ++i)
+    XLDeleteAssoc (table, xids[i]);
+  report ("delete", start, n_xids);
+
+  XLDestroyAssocTable (table);
+  free (xids);
+  return 0;
+}
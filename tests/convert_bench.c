@@ -0,0 +1,147 @@
+/* Tests for the Wayland compositor running on the X server.
+
+Copyright (C) 2022 to various contributors.
+
+This file is part of 12to11.
+
+12to11 is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+12to11 is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+for more details.
+
+You should have received a copy of the GNU General Public License
+along with 12to11.  If not, see <https://www.gnu.org/licenses/>.  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../compositor.h"
+
+/* convert_bench -- micro-benchmark for the pixel format conversion
+   kernels in pixel_conversion.c, which it links with.  It times the
+   conversion of a whole buffer and of a small damaged rectangle for
+   each format, and prints the throughput in megapixels per second.
+   The width and height of the buffer can be given as the first and
+   second arguments.  */
+
+/* Number of times each conversion is repeated.  */
+#define PASSES 64
+
+/* Size of the damaged rectangle.  */
+#define DAMAGE_SIZE 64
+
+static double
+current_time (void)
+{
+  struct timespec timespec;
+
+  clock_gettime (CLOCK_MONOTONIC, &timespec);
+  return timespec.tv_sec * 1e9 + timespec.tv_nsec;
+}
+
+static void
+report (const char *what, uint32_t format, double start,
+	long n_pixels)
+{
+  double elapsed;
+
+  elapsed = current_time () - start;
+  printf ("%-10s %c%c%c%c %10.1f Mpixel/s %8.3f ns/pixel\n", what,
+	  format & 0xff, (format >> 8) & 0xff, (format >> 16) & 0xff,
+	  (format >> 24) & 0xff, n_pixels / elapsed * 1e3,
+	  elapsed / n_pixels);
+}
+
+int
+main (int argc, char **argv)
+{
+  int width, height, n, pass, bpp, n_planes, plane;
+  size_t i, offsets[3], strides[3], size;
+  unsigned char *src;
+  uint32_t *dst, format;
+  size_t src_stride, dst_stride;
+  ConversionSource source;
+  double start;
+
+  width = 1920;
+  height = 1080;
+
+  if (argc > 2)
+    {
+      width = atoi (argv[1]);
+      height = atoi (argv[2]);
+    }
+
+  if (width < DAMAGE_SIZE || height < DAMAGE_SIZE)
+    {
+      fprintf (stderr, "usage: %s [width height]\n", argv[0]);
+      return 1;
+    }
+
+  /* Allocate the source for the widest format, and fill it with
+     random data.  */
+  src_stride = (size_t) width * 4;
+  dst_stride = (size_t) width * 4;
+  src = malloc (src_stride * height);
+  dst = malloc (dst_stride * height);
+
+  if (!src || !dst)
+    abort ();
+
+  for (i = 0; i < src_stride * height; ++i)
+    src[i] = random ();
+
+  printf ("%dx%d, %s kernels\n", width, height,
+	  GetConversionKernelName ());
+
+  /* Time copying the buffer as is, for comparison.  */
+  start = current_time ();
+  for (pass = 0; pass < PASSES; ++pass)
+    memcpy (dst, src, dst_stride * height);
+  report ("memcpy", WL_SHM_FORMAT_ARGB8888, start,
+	  (long) width * height * PASSES);
+
+  for (n = 0; (format = GetConversionFormat (n)); ++n)
+    {
+      if (!GetConversionFormatInfo (format, &bpp, &n_planes, NULL))
+	abort ();
+
+      /* Lay the planes out as in a shared memory buffer.  The
+	 source is large enough for any format.  */
+      if (!GetShmConversionLayout (format, width * bpp / 8, height,
+				   offsets, strides, &size))
+	abort ();
+
+      for (plane = 0; plane < n_planes; ++plane)
+	{
+	  source.planes[plane] = src + offsets[plane];
+	  source.strides[plane] = strides[plane];
+	}
+
+      start = current_time ();
+      for (pass = 0; pass < PASSES; ++pass)
+	ConvertPixels (format, &source, 0, 0, dst, dst_stride,
+		       width, height);
+      report ("full", format, start, (long) width * height * PASSES);
+
+      /* Convert a rectangle at an odd offset, which is not aligned
+	 to the vector size.  */
+      start = current_time ();
+      for (pass = 0; pass < PASSES * 64; ++pass)
+	ConvertPixels (format, &source, 1, 1, dst + width + 1,
+		       dst_stride, DAMAGE_SIZE - 1, DAMAGE_SIZE);
+      report ("damage", format, start,
+	      (long) (DAMAGE_SIZE - 1) * DAMAGE_SIZE * PASSES * 64);
+    }
+
+  free (src);
+  free (dst);
+  return 0;
+}
@@ -0,0 +1,271 @@
+/* Tests for the Wayland compositor running on the X server.
+
+Copyright (C) 2022 to various contributors.
+
+This file is part of 12to11.
+
+12to11 is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+12to11 is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+for more details.
+
+You should have received a copy of the GNU General Public License
+along with 12to11.  If not, see <https://www.gnu.org/licenses/>.  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../compositor.h"
+
+/* convert_test -- check the pixel format conversion kernels in
+   pixel_conversion.c, which it links with, against a scalar
+   reference written from the definitions of each format.  Every
+   format is converted at a range of unaligned offsets, and with
+   widths that are not multiples of the vector size, so that both the
+   vector loops and the scalar tails are exercised.  Unlike the other
+   tests, it does not need a running compositor.  */
+
+/* The size of the source buffer.  The width must be even, so that
+   the chroma planes of YUV420 are exactly half as wide.  */
+#define BUFFER_WIDTH 68
+#define BUFFER_HEIGHT 9
+
+/* Offsets and widths tried.  The vector size of the kernels is 8
+   pixels, so this covers every alignment of the start and end of a
+   row.  */
+#define MAX_X 9
+#define MAX_Y 3
+#define MAX_WIDTH 35
+
+/* Number of differences printed before giving up on a format.  */
+#define MAX_ERRORS 8
+
+static unsigned char *source_data;
+static size_t offsets[3], strides[3];
+
+static uint32_t
+Load32 (int plane, int x, int y)
+{
+  uint32_t pixel;
+
+  memcpy (&pixel, (source_data + offsets[plane] + y * strides[plane]
+		   + x * 4), sizeof pixel);
+  return pixel;
+}
+
+static uint32_t
+Load16 (int x, int y)
+{
+  uint16_t pixel;
+
+  memcpy (&pixel, source_data + offsets[0] + y * strides[0] + x * 2,
+	  sizeof pixel);
+  return pixel;
+}
+
+static uint32_t
+Sample (int plane, int x, int y)
+{
+  return source_data[offsets[plane] + y * strides[plane] + x];
+}
+
+static int
+Clamp (int value)
+{
+  return value < 0 ? 0 : (value > 255 ? 255 : value);
+}
+
+static uint32_t
+Pack (uint32_t a, uint32_t r, uint32_t g, uint32_t b)
+{
+  return (a << 24) | (r << 16) | (g << 8) | b;
+}
+
+static uint32_t
+ReferenceYuv (int luma, int u, int v)
+{
+  int c, d, e;
+
+  /* BT.601, limited range, in 8 bit fixed point with rounding.  */
+  c = (luma - 16) * 298 + 128;
+  d = u - 128;
+  e = v - 128;
+
+  return Pack (0xff, Clamp ((c + 409 * e) >> 8),
+	       Clamp ((c - 100 * d - 208 * e) >> 8),
+	       Clamp ((c + 516 * d) >> 8));
+}
+
+static uint32_t
+Reference (uint32_t format, int x, int y)
+{
+  uint32_t p, r, g, b;
+
+  switch (format)
+    {
+    case WL_SHM_FORMAT_ABGR8888:
+      p = Load32 (0, x, y);
+      return Pack (p >> 24, p & 0xff, (p >> 8) & 0xff, (p >> 16) & 0xff);
+
+    case WL_SHM_FORMAT_XBGR8888:
+      p = Load32 (0, x, y);
+      return Pack (0xff, p & 0xff, (p >> 8) & 0xff, (p >> 16) & 0xff);
+
+    case WL_SHM_FORMAT_RGB565:
+      p = Load16 (x, y);
+      r = (p >> 11) & 0x1f;
+      g = (p >> 5) & 0x3f;
+      b = p & 0x1f;
+
+      /* The high bits are replicated into the low bits.  */
+      return Pack (0xff, (r << 3) | (r >> 2), (g << 2) | (g >> 4),
+		   (b << 3) | (b >> 2));
+
+    case WL_SHM_FORMAT_ARGB2101010:
+      p = Load32 (0, x, y);
+      return Pack ((p >> 30) * 0x55, ((p >> 20) & 0x3ff) >> 2,
+		   ((p >> 10) & 0x3ff) >> 2, (p & 0x3ff) >> 2);
+
+    case WL_SHM_FORMAT_XRGB2101010:
+      p = Load32 (0, x, y);
+      return Pack (0xff, ((p >> 20) & 0x3ff) >> 2,
+		   ((p >> 10) & 0x3ff) >> 2, (p & 0x3ff) >> 2);
+
+    case WL_SHM_FORMAT_ABGR2101010:
+      p = Load32 (0, x, y);
+      return Pack ((p >> 30) * 0x55, (p & 0x3ff) >> 2,
+		   ((p >> 10) & 0x3ff) >> 2, ((p >> 20) & 0x3ff) >> 2);
+
+    case WL_SHM_FORMAT_XBGR2101010:
+      p = Load32 (0, x, y);
+      return Pack (0xff, (p & 0x3ff) >> 2,
+		   ((p >> 10) & 0x3ff) >> 2, ((p >> 20) & 0x3ff) >> 2);
+
+    case WL_SHM_FORMAT_NV12:
+      /* U and V are interleaved in the second plane.  */
+      return ReferenceYuv (Sample (0, x, y),
+			   Sample (1, x / 2 * 2, y / 2),
+			   Sample (1, x / 2 * 2 + 1, y / 2));
+
+    case WL_SHM_FORMAT_YUV420:
+      return ReferenceYuv (Sample (0, x, y), Sample (1, x / 2, y / 2),
+			   Sample (2, x / 2, y / 2));
+    }
+
+  fprintf (stderr, "no reference for format %08x\n", format);
+  abort ();
+}
+
+static int
+TestFormat (uint32_t format)
+{
+  int bpp, n_planes, plane, x, y, width, height, i, j, errors;
+  uint32_t *dst, expected;
+  ConversionSource source;
+  size_t size, dst_stride;
+
+  if (!GetConversionFormatInfo (format, &bpp, &n_planes, NULL)
+      || !GetShmConversionLayout (format, BUFFER_WIDTH * bpp / 8,
+				  BUFFER_HEIGHT, offsets, strides,
+				  &size))
+    abort ();
+
+  source_data = malloc (size);
+
+  /* One pixel more than necessary is allocated on each row, to catch
+     writes past the end of the rectangle.  */
+  dst_stride = (MAX_WIDTH + 1) * 4;
+  dst = malloc (dst_stride * BUFFER_HEIGHT);
+
+  if (!source_data || !dst)
+    abort ();
+
+  for (i = 0; i < size; ++i)
+    source_data[i] = random ();
+
+  for (plane = 0; plane < n_planes; ++plane)
+    {
+      source.planes[plane] = source_data + offsets[plane];
+      source.strides[plane] = strides[plane];
+    }
+
+  errors = 0;
+  height = BUFFER_HEIGHT - MAX_Y;
+
+  for (y = 0; y < MAX_Y; ++y)
+    {
+      for (x = 0; x < MAX_X; ++x)
+	{
+	  for (width = 1; width <= MAX_WIDTH; ++width)
+	    {
+	      memset (dst, 0x5a, dst_stride * BUFFER_HEIGHT);
+	      ConvertPixels (format, &source, x, y, dst, dst_stride,
+			     width, height);
+
+	      for (j = 0; j < height; ++j)
+		{
+		  for (i = 0; i <= width; ++i)
+		    {
+		      /* The pixel after the rectangle must not have
+			 been touched.  */
+		      expected = (i < width
+				  ? Reference (format, x + i, y + j)
+				  : 0x5a5a5a5a);
+
+		      if (dst[j * (MAX_WIDTH + 1) + i] == expected)
+			continue;
+
+		      fprintf (stderr, "%c%c%c%c: x %d, y %d, width %d:"
+			       " pixel %d, %d is %08x, not %08x\n",
+			       format & 0xff, (format >> 8) & 0xff,
+			       (format >> 16) & 0xff, format >> 24,
+			       x, y, width, i, j,
+			       dst[j * (MAX_WIDTH + 1) + i], expected);
+
+		      if (++errors == MAX_ERRORS)
+			goto done;
+		    }
+		}
+	    }
+	}
+    }
+
+ done:
+  free (source_data);
+  free (dst);
+
+  return errors;
+}
+
+int
+main (int argc, char **argv)
+{
+  int n, failed;
+  uint32_t format;
+
+  printf ("Testing %s kernels\n", GetConversionKernelName ());
+  failed = 0;
+
+  for (n = 0; (format = GetConversionFormat (n)); ++n)
+    {
+      if (TestFormat (format))
+	failed++;
+      else
+	printf ("%c%c%c%c: ok\n", format & 0xff, (format >> 8) & 0xff,
+		(format >> 16) & 0xff, format >> 24);
+    }
+
+  if (failed)
+    {
+      fprintf (stderr, "%d formats failed\n", failed);
+      return 1;
+    }
+
+  return 0;
+}
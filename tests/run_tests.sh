@@ -26,7 +26,17 @@ declare -a standard_tests=(
     tearing_control_test
 )
 
-make -C . "${standard_tests[@]}"
+make -C . "${standard_tests[@]}" convert_test
+
+# This test checks the pixel conversion code directly, and does not
+# need a compositor.
+echo "Running test convert_test"
+
+if ./convert_test; then
+    echo "convert_test completed successfully"
+else
+    echo "convert_test failed; see its output for more details"
+fi
 
 export GLOBAL_SCALE=1
 export OUTPUT_SCALE=1
@@ -20,15 +20,57 @@ along with 12to11.  If not, see <https://www.gnu.org/licenses/>.  */
 /* Some of this file was taken from timespec-add.c and timespec-sub.c,
    part of gnulib, written by Paul Eggert <eggert@cs.ucla.edu>.  */
 
+#include <sys/timerfd.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
 #include "compositor.h"
 
-/* Linked list of all timers.  */
-static Timer all_timers;
+/* Binary min-heap of all timers, ordered by next_time.  */
+static Timer **timer_heap;
+
+/* The number of timers in that heap, and the number of elements
+   allocated.  */
+static int n_timers, timer_heap_size;
+
+/* Serial number of the current call to TimerCheck.  */
+static unsigned int check_serial;
+
+/* Timers that are still expired after being run by the current call
+   to TimerCheck, and were taken off the heap so that they do not
+   hide other expired timers.  They are put back once it returns.  */
+static Timer **deferred_timers;
+
+/* The number of those timers, and the number of elements
+   allocated.  */
+static int n_deferred_timers, deferred_timers_size;
+
+/* If timers are driven by a timerfd, the timerfd armed for the
+   earliest timer deadline, or -1.  */
+static int timer_fd;
+
+/* The read fd record used to wait for that timerfd.  */
+static ReadFd *timer_read_fd;
+
+/* The deadline the timerfd is currently armed for, and whether or
+   not it is armed at all.  */
+static struct timespec timer_fd_deadline;
+static Bool timer_fd_armed;
+
+/* Whether or not to print how late each timer is run.  */
+static Bool debug_timer_jitter;
 
 struct _Timer
 {
-  /* The next and last timers in this list.  */
-  Timer *next, *last;
+  /* The index of this timer in the timer heap, or -1 if it is in
+     deferred_timers.  */
+  int heap_index;
+
+  /* The value of check_serial when this timer was last run.  */
+  unsigned int run_serial;
 
   /* The repeat of this timer.  */
   struct timespec repeat;
@@ -43,6 +85,9 @@ struct _Timer
   void *timer_data;
 };
 
+/* Slab from which timers are allocated.  */
+static XLSlab timer_slab = XLSlabInitializer (Timer);
+
 struct timespec
 CurrentTimespec (void)
 {
@@ -152,25 +197,109 @@ TimespecSub (struct timespec a, struct timespec b)
   return MakeTimespec (rs, rns);
 }
 
+static void
+SwapTimers (int a, int b)
+{
+  Timer *temp;
+
+  temp = timer_heap[a];
+  timer_heap[a] = timer_heap[b];
+  timer_heap[b] = temp;
+
+  timer_heap[a]->heap_index = a;
+  timer_heap[b]->heap_index = b;
+}
+
+static Bool
+TimerEarlier (int a, int b)
+{
+  return TimespecCmp (timer_heap[a]->next_time,
+		      timer_heap[b]->next_time) < 0;
+}
+
+static void
+SiftUp (int index)
+{
+  int parent;
+
+  while (index > 0)
+    {
+      parent = (index - 1) / 2;
+
+      if (!TimerEarlier (index, parent))
+	break;
+
+      SwapTimers (index, parent);
+      index = parent;
+    }
+}
+
+static void
+SiftDown (int index)
+{
+  int child, smallest;
+
+  while (True)
+    {
+      smallest = index;
+      child = index * 2 + 1;
+
+      if (child < n_timers && TimerEarlier (child, smallest))
+	smallest = child;
+
+      if (child + 1 < n_timers && TimerEarlier (child + 1, smallest))
+	smallest = child + 1;
+
+      if (smallest == index)
+	break;
+
+      SwapTimers (index, smallest);
+      index = smallest;
+    }
+}
+
+static void
+RestoreHeap (int index)
+{
+  /* Move the timer at index to where it belongs after its next_time
+     changed.  */
+  if (index > 0 && TimerEarlier (index, (index - 1) / 2))
+    SiftUp (index);
+  else
+    SiftDown (index);
+}
+
+static void
+InsertTimer (Timer *timer)
+{
+  if (n_timers == timer_heap_size)
+    {
+      timer_heap_size = MAX (16, timer_heap_size * 2);
+      timer_heap = XLRealloc (timer_heap,
+			      sizeof *timer_heap * timer_heap_size);
+    }
+
+  timer->heap_index = n_timers++;
+  timer->run_serial = check_serial;
+  timer_heap[timer->heap_index] = timer;
+  SiftUp (timer->heap_index);
+}
+
 Timer *
 AddTimer (void (*function) (Timer *, void *, struct timespec),
 	  void *data, struct timespec delay)
 {
   Timer *timer;
 
-  timer = XLMalloc (sizeof *timer);
+  timer = XLSlabAlloc (&timer_slab);
   timer->function = function;
   timer->timer_data = data;
   timer->repeat = delay;
   timer->next_time = TimespecAdd (CurrentTimespec (),
 				  delay);
 
-  /* Chain the timer onto our list of timers.  */
-  timer->next = all_timers.next;
-  timer->last = &all_timers;
-
-  all_timers.next->last = timer;
-  all_timers.next = timer;
+  /* Insert the timer into the heap of timers.  */
+  InsertTimer (timer);
 
   return timer;
 }
@@ -181,32 +310,76 @@ AddTimerWithBaseTime (void (*function) (Timer *, void *, struct timespec),
 {
   Timer *timer;
 
-  timer = XLMalloc (sizeof *timer);
+  timer = XLSlabAlloc (&timer_slab);
   timer->function = function;
   timer->timer_data = data;
   timer->repeat = delay;
   timer->next_time = TimespecAdd (base, delay);
 
-  /* Chain the timer onto our list of timers.  */
-  timer->next = all_timers.next;
-  timer->last = &all_timers;
-
-  all_timers.next->last = timer;
-  all_timers.next = timer;
+  /* Insert the timer into the heap of timers.  */
+  InsertTimer (timer);
 
   return timer;
 }
 
+static void
+UnlinkTimer (Timer *timer)
+{
+  int index;
+
+  /* Remove the timer from the heap of timers, by moving the last
+     timer into its place.  This is safe both inside a timer callback
+     and outside TimerCheck, since TimerCheck always looks at the top
+     of the heap afresh.  */
+  index = timer->heap_index;
+  n_timers--;
+
+  if (index != n_timers)
+    {
+      timer_heap[index] = timer_heap[n_timers];
+      timer_heap[index]->heap_index = index;
+      RestoreHeap (index);
+    }
+}
+
+static void
+DeferTimer (Timer *timer)
+{
+  /* Take TIMER off the heap until the current call to TimerCheck
+     returns.  */
+  UnlinkTimer (timer);
+
+  if (n_deferred_timers == deferred_timers_size)
+    {
+      deferred_timers_size = MAX (16, deferred_timers_size * 2);
+      deferred_timers = XLRealloc (deferred_timers,
+				   (sizeof *deferred_timers
+				    * deferred_timers_size));
+    }
+
+  timer->heap_index = -1;
+  deferred_timers[n_deferred_timers++] = timer;
+}
+
 void
 RemoveTimer (Timer *timer)
 {
-  /* Start by removing the timer from the list of timers.  This is
-     only safe inside a timer callback our outside TimerCheck.  */
-  timer->next->last = timer->last;
-  timer->last->next = timer->next;
+  int i;
+
+  if (timer->heap_index != -1)
+    UnlinkTimer (timer);
+  else
+    {
+      /* The timer was deferred by TimerCheck, which is running the
+	 callback that removed it.  */
+      for (i = 0; deferred_timers[i] != timer; ++i)
+	/* Look for the timer.  */;
+
+      deferred_timers[i] = deferred_timers[--n_deferred_timers];
+    }
 
   /* Then, free the timer.  */
-  XLFree (timer);
+  XLSlabFree (&timer_slab, timer);
 }
 
 void
@@ -214,55 +387,169 @@ RetimeTimer (Timer *timer)
 {
   timer->next_time = TimespecAdd (CurrentTimespec (),
 				  timer->repeat);
+
+  /* A deferred timer is put back into the heap by TimerCheck.  */
+  if (timer->heap_index != -1)
+    RestoreHeap (timer->heap_index);
+}
+
+static void
+HandleTimerFdReadable (int fd, void *data, ReadFd *readfd)
+{
+  uint64_t expirations;
+
+  /* Read the number of expirations to clear the readiness of the
+     timerfd.  The timers themselves are run by TimerCheck at the
+     start of the next iteration of the event loop.  */
+  if (read (fd, &expirations, sizeof expirations) == -1
+      && errno != EAGAIN)
+    perror ("read");
+}
+
+static void
+ArmTimerFd (void)
+{
+  struct itimerspec spec;
+
+  if (!timer_read_fd)
+    /* The event loop must be running by the time TimerCheck is
+       called, so the timerfd can be registered now.  */
+    timer_read_fd = XLAddReadFd (timer_fd, NULL,
+				 HandleTimerFdReadable);
+
+  memset (&spec, 0, sizeof spec);
+
+  if (n_timers)
+    {
+      /* Avoid re-arming the timerfd if the deadline did not
+	 change.  */
+      if (timer_fd_armed
+	  && !TimespecCmp (timer_fd_deadline,
+			   timer_heap[0]->next_time))
+	return;
+
+      spec.it_value = timer_heap[0]->next_time;
+      timer_fd_deadline = spec.it_value;
+      timer_fd_armed = True;
+    }
+  else
+    {
+      if (!timer_fd_armed)
+	return;
+
+      /* Disarm the timerfd; a zero it_value does that.  */
+      timer_fd_armed = False;
+    }
+
+  if (timerfd_settime (timer_fd, TFD_TIMER_ABSTIME, &spec, NULL))
+    {
+      perror ("timerfd_settime");
+      abort ();
+    }
+}
+
+static void
+NoteTimerLateness (Timer *timer, struct timespec now)
+{
+  struct timespec lateness;
+
+  lateness = TimespecSub (now, timer->next_time);
+  fprintf (stderr, "Timer %p ran %lld.%06ld ms late\n", timer,
+	   (long long) lateness.tv_sec * 1000 + lateness.tv_nsec / 1000000,
+	   lateness.tv_nsec % 1000000);
 }
 
 struct timespec
 TimerCheck (void)
 {
-  struct timespec now, wait, temp;
-  Timer *timer, *next;
-  Bool flag;
+  struct timespec now;
+  Timer *timer;
 
   now = CurrentTimespec ();
-  wait = MakeTimespec (TypeMaximum (time_t),
-		       1000000000 - 1);
-  timer = all_timers.next;
+  check_serial++;
+
+  /* Run every timer that has expired, earliest first.  Each timer is
+     run at most once per call, even if it is still expired after
+     being rescheduled.  Such timers, and those added by callbacks,
+     are set aside, so that they do not keep other expired timers
+     from running.  */
 
-  while (timer != &all_timers)
+  while (n_timers)
     {
-      /* Move the list forward first, so the timer callback can
-	 safely remove itself from the list.  */
-      next = timer->next;
-      flag = False;
+      timer = timer_heap[0];
+
+      if (TimespecCmp (timer->next_time, now) > 0)
+	break;
 
-      if (TimespecCmp (timer->next_time, now) <= 0)
+      if (timer->run_serial == check_serial)
 	{
-	  timer->next_time = TimespecAdd (timer->next_time,
-					  timer->repeat);
-	  flag = True;
+	  DeferTimer (timer);
+	  continue;
 	}
 
-      temp = TimespecSub (timer->next_time, now);
+      if (debug_timer_jitter)
+	NoteTimerLateness (timer, now);
 
-      if (TimespecCmp (temp, wait) < 0)
-	/* Wait is the time to wait until the next timer might
-	   fire.  */
-	wait = temp;
+      timer->next_time = TimespecAdd (timer->next_time,
+				      timer->repeat);
+      timer->run_serial = check_serial;
+      SiftDown (0);
 
-      if (flag)
-	/* Run this function here instead, since it might remove the
-	   timer from the list.  */
-	timer->function (timer, timer->timer_data, now);
+      /* Run this function last, since it might remove the timer from
+	 the heap.  */
+      timer->function (timer, timer->timer_data, now);
+    }
+
+  /* Put the timers that were set aside back into the heap.  */
+  while (n_deferred_timers)
+    InsertTimer (deferred_timers[--n_deferred_timers]);
+
+  if (timer_fd != -1)
+    {
+      /* Arm the timerfd for the earliest deadline.  The event loop
+	 will then be woken by the timerfd becoming readable, so it
+	 does not have to time out by itself.  */
+      ArmTimerFd ();
 
-      timer = next;
+      if (n_timers
+	  && TimespecCmp (timer_heap[0]->next_time, now) <= 0)
+	return MakeTimespec (0, 0);
+
+      return MakeTimespec (TypeMaximum (time_t),
+			   1000000000 - 1);
     }
 
-  return wait;
+  if (!n_timers)
+    return MakeTimespec (TypeMaximum (time_t),
+			 1000000000 - 1);
+
+  /* Wait is the time to wait until the next timer might fire.  */
+
+  if (TimespecCmp (timer_heap[0]->next_time, now) <= 0)
+    return MakeTimespec (0, 0);
+
+  return TimespecSub (timer_heap[0]->next_time, now);
 }
 
 void
 XLInitTimers (void)
 {
-  all_timers.next = &all_timers;
-  all_timers.last = &all_timers;
+  /* The heap is allocated on demand.  */
+  timer_heap = NULL;
+  n_timers = 0;
+  timer_heap_size = 0;
+  timer_fd = -1;
+
+  if (getenv ("DEBUG_TIMER_JITTER"))
+    debug_timer_jitter = True;
+
+  if (getenv ("USE_TIMERFD"))
+    {
+      /* Drive timers with a timerfd instead of the poll timeout.  */
+      timer_fd = timerfd_create (CLOCK_MONOTONIC,
+				 TFD_NONBLOCK | TFD_CLOEXEC);
+
+      if (timer_fd == -1)
+	perror ("timerfd_create");
+    }
 }
@@ -21,6 +21,7 @@ along with 12to11.  If not, see <https://www.gnu.org/licenses/>.  */
 
 #include <string.h>
 #include <stdio.h>
+#include <math.h>
 
 #include "compositor.h"
 
@@ -388,3 +389,44 @@ InvertTransform (BufferTransform transform)
       return transform;
     }
 }
+
+void
+ReverseTransformToBox (DrawParams *params, pixman_box32_t *box)
+{
+  double x_factor, y_factor;
+
+  if (!params)
+    return;
+
+  /* Apply the inverse of PARAMS to BOX, for use in damage
+     tracking.  */
+
+  if (params->flags & ScaleSet)
+    {
+      box->x1 = floor (box->x1 / params->scale);
+      box->y1 = floor (box->y1 / params->scale);
+      box->x2 = ceil (box->x2 / params->scale);
+      box->y2 = ceil (box->y2 / params->scale);
+    }
+
+  if (params->flags & OffsetSet)
+    {
+      /* Since the offset can be a fractional value, also try to
+	 include as much as possible in the box.  */
+      box->x1 = floor (box->x1 + params->off_x);
+      box->y1 = floor (box->y1 + params->off_y);
+      box->x2 = ceil (box->x2 + params->off_x);
+      box->y2 = ceil (box->y2 + params->off_y);
+    }
+
+  if (params->flags & StretchSet)
+    {
+      x_factor = params->crop_width / params->stretch_width;
+      y_factor = params->crop_height / params->stretch_height;
+
+      box->x1 = floor (box->x1 * x_factor);
+      box->y1 = floor (box->y1 * y_factor);
+      box->x2 = ceil (box->x2 * x_factor);
+      box->y2 = ceil (box->y2 * y_factor);
+    }
+}